@@ -34,6 +34,7 @@ public:
     {
         StringVec install;
         StringVec uninstall;
+        std::string traceFile;
         bool update;
         bool print;
         bool help;
@@ -60,6 +61,8 @@ public:
                "\nGeneral commands:"
                "\n  -help           Print help"
                "\n  -logfile        Log file path"
+               "\n  -trace          Write a Chrome trace of all work to this file"
+               "\n  -metrics-file   Write Prometheus metrics to this file"
                "\n"
                "\nServer commands:"
                "\n  -endpoint       HTTP server endpoint"
@@ -112,6 +115,11 @@ public:
                 options.update = true;
             } else if (key == "print") {
                 options.print = true;
+            } else if (key == "trace") {
+                options.traceFile = value;
+                manager.setTracer(std::make_shared<pacm::Tracer>());
+            } else if (key == "metrics-file") {
+                manager.mutableOptions().metricsFile = value;
             } else if (key == "logfile") {
                 auto log = dynamic_cast<FileChannel*>(
                     icy::Logger::instance().get("Pacm"));
@@ -124,73 +132,114 @@ public:
 
     void work()
     {
+        // Print help
+        if (options.help) {
+            printHelp();
+            return;
+        }
+
+        // All commands run in sequence from one coroutine, so the
+        // event loop only needs to be run once.
+        auto commands = runCommands();
+        commands.start();
+        icy::Application::run();
         try {
-            // Print help
-            if (options.help) {
-                printHelp();
-                return;
-            }
+            commands.get();
+        } catch (std::exception& exc) {
+            cerr << "Pacm runtime error: " << exc.what() << endl;
+        }
 
-            // Initialize Pacman and query remote packages from the server
-            manager.initialize();
-            manager.queryRemotePackages();
-            icy::Application::run();
-            if (!manager.initialized()) {
-                cerr << "Package manager failed to initialize" << endl;
-                return;
+        if (auto tracer = manager.tracer()) {
+            try {
+                tracer->writeFile(options.traceFile);
+                cout << "# Trace written: " << options.traceFile << endl;
+            } catch (std::exception& exc) {
+                cerr << "Cannot write trace: " << exc.what() << endl;
             }
+        }
+    }
 
-            // Uninstall packages if requested
-            if (!options.uninstall.empty()) {
-                cout << "# Uninstall packages: " << options.install.size()
-                     << endl;
-                manager.uninstallPackages(options.uninstall);
-                icy::Application::run();
-            }
+    pacm::Async<> runCommands()
+    {
+        // Initialize Pacman and query remote packages from the server
+        manager.initialize();
+        co_await manager.queryRemote();
+        if (!manager.initialized()) {
+            cerr << "Package manager failed to initialize" << endl;
+            co_return;
+        }
 
-            // Install packages if requested
-            if (!options.install.empty()) {
-                cout << "# Install packages: " << options.install.size()
-                     << endl;
-                manager.installPackages(options.install);
-                icy::Application::run();
-            }
+        // Uninstall packages if requested
+        if (!options.uninstall.empty()) {
+            cout << "# Uninstall packages: " << options.uninstall.size()
+                 << endl;
+            co_await manager.uninstall(options.uninstall);
+        }
 
-            // Update all packages if requested
-            if (options.update) {
-                cout << "# Update all packages" << endl;
-                manager.updateAllPackages();
-                icy::Application::run();
+        // Install packages if requested. Each install brings in its
+        // dependencies, and the tasks are all scheduled before the first
+        // one is awaited, so they run concurrently up to the limit.
+        if (!options.install.empty()) {
+            cout << "# Install packages: " << options.install.size()
+                 << endl;
+            std::vector<pacm::InstallAwaiter> installs;
+            for (const auto& id : options.install) {
+                try {
+                    installs.push_back(manager.install(id));
+                } catch (std::exception& exc) {
+                    cerr << "Cannot install " << id << ": " << exc.what() << endl;
+                }
             }
+            for (auto& install : installs)
+                co_await install;
+        }
 
-            // Print packages to stdout
-            if (options.print) {
-                cout << "# Print packages" << endl;
-
-                // Print local packages
-                {
-                    cout << "Local packages: " << manager.localPackages().size()
-                         << endl;
-                    for (auto& kv : manager.localPackages().map()) {
-                        cout << "  - " << kv.first
-                             << ": version=" << kv.second->version()
-                             << ", state=" << kv.second->state() << endl;
-                    }
+        // Update all packages if requested
+        if (options.update) {
+            cout << "# Update all packages" << endl;
+            std::vector<pacm::InstallAwaiter> updates;
+            for (auto& pair : manager.getUpdatablePackagePairs()) {
+                try {
+                    updates.push_back(manager.update(pair.id()));
+                } catch (std::exception& exc) {
+                    cerr << "Cannot update " << pair.id() << ": " << exc.what() << endl;
                 }
+            }
+            for (auto& update : updates)
+                co_await update;
+        }
 
-                // Print remote packages
-                {
-                    cout << "Remote packages: "
-                         << manager.remotePackages().size() << endl;
-                    for (auto& kv : manager.remotePackages().map()) {
-                        cout << "  - " << kv.first << ": version="
-                             << kv.second->latestAsset().version()
-                             << ", author=" << kv.second->author() << endl;
-                    }
-                }
+        printPackages();
+    }
+
+    void printPackages()
+    {
+        // Print packages to stdout
+        if (!options.print)
+            return;
+
+        cout << "# Print packages" << endl;
+
+        // Print local packages
+        {
+            cout << "Local packages: " << manager.localPackages().size()
+                 << endl;
+            for (auto& kv : manager.localPackages().map()) {
+                cout << "  - " << kv.first
+                     << ": version=" << kv.second->version()
+                     << ", state=" << kv.second->state() << endl;
+            }
+        }
+
+        // Print remote packages
+        {
+            cout << "Remote packages: "
+                 << manager.remotePackages().size() << endl;
+            for (auto& kv : manager.remotePackages().map()) {
+                cout << "  - " << kv.first << ": version="
+                     << kv.second->latestAsset().version()
+                     << ", author=" << kv.second->author() << endl;
             }
-        } catch (std::exception& exc) {
-            cerr << "Pacm runtime error: " << exc.what() << endl;
         }
     }
 };
@@ -0,0 +1,869 @@
+///
+//
+// icey
+// Copyright (c) 2005, icey <https://0state.com>
+//
+// SPDX-License-Identifier: LGPL-2.1+
+//
+/// @addtogroup pacm
+/// @{
+
+
+#include "icy/pacm/checksum.h"
+#include "icy/pacm/installmonitor.h"
+#include "icy/pacm/package.h"
+#include "icy/pacm/packagemanager.h"
+#include "icy/json/json.h"
+#include "icy/util.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+
+using namespace std;
+using namespace icy;
+
+
+// Benchmarks for the package manager, reported as JSON so that runs can
+// be compared across upgrades. Built when configured with
+// -DPACM_BUILD_BENCHMARKS=ON:
+//
+//     pacmbench [-o results.json] [-sizes 1000,10000,100000]
+//               [-packages 16] [-latency 0] [-bandwidth 0]
+//               [-files 10000,100000] [-fs-dirs <dir>,...]
+//               [-checksum-mb 1024] [suite...]
+//
+// Suites:
+//   index    Parse, pair and select assets from synthetic package indexes
+//   install  Download, extract and finalize generated archives served by
+//            a local HTTP server with the given latency (ms) and
+//            bandwidth (bytes per second, 0 for unlimited); POSIX only
+//   fs       Extract, finalize, verify and uninstall packages of many
+//            small files (-files 10000,100000) on each of the given
+//            filesystems (-fs-dirs /dev/shm,/var/tmp)
+//   checksum Hash a generated file of -checksum-mb MiB with SHA256 and
+//            with the parallel SHA256-TREE algorithm
+
+
+namespace {
+
+
+/// Collects timed measurements, each with the peak resident set size
+/// reached while it ran.
+class Bench
+{
+public:
+    /// Runs @p fn once and records its wall time, CPU time and peak RSS.
+    /// Returns the result, which the caller may add fields to before
+    /// measuring anything else.
+    json::Value& measure(const std::string& suite, const std::string& name,
+                         json::Value params, const std::function<void()>& fn)
+    {
+        resetPeakRss();
+        double cpu = cpuTime();
+        auto io = ioSyscalls();
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        auto ioAfter = ioSyscalls();
+
+        json::Value result = {{"suite", suite},
+                              {"name", name},
+                              {"params", std::move(params)},
+                              {"seconds", seconds},
+                              {"cpuSeconds", cpuTime() - cpu},
+                              {"peakRssBytes", peakRss()},
+                              {"readSyscalls", ioAfter.first - io.first},
+                              {"writeSyscalls", ioAfter.second - io.second}};
+        cerr << suite << "/" << name << " " << result["params"].dump() << ": "
+             << seconds * 1000 << "ms" << endl;
+        _results.push_back(std::move(result));
+        return _results.back();
+    }
+
+    json::Value toJson() const
+    {
+        return {{"results", _results}};
+    }
+
+protected:
+    /// Resets the peak RSS counter where the platform allows it, so each
+    /// measurement reports its own peak rather than the process peak.
+    static void resetPeakRss()
+    {
+#ifdef __linux__
+        std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+    }
+
+    /// Returns the read and write syscall counts of the process, where
+    /// the platform reports them.
+    static std::pair<uint64_t, uint64_t> ioSyscalls()
+    {
+        std::pair<uint64_t, uint64_t> counts{0, 0};
+#ifdef __linux__
+        std::ifstream io("/proc/self/io");
+        std::string key;
+        uint64_t value;
+        while (io >> key >> value) {
+            if (key == "syscr:")
+                counts.first = value;
+            else if (key == "syscw:")
+                counts.second = value;
+        }
+#endif
+        return counts;
+    }
+
+    /// Returns the user and system CPU time of the process in seconds.
+    static double cpuTime()
+    {
+#ifndef _WIN32
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+            return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                   usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+        }
+#endif
+        return 0;
+    }
+
+    static uint64_t peakRss()
+    {
+#ifdef __linux__
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, 6, "VmHWM:") == 0)
+                return std::stoull(line.substr(6)) * 1024;
+        }
+#endif
+#ifndef _WIN32
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+            return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+            return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+        }
+#endif
+        return 0;
+    }
+
+    json::Value _results = json::Value::array();
+};
+
+
+/// Returns a synthetic remote package with @p assets versions.
+/// Every package has an asset for SDK 2.0.0, and the newest asset
+/// targets SDK 3.0.0.
+json::Value makeRemotePackage(size_t index, size_t assets)
+{
+    std::string id = "package-" + std::to_string(index);
+    json::Value package = {{"id", id},
+                           {"name", "Package " + std::to_string(index)},
+                           {"type", "Plugin"},
+                           {"author", "Bench"},
+                           {"description", "Synthetic benchmark package"},
+                           {"assets", json::Value::array()}};
+    for (size_t i = 0; i < assets; i++) {
+        std::string version = "1." + std::to_string(i) + ".0";
+        std::string file = id + "-" + version + ".zip";
+        package["assets"].push_back(
+            {{"version", version},
+             {"sdk-version", i + 1 < assets || assets == 1 ? "2.0.0" : "3.0.0"},
+             {"platform", "linux"},
+             {"checksum", "0123456789abcdef0123456789abcdef"},
+             {"file-name", file},
+             {"file-size", 1024 * (i + 1)},
+             {"mirrors", {{{"url", "https://example.com/" + file}}}}});
+    }
+    return package;
+}
+
+
+/// Writes uncompressed zip archives, so archives of any shape can be
+/// generated without a compression library.
+class ZipWriter
+{
+public:
+    explicit ZipWriter(const std::string& path)
+        : _file(path, std::ios::out | std::ios::binary | std::ios::trunc)
+    {
+        if (!_file)
+            throw std::runtime_error("Cannot create archive: " + path);
+    }
+
+    /// Adds a directory entry; @p name must end with a slash.
+    void addDirectory(const std::string& name) { addEntry(name, std::string(), true); }
+
+    void addFile(const std::string& name, const std::string& data) { addEntry(name, data, false); }
+
+    /// Writes the central directory and closes the archive.
+    void close()
+    {
+        uint32_t offset = static_cast<uint32_t>(_file.tellp());
+        for (const auto& entry : _entries) {
+            put32(0x02014b50);
+            put16(20); // version made by
+            put16(20); // version needed
+            put16(0);  // flags
+            put16(0);  // stored
+            put16(0);  // time
+            put16(0x21); // date: 1980-01-01
+            put32(entry.crc);
+            put32(entry.size);
+            put32(entry.size);
+            put16(static_cast<uint16_t>(entry.name.size()));
+            put16(0); // extra
+            put16(0); // comment
+            put16(0); // disk
+            put16(0); // internal attributes
+            put32(entry.directory ? 0x10 : 0);
+            put32(entry.offset);
+            _file.write(entry.name.data(), entry.name.size());
+        }
+        uint32_t size = static_cast<uint32_t>(_file.tellp()) - offset;
+
+        // More than 65535 entries needs the zip64 end of central directory
+        uint16_t count = static_cast<uint16_t>(_entries.size());
+        if (_entries.size() > 0xfffe) {
+            uint64_t record = static_cast<uint64_t>(_file.tellp());
+            put32(0x06064b50);
+            put64(44); // size of the remaining record
+            put16(45); // version made by
+            put16(45); // version needed
+            put32(0);  // disk
+            put32(0);  // central directory disk
+            put64(_entries.size());
+            put64(_entries.size());
+            put64(size);
+            put64(offset);
+
+            put32(0x07064b50);
+            put32(0);
+            put64(record);
+            put32(1); // total disks
+            count = 0xffff;
+        }
+
+        put32(0x06054b50);
+        put16(0);
+        put16(0);
+        put16(count);
+        put16(count);
+        put32(size);
+        put32(offset);
+        put16(0);
+        _file.close();
+    }
+
+protected:
+    struct Entry
+    {
+        std::string name;
+        uint32_t crc;
+        uint32_t size;
+        uint32_t offset;
+        bool directory;
+    };
+
+    void addEntry(const std::string& name, const std::string& data, bool directory)
+    {
+        Entry entry{name, crc32(data), static_cast<uint32_t>(data.size()),
+                    static_cast<uint32_t>(_file.tellp()), directory};
+        put32(0x04034b50);
+        put16(20);
+        put16(0);
+        put16(0);
+        put16(0);
+        put16(0x21);
+        put32(entry.crc);
+        put32(entry.size);
+        put32(entry.size);
+        put16(static_cast<uint16_t>(name.size()));
+        put16(0);
+        _file.write(name.data(), name.size());
+        _file.write(data.data(), data.size());
+        _entries.push_back(std::move(entry));
+    }
+
+    static uint32_t crc32(const std::string& data)
+    {
+        static uint32_t table[256] = {0};
+        if (!table[1]) {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++)
+                    c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+                table[i] = c;
+            }
+        }
+        uint32_t crc = 0xffffffff;
+        for (unsigned char byte : data)
+            crc = table[(crc ^ byte) & 0xff] ^ (crc >> 8);
+        return crc ^ 0xffffffff;
+    }
+
+    void put16(uint16_t value)
+    {
+        char buf[2] = {static_cast<char>(value), static_cast<char>(value >> 8)};
+        _file.write(buf, 2);
+    }
+
+    void put32(uint32_t value)
+    {
+        put16(static_cast<uint16_t>(value));
+        put16(static_cast<uint16_t>(value >> 16));
+    }
+
+    void put64(uint64_t value)
+    {
+        put32(static_cast<uint32_t>(value));
+        put32(static_cast<uint32_t>(value >> 32));
+    }
+
+    std::ofstream _file;
+    std::vector<Entry> _entries;
+};
+
+
+/// Writes a zip archive of @p files files of @p fileSize bytes, spread
+/// over nested directories of up to 100 files each.
+void writeArchive(const std::string& path, size_t files, size_t fileSize)
+{
+    ZipWriter zip(path);
+    std::string data(fileSize, '\0');
+    for (size_t i = 0; i < fileSize; i++)
+        data[i] = static_cast<char>('a' + (i * 7) % 26);
+
+    std::string dir;
+    for (size_t i = 0; i < files; i++) {
+        if (i % 100 == 0) {
+            dir = "data/" + std::to_string(i / 10000) + "/" + std::to_string(i / 100) + "/";
+            if (i == 0)
+                zip.addDirectory("data/");
+            if (i % 10000 == 0)
+                zip.addDirectory("data/" + std::to_string(i / 10000) + "/");
+            zip.addDirectory(dir);
+        }
+        zip.addFile(dir + "file" + std::to_string(i) + ".bin", data);
+    }
+    zip.close();
+}
+
+
+#ifndef _WIN32
+
+/// Minimal HTTP/1.1 file server on the loopback interface, run on its
+/// own threads so it never competes with the event loop under test.
+/// Each response waits @p latency before the headers and is throttled
+/// to @p bandwidth bytes per second.
+class ArchiveServer
+{
+public:
+    ArchiveServer(const std::string& root, std::chrono::milliseconds latency, uint64_t bandwidth)
+        : _root(root)
+        , _latency(latency)
+        , _bandwidth(bandwidth)
+        , _stopping(false)
+    {
+        _socket = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        socklen_t len = sizeof(addr);
+        if (_socket < 0 || ::bind(_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            ::listen(_socket, 128) != 0 ||
+            ::getsockname(_socket, reinterpret_cast<sockaddr*>(&addr), &len) != 0)
+            throw std::runtime_error("Cannot start archive server");
+        _port = ntohs(addr.sin_port);
+        _thread = std::thread(&ArchiveServer::acceptLoop, this);
+    }
+
+    ~ArchiveServer()
+    {
+        _stopping = true;
+        ::shutdown(_socket, SHUT_RDWR);
+        ::close(_socket);
+        _thread.join();
+        for (auto& thread : _connections)
+            thread.join();
+    }
+
+    uint16_t port() const { return _port; }
+
+protected:
+    void acceptLoop()
+    {
+        while (!_stopping) {
+            int fd = ::accept(_socket, nullptr, nullptr);
+            if (fd < 0)
+                break;
+            _connections.emplace_back(&ArchiveServer::serve, this, fd);
+        }
+    }
+
+    void serve(int fd)
+    {
+        std::string request;
+        char buf[4096];
+        while (request.find("\r\n\r\n") == std::string::npos) {
+            ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) {
+                ::close(fd);
+                return;
+            }
+            request.append(buf, n);
+        }
+
+        // GET /<file> HTTP/1.1
+        size_t start = request.find(' ') + 2;
+        std::string name = request.substr(start, request.find(' ', start) - start);
+        std::ifstream file(fs::makePath(_root, name), std::ios::in | std::ios::binary);
+        std::this_thread::sleep_for(_latency);
+
+        if (name.find('/') != std::string::npos || !file) {
+            send(fd, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+            ::close(fd);
+            return;
+        }
+
+        file.seekg(0, std::ios::end);
+        uint64_t size = static_cast<uint64_t>(file.tellg());
+        file.seekg(0);
+        send(fd, "HTTP/1.1 200 OK\r\nContent-Type: application/zip\r\nContent-Length: " +
+                     std::to_string(size) + "\r\nConnection: close\r\n\r\n");
+
+        auto began = std::chrono::steady_clock::now();
+        uint64_t sent = 0;
+        std::vector<char> chunk(64 * 1024);
+        while (file.read(chunk.data(), chunk.size()) || file.gcount() > 0) {
+            if (!send(fd, std::string(chunk.data(), static_cast<size_t>(file.gcount()))))
+                break;
+            sent += static_cast<uint64_t>(file.gcount());
+            if (_bandwidth > 0)
+                std::this_thread::sleep_until(began + std::chrono::microseconds(sent * 1000000 / _bandwidth));
+        }
+        ::close(fd);
+    }
+
+    static bool send(int fd, const std::string& data)
+    {
+        size_t offset = 0;
+        while (offset < data.size()) {
+            ssize_t n = ::send(fd, data.data() + offset, data.size() - offset, MSG_NOSIGNAL);
+            if (n <= 0)
+                return false;
+            offset += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    std::string _root;
+    std::chrono::milliseconds _latency;
+    uint64_t _bandwidth;
+    std::atomic<bool> _stopping;
+    int _socket;
+    uint16_t _port;
+    std::thread _thread;
+    std::vector<std::thread> _connections;
+};
+
+#endif
+
+
+void runIndexSuite(Bench& bench, const std::vector<size_t>& sizes)
+{
+    for (size_t size : sizes) {
+        // Asset counts vary from 1 to 8 per package
+        json::Value index = json::Value::array();
+        size_t assets = 0;
+        for (size_t i = 0; i < size; i++) {
+            index.push_back(makeRemotePackage(i, i % 8 + 1));
+            assets += i % 8 + 1;
+        }
+        std::string data = index.dump();
+        json::Value params = {{"packages", size}, {"assets", assets}, {"bytes", data.size()}};
+
+        auto root = std::filesystem::temp_directory_path() / "pacm-bench-index";
+        std::filesystem::remove_all(root);
+        pacm::PackageManager manager(pacm::PackageManager::Options(root.string()));
+        manager.createDirectories();
+
+        bench.measure("index", "parseRemotePackages", params,
+                      [&]() { manager.parseRemotePackages(data); });
+
+        // Every package is installed at its oldest version, so every
+        // package with more than one asset is updatable.
+        for (auto& [id, remote] : manager.remotePackages()) {
+            pacm::LocalPackage local(*remote);
+            local.setState("Installed");
+            local.setInstalledAsset(remote->assets().front());
+            json::saveFile(fs::makePath(manager.options().dataDir, id + ".json"), local, 0);
+        }
+
+        auto& loaded = bench.measure("index", "loadLocalPackages", params,
+                                     [&]() { manager.loadLocalPackages(); });
+        auto memory = manager.memoryStats();
+        loaded["indexBytes"] = memory.remote.totalBytes();
+        loaded["localBytes"] = memory.local.totalBytes();
+        loaded["snapshotBytes"] = memory.snapshotBytes;
+
+        size_t count = 0;
+        bench.measure("index", "getPackagePairs", params,
+                      [&]() { count = manager.getPackagePairs().size(); });
+        bench.measure("index", "getUpdatablePackagePairs", params,
+                      [&]() { count = manager.getUpdatablePackagePairs().size(); });
+
+        bench.measure("index", "latestAsset", params, [&]() {
+            for (auto& [id, remote] : manager.remotePackages())
+                count += remote->latestAsset().fileSize();
+        });
+        bench.measure("index", "latestSDKAsset", params, [&]() {
+            for (auto& [id, remote] : manager.remotePackages())
+                count += remote->latestSDKAsset("2.0.0").fileSize();
+        });
+
+        manager.uninitialize();
+        std::filesystem::remove_all(root);
+    }
+}
+
+
+#ifndef _WIN32
+
+/// Parameters of the install suite.
+struct InstallParams
+{
+    size_t packages = 16;
+    std::chrono::milliseconds latency{0};
+    uint64_t bandwidth = 0;
+};
+
+
+void runInstallSuite(Bench& bench, const InstallParams& params)
+{
+    auto root = std::filesystem::temp_directory_path() / "pacm-bench-install";
+    std::filesystem::remove_all(root);
+    auto served = root / "served";
+    std::filesystem::create_directories(served);
+
+    pacm::PackageManager manager(pacm::PackageManager::Options((root / "client").string()));
+    manager.createDirectories();
+    ArchiveServer server(served.string(), params.latency, params.bandwidth);
+
+    // Packages range from a few large files to many small ones
+    json::Value index = json::Value::array();
+    StringVec ids;
+    uint64_t totalBytes = 0;
+    size_t totalFiles = 0;
+    for (size_t i = 0; i < params.packages; i++) {
+        size_t files = size_t(8) << (i % 6);          // 8 - 256 files
+        size_t fileSize = size_t(1024) << (5 - i % 6); // 32 KiB - 1 KiB, then scaled
+        fileSize *= 1 + i % 3;
+
+        std::string id = "bench-" + std::to_string(i);
+        std::string fileName = id + "-1.0.0.zip";
+        std::string path = (served / fileName).string();
+        writeArchive(path, files, fileSize);
+
+        index.push_back({{"id", id},
+                         {"name", id},
+                         {"type", "Plugin"},
+                         {"author", "Bench"},
+                         {"description", "Synthetic install benchmark package"},
+                         {"assets",
+                          {{{"version", "1.0.0"},
+                            {"sdk-version", "1.0.0"},
+                            {"platform", manager.options().platform},
+                            {"checksum", pacm::checksumFile(manager.options().checksumAlgorithm, path)},
+                            {"file-name", fileName},
+                            {"file-size", std::filesystem::file_size(path)},
+                            {"mirrors",
+                             {{{"url", "http://127.0.0.1:" + std::to_string(server.port()) +
+                                           "/" + fileName}}}}}}}});
+        ids.push_back(id);
+        totalBytes += std::filesystem::file_size(path);
+        totalFiles += files;
+    }
+    manager.parseRemotePackages(index.dump());
+
+    // Per-stage totals across all tasks, from each task's InstallStats
+    std::map<std::string, double> stageSeconds;
+    std::map<std::string, double> stageMax;
+    size_t installed = 0;
+    double checksumSeconds = 0;
+    manager.InstallTaskComplete += [&](const pacm::InstallTask& task) {
+        auto stats = task.stats();
+        for (unsigned int state : {pacm::InstallationState::Downloading,
+                                   pacm::InstallationState::Extracting,
+                                   pacm::InstallationState::Finalizing}) {
+            std::string name = pacm::InstallationState().str(state);
+            double seconds = std::chrono::duration<double>(stats.stateTime(state)).count();
+            stageSeconds[name] += seconds;
+            stageMax[name] = std::max(stageMax[name], seconds);
+        }
+        checksumSeconds += std::chrono::duration<double>(stats.checksumTime).count();
+        if (task.success())
+            installed++;
+    };
+
+    json::Value info = {{"packages", params.packages},
+                        {"files", totalFiles},
+                        {"bytes", totalBytes},
+                        {"latencyMs", params.latency.count()},
+                        {"bandwidth", params.bandwidth}};
+    pacm::InstallMonitor monitor;
+    json::Value& result = bench.measure("install", "installPackages", info, [&]() {
+        manager.installPackages(ids, pacm::InstallOptions(), &monitor, true);
+        monitor.startAll();
+        uv_run(uv::defaultLoop(), UV_RUN_DEFAULT);
+    });
+
+    double seconds = result["seconds"].get<double>();
+    result["installed"] = installed;
+    result["bytesPerSecond"] = seconds > 0 ? totalBytes / seconds : 0;
+    result["filesPerSecond"] = seconds > 0 ? totalFiles / seconds : 0;
+    result["checksumSeconds"] = checksumSeconds;
+    for (const auto& [stage, total] : stageSeconds) {
+        result["stages"][stage] = {{"totalSeconds", total},
+                                   {"meanSeconds", total / params.packages},
+                                   {"maxSeconds", stageMax[stage]}};
+    }
+    if (installed != params.packages)
+        throw std::runtime_error("Only " + std::to_string(installed) + " of " +
+                                 std::to_string(params.packages) + " packages installed");
+
+    manager.uninitialize();
+    std::filesystem::remove_all(root);
+}
+
+#endif
+
+
+/// Measures the metadata-heavy install paths for packages of many
+/// small files: extraction, finalizing into a fresh and an existing
+/// install directory, manifest verification and uninstall.
+void runFilesystemSuite(Bench& bench, const std::vector<size_t>& fileCounts,
+                        const StringVec& dirs)
+{
+    for (const auto& dir : dirs) {
+        for (size_t files : fileCounts) {
+            auto root = std::filesystem::path(dir) / "pacm-bench-fs";
+            std::filesystem::remove_all(root);
+
+            pacm::PackageManager manager(pacm::PackageManager::Options(root.string()));
+            manager.createDirectories();
+
+            // No checksum, so extraction is measured on its own
+            std::string id = "bench-files";
+            std::string fileName = id + "-1.0.0.zip";
+            writeArchive(manager.getCacheFilePath(fileName), files, 64);
+            json::Value index = json::Value::array();
+            index.push_back({{"id", id},
+                             {"name", id},
+                             {"type", "Plugin"},
+                             {"author", "Bench"},
+                             {"description", "Synthetic filesystem benchmark package"},
+                             {"assets",
+                              {{{"version", "1.0.0"},
+                                {"platform", manager.options().platform},
+                                {"file-name", fileName},
+                                {"mirrors", {{{"url", "http://127.0.0.1/" + fileName}}}}}}}});
+            manager.parseRemotePackages(index.dump());
+            auto* remote = manager.remotePackages().get(id);
+
+            std::string installDir = (root / "install" / id).string();
+            manager.localPackages().tryAdd(id, std::make_unique<pacm::LocalPackage>(*remote));
+            auto* local = manager.localPackages().get(id);
+            local->setInstallDir(installDir);
+
+            pacm::InstallOptions options;
+            options.version = "1.0.0";
+            options.installDir = installDir;
+
+            json::Value params = {{"dir", dir}, {"files", files}};
+            auto perFile = [&](json::Value& result) {
+                result["secondsPerFile"] = result["seconds"].get<double>() / files;
+                result["syscallsPerFile"] =
+                    double(result["readSyscalls"].get<uint64_t>() +
+                           result["writeSyscalls"].get<uint64_t>()) /
+                    files;
+            };
+
+            {
+                pacm::InstallTask task(manager, local, remote, options);
+                perFile(bench.measure("fs", "doExtract", params, [&]() { task.doExtract(); }));
+                perFile(bench.measure("fs", "doFinalize", params, [&]() { task.doFinalize(); }));
+                local->setState("Installed");
+
+                // Verification results are only cached for directories
+                // which have not been modified in the last two seconds
+                std::this_thread::sleep_for(std::chrono::milliseconds(2500));
+                perFile(bench.measure("fs", "verifyInstallManifest", params, [&]() {
+                    local->verifyInstallManifest(false, &manager.workerPool());
+                }));
+                perFile(bench.measure("fs", "verifyInstallManifest (cached)", params,
+                                      [&]() { local->verifyInstallManifest(); }));
+
+                // Reinstalling replaces every file of the existing tree
+                task.doExtract();
+                perFile(bench.measure("fs", "doFinalize (replace)", params,
+                                      [&]() { task.doFinalize(); }));
+            }
+
+            perFile(bench.measure("fs", "uninstallPackage", params,
+                                  [&]() { manager.uninstallPackage(id, true); }));
+
+            manager.uninitialize();
+            std::filesystem::remove_all(root);
+        }
+    }
+}
+
+
+/// Measures archive verification throughput for each checksum algorithm.
+void runChecksumSuite(Bench& bench, size_t megabytes)
+{
+    auto path = std::filesystem::temp_directory_path() / "pacm-bench-checksum.bin";
+    {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        std::string block(1024 * 1024, '\0');
+        for (size_t i = 0; i < block.size(); i++)
+            block[i] = static_cast<char>((i * 7) % 251);
+        for (size_t i = 0; i < megabytes; i++)
+            file.write(block.data(), block.size());
+    }
+
+    pacm::WorkerPool pool;
+    size_t bytes = megabytes * 1024 * 1024;
+    auto run = [&](const std::string& algorithm, pacm::WorkerPool* workers) {
+        json::Value params = {{"algorithm", algorithm},
+                              {"bytes", bytes},
+                              {"threads", workers ? workers->size() + 1 : 1}};
+        auto& result = bench.measure("checksum", "checksumFile", params, [&]() {
+            pacm::checksumFile(algorithm, path.string(), workers);
+        });
+        result["bytesPerSecond"] = bytes / result["seconds"].get<double>();
+    };
+    run("SHA256", nullptr);
+    run(TREE_CHECKSUM_ALGORITHM, nullptr);
+    run(TREE_CHECKSUM_ALGORITHM, &pool);
+
+    std::filesystem::remove(path);
+}
+
+
+std::vector<size_t> parseSizes(const std::string& value)
+{
+    std::vector<size_t> sizes;
+    for (const auto& size : util::split(value, ","))
+        sizes.push_back(std::stoul(size));
+    return sizes;
+}
+
+
+} // namespace
+
+
+int main(int argc, char** argv)
+{
+    std::string output;
+    std::vector<size_t> sizes{1000, 10000, 100000};
+    std::vector<size_t> fileCounts{10000, 100000};
+    size_t checksumMegabytes = 1024;
+    StringVec dirs;
+#ifdef __linux__
+    if (std::filesystem::is_directory("/dev/shm"))
+        dirs.push_back("/dev/shm"); // tmpfs
+#endif
+    dirs.push_back(std::filesystem::temp_directory_path().string());
+#ifndef _WIN32
+    InstallParams install;
+#endif
+    std::vector<std::string> suites;
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        if (arg == "-o" && i + 1 < argc)
+            output = argv[++i];
+        else if (arg == "-sizes" && i + 1 < argc)
+            sizes = parseSizes(argv[++i]);
+        else if (arg == "-files" && i + 1 < argc)
+            fileCounts = parseSizes(argv[++i]);
+        else if (arg == "-fs-dirs" && i + 1 < argc)
+            dirs = util::split(argv[++i], ",");
+        else if (arg == "-checksum-mb" && i + 1 < argc)
+            checksumMegabytes = std::stoul(argv[++i]);
+#ifndef _WIN32
+        else if (arg == "-packages" && i + 1 < argc)
+            install.packages = std::stoul(argv[++i]);
+        else if (arg == "-latency" && i + 1 < argc)
+            install.latency = std::chrono::milliseconds(std::stoul(argv[++i]));
+        else if (arg == "-bandwidth" && i + 1 < argc)
+            install.bandwidth = std::stoull(argv[++i]);
+#endif
+        else
+            suites.push_back(arg);
+    }
+    if (suites.empty()) {
+        suites = {"index"};
+#ifndef _WIN32
+        suites.push_back("install");
+#endif
+        suites.push_back("fs");
+        suites.push_back("checksum");
+    }
+
+    Bench bench;
+    try {
+        for (const auto& suite : suites) {
+            if (suite == "index")
+                runIndexSuite(bench, sizes);
+#ifndef _WIN32
+            else if (suite == "install")
+                runInstallSuite(bench, install);
+#endif
+            else if (suite == "fs")
+                runFilesystemSuite(bench, fileCounts, dirs);
+            else if (suite == "checksum")
+                runChecksumSuite(bench, checksumMegabytes);
+            else
+                throw std::runtime_error("Unknown benchmark suite: " + suite);
+        }
+    } catch (std::exception& exc) {
+        cerr << "Benchmark failed: " << exc.what() << endl;
+        return 1;
+    }
+
+    if (output.empty())
+        cout << bench.toJson().dump(4) << endl;
+    else
+        json::saveFile(output, bench.toJson(), 4);
+    return 0;
+}
+
+
+/// @}
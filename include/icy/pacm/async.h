@@ -0,0 +1,233 @@
+///
+//
+// icey
+// Copyright (c) 2005, icey <https://0state.com>
+//
+// SPDX-License-Identifier: LGPL-2.1+
+//
+/// @addtogroup pacm
+/// @{
+
+
+#pragma once
+
+
+#include "icy/loop.h"
+#include "icy/pacm/config.h"
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+
+
+namespace icy {
+namespace pacm {
+
+
+/// Calls @p fn from the next iteration of @p loop, once the current
+/// callback and any signal being emitted have fully unwound.
+/// Must be called from the loop thread.
+Pacm_API void runOnLoop(uv::Loop* loop, std::function<void()> fn);
+
+/// Resumes @p handle from the next iteration of @p loop.
+/// Awaitables use this so that a coroutine never continues from inside
+/// the signal callback which completed the awaited operation.
+/// Must be called from the loop thread.
+Pacm_API void resumeOnLoop(uv::Loop* loop, std::coroutine_handle<> handle);
+
+
+template <typename T = void>
+class Async;
+
+
+namespace internal {
+
+
+/// Promise state shared by all Async<T> specializations.
+struct AsyncPromiseBase
+{
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    /// Transfers control to the awaiting coroutine, if any, on completion.
+    struct FinalAwaiter
+    {
+        bool await_ready() const noexcept { return false; }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            if (auto next = handle.promise().continuation)
+                return next;
+            return std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+
+template <typename T>
+struct AsyncPromise : public AsyncPromiseBase
+{
+    std::optional<T> value;
+
+    Async<T> get_return_object() noexcept;
+
+    template <typename U>
+    void return_value(U&& result)
+    {
+        value.emplace(std::forward<U>(result));
+    }
+
+    T result()
+    {
+        if (error)
+            std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+
+template <>
+struct AsyncPromise<void> : public AsyncPromiseBase
+{
+    Async<void> get_return_object() noexcept;
+
+    void return_void() const noexcept {}
+
+    void result()
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+
+} // namespace internal
+
+
+/// Lazily started coroutine returning @p T.
+///
+/// An Async may be awaited from another coroutine, or started from
+/// ordinary code with start() and inspected once done():
+///
+///     pacm::Async<> work(pacm::PackageManager& manager)
+///     {
+///         co_await manager.queryRemote();
+///         auto task = co_await manager.install("my-plugin");
+///         ...
+///     }
+///
+///     auto job = work(manager);
+///     job.start();
+///     uv_run(loop, UV_RUN_DEFAULT);
+///     job.get(); // rethrows any error
+///
+template <typename T>
+class Async
+{
+public:
+    using promise_type = internal::AsyncPromise<T>;
+    using Handle = std::coroutine_handle<promise_type>;
+
+    explicit Async(Handle handle) noexcept
+        : _handle(handle)
+    {
+    }
+
+    Async(Async&& other) noexcept
+        : _handle(std::exchange(other._handle, nullptr))
+    {
+    }
+
+    Async& operator=(Async&& other) noexcept
+    {
+        if (this != &other) {
+            if (_handle)
+                _handle.destroy();
+            _handle = std::exchange(other._handle, nullptr);
+        }
+        return *this;
+    }
+
+    Async(const Async&) = delete;
+    Async& operator=(const Async&) = delete;
+
+    /// Destroys the coroutine frame. A coroutine which is still
+    /// suspended on an operation must not be destroyed.
+    ~Async() noexcept
+    {
+        if (_handle)
+            _handle.destroy();
+    }
+
+    /// Runs the coroutine until its first suspension point.
+    /// Has no effect if the coroutine was already started.
+    void start()
+    {
+        if (_handle && !_started) {
+            _started = true;
+            _handle.resume();
+        }
+    }
+
+    /// Returns true once the coroutine has returned or thrown.
+    bool done() const noexcept { return !_handle || _handle.done(); }
+
+    /// Returns the coroutine result, rethrowing its exception if any.
+    /// @throws std::logic_error if the coroutine has not completed.
+    T get()
+    {
+        if (!_handle || !_handle.done())
+            throw std::logic_error("Coroutine has not completed");
+        return _handle.promise().result();
+    }
+
+    // Awaitable interface, so coroutines can be composed.
+    bool await_ready() const noexcept { return done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        _started = true;
+        _handle.promise().continuation = awaiting;
+        return _handle;
+    }
+
+    T await_resume() { return _handle.promise().result(); }
+
+protected:
+    Handle _handle;
+    bool _started = false;
+};
+
+
+namespace internal {
+
+
+template <typename T>
+inline Async<T> AsyncPromise<T>::get_return_object() noexcept
+{
+    return Async<T>(std::coroutine_handle<AsyncPromise<T>>::from_promise(*this));
+}
+
+
+inline Async<void> AsyncPromise<void>::get_return_object() noexcept
+{
+    return Async<void>(std::coroutine_handle<AsyncPromise<void>>::from_promise(*this));
+}
+
+
+} // namespace internal
+} // namespace pacm
+} // namespace icy
+
+
+/// @}
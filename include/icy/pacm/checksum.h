@@ -0,0 +1,160 @@
+///
+//
+// icey
+// Copyright (c) 2005, icey <https://0state.com>
+//
+// SPDX-License-Identifier: LGPL-2.1+
+//
+/// @addtogroup pacm
+/// @{
+
+
+#pragma once
+
+
+#include "icy/pacm/config.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <system_error>
+
+
+namespace icy {
+namespace pacm {
+
+
+class WorkerPool;
+
+
+/// Name of the tree checksum algorithm.
+///
+/// The file is split into TREE_CHECKSUM_CHUNK_SIZE byte chunks, the last
+/// of which may be shorter. Each chunk is hashed with SHA256, and the
+/// digest is the SHA256 of the file size as a little-endian 64-bit
+/// integer followed by the chunk digests in order. Chunks are hashed in
+/// parallel, so large archives verify at a multiple of the single core
+/// rate.
+#define TREE_CHECKSUM_ALGORITHM "SHA256-TREE"
+
+/// Chunk size of the tree checksum algorithm.
+#define TREE_CHECKSUM_CHUNK_SIZE (4 * 1024 * 1024)
+
+
+/// Returns the lowercase hex digest of the file at @p path.
+///
+/// @param algorithm Any digest supported by OpenSSL, such as SHA256, or
+///                  TREE_CHECKSUM_ALGORITHM. OpenSSL selects the SHA
+///                  extensions of the CPU (SHA-NI, ARMv8 crypto) at
+///                  runtime when they are available.
+/// @param pool Hashes tree chunks on the worker threads and the calling
+///             thread; null hashes on the calling thread only.
+/// @param checkpoint Called between blocks; may throw to abort.
+/// @throws std::runtime_error if the file cannot be read.
+Pacm_API std::string checksumFile(const std::string& algorithm, const std::string& path,
+                                  WorkerPool* pool = nullptr,
+                                  const std::function<void()>& checkpoint = nullptr);
+
+/// Returns the tree checksum of @p size bytes at @p data.
+Pacm_API std::string treeChecksum(const char* data, size_t size);
+
+
+/// Identity of a file's contents as recorded by the file system.
+/// A file whose identity is unchanged is assumed to hold the same data;
+/// the change time catches writes which restore the modification time.
+struct Pacm_API FileIdentity
+{
+    uint64_t device = 0;
+    uint64_t inode = 0; ///< Zero where the platform has no inode numbers
+    uint64_t size = 0;
+    int64_t mtimeNs = 0; ///< Modification time in nanoseconds
+    int64_t ctimeNs = 0; ///< Status change time in nanoseconds, where available
+
+    /// Returns the identity of @p path, setting @p ec if it cannot be read.
+    static FileIdentity of(const std::string& path, std::error_code& ec);
+
+    bool operator==(const FileIdentity& other) const;
+    bool operator!=(const FileIdentity& other) const { return !(*this == other); }
+};
+
+
+/// Persistent cache of verified file digests, keyed by path and file
+/// identity, so unchanged archives and installed files are not hashed
+/// again after a restart. Entries for files which have changed or been
+/// removed are dropped when the cache is loaded. All methods are thread
+/// safe.
+class Pacm_API ChecksumCache
+{
+public:
+    /// @param path File the cache is loaded from and saved to; empty
+    ///             keeps the cache in memory only.
+    explicit ChecksumCache(std::string path = "");
+
+    ChecksumCache(const ChecksumCache&) = delete;
+    ChecksumCache& operator=(const ChecksumCache&) = delete;
+
+    /// Returns the hex digest of @p path, from the cache if the file is
+    /// unchanged since it was last hashed with @p algorithm, or else
+    /// computed with checksumFile() and remembered.
+    ///
+    /// Files modified in the last few seconds are not remembered, since
+    /// a write within the timestamp granularity would go unnoticed.
+    std::string checksum(const std::string& algorithm, const std::string& path,
+                         WorkerPool* pool = nullptr,
+                         const std::function<void()>& checkpoint = nullptr);
+
+    /// Returns the cached digest of @p path for @p algorithm, or an
+    /// empty string if there is none or the file has changed.
+    std::string lookup(const std::string& algorithm, const std::string& path);
+
+    /// Forgets the digest of @p path.
+    void invalidate(const std::string& path);
+
+    /// Forgets every digest.
+    void clear();
+
+    /// Returns the number of remembered digests.
+    size_t size();
+
+    /// Returns the number of lookups answered from the cache.
+    uint64_t hits() const { return _hits.load(std::memory_order_relaxed); }
+
+    /// Returns the number of lookups which needed hashing.
+    uint64_t misses() const { return _misses.load(std::memory_order_relaxed); }
+
+    /// Writes the cache through a temporary file and a rename if it has
+    /// changed since it was loaded or last saved.
+    /// @throws std::runtime_error if the file cannot be written.
+    void save();
+
+protected:
+    struct Entry
+    {
+        FileIdentity identity;
+        std::string algorithm;
+        std::string digest;
+    };
+
+    /// Loads the cache file once, dropping stale entries.
+    /// Must be called with the mutex held.
+    void load();
+
+    std::mutex _mutex;
+    std::string _path;
+    std::map<std::string, Entry> _entries;
+    std::atomic<uint64_t> _hits{0};
+    std::atomic<uint64_t> _misses{0};
+    bool _loaded = false;
+    bool _dirty = false;
+};
+
+
+} // namespace pacm
+} // namespace icy
+
+
+/// @}
@@ -27,6 +27,9 @@ namespace pacm {
 #define DEFAULT_PACKAGE_DATA_DIR "pacm/data"
 #define DEFAULT_PACKAGE_TEMP_DIR "pacm/tmp"
 #define DEFAULT_CHECKSUM_ALGORITHM "SHA256"
+#define PACKAGE_CURRENT_LINK "current"
+#define PACKAGE_STORE_DIR ".store"
+#define CHECKSUM_CACHE_FILE "checksums.cache"
 
 #ifdef _WIN32
 #define DEFAULT_PLATFORM "win32"
@@ -38,6 +41,29 @@ namespace pacm {
 #error "Unknown platform"
 #endif
 
+// Minimum level of pacm log output which is compiled in:
+// 0 trace, 1 debug, 2 info and above. Statements below the level are
+// discarded at compile time, arguments included, so per-file and
+// per-chunk logging costs nothing in release builds.
+#ifndef PACM_LOG_LEVEL
+#ifdef NDEBUG
+#define PACM_LOG_LEVEL 2
+#else
+#define PACM_LOG_LEVEL 0
+#endif
+#endif
+
+// Gated log streams; used like STrace and SDebug. Brace the statement
+// when it is the body of an unbraced if.
+#define PacmTrace                      \
+    if constexpr (PACM_LOG_LEVEL > 0) { \
+    } else                             \
+        STrace
+#define PacmDebug                      \
+    if constexpr (PACM_LOG_LEVEL > 1) { \
+    } else                             \
+        SDebug
+
 // Shared library exports
 #if defined(Pacm_EXPORTS)
 #define Pacm_API ICY_EXPORT
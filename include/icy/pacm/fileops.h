@@ -0,0 +1,112 @@
+///
+//
+// icey
+// Copyright (c) 2005, icey <https://0state.com>
+//
+// SPDX-License-Identifier: LGPL-2.1+
+//
+/// @addtogroup pacm
+/// @{
+
+
+#pragma once
+
+
+#include "icy/pacm/config.h"
+
+#include <string>
+#include <vector>
+
+
+namespace icy {
+namespace pacm {
+
+
+class Tracer;
+class WorkerPool;
+
+
+/// Outcome of moving a single file or directory during finalization.
+struct FileResult
+{
+    enum Outcome
+    {
+        Moved = 0, ///< Renamed into place
+        Copied,    ///< Data was copied to the target
+        Linked,    ///< Reflinked or hardlinked, sharing data with the source
+        Removed,   ///< Deleted, or already missing
+        Busy,      ///< The target is in use; retry from another process
+        Failed     ///< Any other error
+    };
+
+    std::string source;
+    std::string target;
+    Outcome outcome = Failed;
+    std::string error; ///< Error message for the Busy and Failed outcomes
+
+    /// Returns true if the entry is in place at the target.
+    bool ok() const { return outcome != Busy && outcome != Failed; }
+};
+
+
+/// Vector of per-file move outcomes.
+using FileResultVec = std::vector<FileResult>;
+
+
+/// Moves a single file, symlink or directory to @p target, replacing an
+/// existing file. When the paths are on different filesystems the entry
+/// is cloned or copied (see cloneFile()) and the source removed.
+/// Never throws; the outcome is reported in the result.
+Pacm_API FileResult moveFile(const std::string& source, const std::string& target);
+
+/// Moves everything below @p sourceDir to the same relative path below
+/// @p targetDir, merging into existing directories. Directories which do
+/// not yet exist at the target are moved with a single rename.
+/// Files are moved in parallel on @p pool when one is given, each in a
+/// span on @p tracer when one is given.
+/// Never throws for individual entries; check each result.
+Pacm_API FileResultVec moveTree(const std::string& sourceDir,
+                                const std::string& targetDir,
+                                WorkerPool* pool = nullptr,
+                                Tracer* tracer = nullptr);
+
+/// Materializes everything below @p sourceDir at the same relative path
+/// below @p targetDir without moving the source. Each file is reflinked
+/// when the filesystem supports it, otherwise hardlinked when
+/// @p allowHardlinks is set, otherwise copied. Existing target files are
+/// replaced with a rename so readers never see a partial file.
+/// Files are linked in parallel on @p pool when one is given, each in a
+/// span on @p tracer when one is given.
+/// Never throws for individual entries; check each result.
+Pacm_API FileResultVec linkTree(const std::string& sourceDir,
+                                const std::string& targetDir,
+                                bool allowHardlinks,
+                                WorkerPool* pool = nullptr,
+                                Tracer* tracer = nullptr);
+
+/// Deletes each file or symlink in @p paths, in parallel on @p pool when
+/// one is given. Directories are skipped; see pruneEmptyDirs().
+/// Never throws for individual entries; check each result.
+Pacm_API FileResultVec removeFiles(const std::vector<std::string>& paths,
+                                   WorkerPool* pool = nullptr);
+
+/// Removes the directories containing @p paths, deepest first, for as
+/// long as they are empty. @p root and anything above it is never removed.
+/// @return The number of directories removed.
+Pacm_API size_t pruneEmptyDirs(const std::string& root,
+                               const std::vector<std::string>& paths);
+
+/// Copies a regular file without passing data through user space where
+/// possible: a reflink (FICLONE) on filesystems that share extents
+/// (btrfs, xfs), then copy_file_range(), then a plain read/write loop.
+/// File permissions are preserved.
+/// @return true if the target shares extents with the source.
+/// @throws std::system_error on failure.
+Pacm_API bool cloneFile(const std::string& source, const std::string& target);
+
+
+} // namespace pacm
+} // namespace icy
+
+
+/// @}
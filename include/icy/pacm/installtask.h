@@ -13,12 +13,19 @@
 
 
 #include "icy/http/client.h"
-#include "icy/idler.h"
 #include "icy/logger.h"
+#include "icy/loop.h"
 #include "icy/pacm/config.h"
 #include "icy/pacm/package.h"
 #include "icy/stateful.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <vector>
+
 
 namespace icy {
 namespace pacm {
@@ -67,6 +74,42 @@ struct InstallationState : public State
     }
 };
 
+/// Timing and throughput of a single installation.
+/// Stage timestamps use a monotonic clock.
+struct Pacm_API InstallStats
+{
+    using Clock = std::chrono::steady_clock;
+
+    /// Entry into an installation state.
+    struct Transition
+    {
+        unsigned int state; ///< InstallationState::Type
+        Clock::time_point time;
+    };
+
+    Clock::time_point created;           ///< When the task was created
+    Clock::time_point finished;          ///< When the task completed, if it has
+    std::vector<Transition> transitions; ///< In the order they happened
+    uint64_t bytesDownloaded = 0;        ///< Size of the downloaded archive
+    uint64_t bytesWritten = 0;           ///< Size of the extracted files
+    size_t entries = 0;                  ///< Archive entries extracted
+    Clock::duration checksumTime{};      ///< Time spent verifying the archive
+
+    /// Returns the total time spent in @p state, which is still
+    /// counting if it is the current state.
+    Clock::duration stateTime(unsigned int state) const;
+
+    /// Returns the time from creation until completion, or until now.
+    Clock::duration totalTime() const;
+
+    /// Returns the download rate in bytes per second, or 0 if unknown.
+    double downloadRate() const;
+
+    /// Returns the extraction write rate in bytes per second, or 0 if unknown.
+    double extractRate() const;
+};
+
+
 /// Package installation options.
 struct InstallOptions
 {
@@ -75,12 +118,15 @@ struct InstallOptions
                             ///< version will be installed.
     std::string installDir; ///< Install to the given location, otherwise the
                             ///< manager default `installDir` will be used.
+    int priority;           ///< Tasks with a higher priority are started and
+                            ///< extracted first. Defaults to 0.
 
     InstallOptions()
     {
         version = "";
         sdkVersion = "";
         installDir = "";
+        priority = 0;
     }
 };
 
@@ -108,11 +154,14 @@ public:
     InstallTask(InstallTask&&) = delete;
     InstallTask& operator=(InstallTask&&) = delete;
 
-    /// Validates options, resolves the install directory, and launches the background runner.
+    /// Validates options, resolves the install directory, and schedules the first stage.
     /// @throws std::runtime_error if the requested version or SDK version asset is unavailable.
     virtual void start();
 
-    /// Transitions the task to the Cancelled state.
+    /// Transitions the task to the Cancelled state. An active download
+    /// is aborted straight away, and stage work running on the worker
+    /// pool stops at its next checkpoint, after which partial output is
+    /// removed in the background. Loop thread only.
     void cancel(bool flag = true) override;
 
     /// Downloads the package archive from the server.
@@ -120,10 +169,14 @@ public:
 
     /// Extracts the downloaded package files
     /// to the intermediate directory.
+    /// Runs on a worker thread; must not emit signals.
     virtual void doExtract();
 
     /// Moves extracted files from the intermediate
     /// directory to the installation directory.
+    /// Files in use are left in place and flagged, so the
+    /// package can be finalized later by finalizeInstallations().
+    /// Runs on a worker thread; must not emit signals.
     virtual void doFinalize();
 
     /// Called when the task completes either
@@ -135,6 +188,10 @@ public:
     /// Respects version and sdkVersion overrides; falls back to latestAsset().
     virtual Package::Asset getRemoteAsset() const;
 
+    /// Returns true if the content store already holds the selected
+    /// asset version, in which case no download is required.
+    virtual bool hasStoredVersion() const;
+
     /// Returns a pointer to the local package record.
     virtual LocalPackage* local() const;
 
@@ -167,6 +224,36 @@ public:
     /// Returns the current progress value in the range [0, 100].
     virtual int progress() const;
 
+    /// Returns a copy of the timing and throughput recorded so far.
+    /// Complete once the task has completed, including from
+    /// PackageManager::InstallTaskComplete handlers.
+    virtual InstallStats stats() const;
+
+    /// Holds finalization until the tasks installing the given
+    /// packages have completed. Must be called before start().
+    virtual void setDependencies(const StringVec& ids);
+
+    /// Returns the IDs of dependencies which are still being installed.
+    virtual StringVec pendingDependencies() const;
+
+    /// Called by the manager when the task of a dependency completes.
+    /// Fails this task if the dependency was not installed.
+    virtual void onDependencyComplete(const InstallTask& dependency);
+
+    /// Holds the task once its files are staged, before finalization,
+    /// until the hold is released. Used by transactions to stage every
+    /// package before any of them is committed.
+    virtual void setHoldFinalize(bool hold);
+
+    /// Returns true if finalization is held.
+    virtual bool holdFinalize() const;
+
+    /// Returns true if the last doFinalize() left files in use behind.
+    virtual bool hasBusyFiles() const;
+
+    /// Blocks until any stage work running on the worker pool is done.
+    void waitForWork();
+
     /// Signals on progress update [0-100].
     Signal<void(InstallTask&, int&)> Progress;
 
@@ -175,9 +262,27 @@ public:
     Signal<void(InstallTask&)> Complete;
 
 protected:
-    /// Called asynchronously by the thread to do the work.
+    /// Runs the current stage on the event loop thread.
+    /// Called from the wakeup handle whenever a stage can make progress.
     void run() override;
 
+    /// Schedules run() on the event loop. Safe to call from any thread.
+    /// Wakeups are coalesced, and nothing runs while a download or
+    /// other stage work is outstanding, so an idle task costs no CPU.
+    void wakeup();
+
+    /// Closes the wakeup handle. Loop thread only.
+    void closeWakeup();
+
+    /// Runs a blocking stage on the manager's worker pool, and wakes the
+    /// task on the loop thread once it is done.
+    /// @return true once the work has completed; false while it is still
+    ///         running. Rethrows any exception thrown by the work.
+    bool offload(void (InstallTask::*work)());
+
+    /// Returns true while stage work is running on the worker pool.
+    bool working() const;
+
     void onStateChange(InstallationState& state,
                        const InstallationState& oldState) override;
     virtual void onDownloadProgress(const double& progress);
@@ -185,10 +290,38 @@ protected:
 
     virtual void setProgress(int value);
 
+    /// Moves the staged tree into its version directory and
+    /// activates it. Used for the versioned install layout.
+    virtual void doFinalizeVersion(const std::string& tempDir);
+
+    /// Returns the content store directory of the pending version.
+    std::string storeDir() const;
+
+    /// Records the stage spans of the completed task with the tracer.
+    void traceStages();
+
+    /// Cancellation checkpoint for stage work on the worker pool.
+    /// @throws std::runtime_error once the task has been cancelled.
+    void checkCancelled() const;
+
+    /// Returns the hex digest of @p path, from the manager's checksum
+    /// cache if the file is unchanged, or else hashing tree checksum
+    /// chunks on the worker pool and checking for cancellation between
+    /// chunks.
+    std::string computeChecksum(const std::string& algorithm, const std::string& path) const;
+
+    /// Marks @p path as partial output, removed if the task is cancelled.
+    void addPartialPath(const std::string& path);
+
+    /// Unmarks @p path once it holds complete output.
+    void removePartialPath(const std::string& path);
+
+    /// Removes partial output on the worker pool.
+    void cleanupPartialPaths();
+
 protected:
     mutable std::mutex _mutex;
 
-    Idler _runner;
     icy::Error _error;
     PackageManager& _manager;
     LocalPackage* _local;
@@ -198,6 +331,18 @@ protected:
     bool _downloading;
     http::ClientConnection::Ptr _dlconn;
     uv::Loop* _loop;
+    uv_async_t* _wakeup;
+    bool _working;
+    bool _workDone;
+    std::exception_ptr _workError;
+    std::condition_variable _workCond;
+    bool _busyFiles;
+    std::atomic<bool> _cancelling; ///< Read by stage work at checkpoints
+    StringVec _partialPaths;       ///< Guarded by _mutex
+    InstallStats _stats;           ///< Guarded by _mutex
+    uint64_t _traceLane;           ///< Tracer lane of this task, if tracing
+    StringVec _dependencies;
+    bool _holdFinalize;
 
     friend class PackageManager;
     friend class InstallMonitor;
@@ -0,0 +1,166 @@
+///
+//
+// icey
+// Copyright (c) 2005, icey <https://0state.com>
+//
+// SPDX-License-Identifier: LGPL-2.1+
+//
+/// @addtogroup pacm
+/// @{
+
+
+#pragma once
+
+
+#include "icy/pacm/config.h"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+namespace icy {
+namespace pacm {
+
+
+/// Monotonically increasing value, such as a byte or event count.
+class Pacm_API Counter
+{
+public:
+    /// Adds @p value, which must not be negative.
+    void inc(double value = 1) { _value.fetch_add(value, std::memory_order_relaxed); }
+
+    double value() const { return _value.load(std::memory_order_relaxed); }
+
+protected:
+    std::atomic<double> _value{0};
+};
+
+
+/// Value which can go up and down, such as a number of active tasks.
+class Pacm_API Gauge
+{
+public:
+    void set(double value) { _value.store(value, std::memory_order_relaxed); }
+    void inc(double value = 1) { _value.fetch_add(value, std::memory_order_relaxed); }
+    void dec(double value = 1) { _value.fetch_sub(value, std::memory_order_relaxed); }
+
+    double value() const { return _value.load(std::memory_order_relaxed); }
+
+protected:
+    std::atomic<double> _value{0};
+};
+
+
+/// Distribution of observed values, such as durations, counted into
+/// buckets with fixed upper bounds.
+class Pacm_API Histogram
+{
+public:
+    /// @param bounds Bucket upper bounds in ascending order; a final
+    ///               +Inf bucket is implied.
+    explicit Histogram(std::vector<double> bounds);
+
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+
+    void observe(double value);
+
+    const std::vector<double>& bounds() const { return _bounds; }
+
+    /// Returns the number of observations in each bucket, including
+    /// the +Inf bucket. Counts are not cumulative.
+    std::vector<uint64_t> counts() const;
+
+    double sum() const { return _sum.load(std::memory_order_relaxed); }
+    uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+
+    /// Default bounds for durations in seconds, from 5ms to 5 minutes.
+    static std::vector<double> secondsBounds();
+
+protected:
+    std::vector<double> _bounds;
+    std::unique_ptr<std::atomic<uint64_t>[]> _counts;
+    std::atomic<double> _sum{0};
+    std::atomic<uint64_t> _count{0};
+};
+
+
+/// Named metrics which can be written in the Prometheus text format.
+///
+/// Metrics are created on first use and live as long as the registry,
+/// so the returned references may be kept. Updating a metric is lock
+/// free; only creation and export take the registry lock.
+class Pacm_API MetricsRegistry
+{
+public:
+    /// Label name and value pairs identifying one series of a metric.
+    using Labels = std::vector<std::pair<std::string, std::string>>;
+
+    MetricsRegistry() = default;
+    MetricsRegistry(const MetricsRegistry&) = delete;
+    MetricsRegistry& operator=(const MetricsRegistry&) = delete;
+
+    /// Returns the counter series @p name with @p labels.
+    /// @throws std::logic_error if @p name is registered with another type.
+    Counter& counter(const std::string& name, const std::string& help,
+                     const Labels& labels = {});
+
+    /// Returns the gauge series @p name with @p labels.
+    /// @throws std::logic_error if @p name is registered with another type.
+    Gauge& gauge(const std::string& name, const std::string& help,
+                 const Labels& labels = {});
+
+    /// Returns the histogram series @p name with @p labels. The bounds
+    /// are only used when the series is created.
+    /// @throws std::logic_error if @p name is registered with another type.
+    Histogram& histogram(const std::string& name, const std::string& help,
+                         const std::vector<double>& bounds = Histogram::secondsBounds(),
+                         const Labels& labels = {});
+
+    /// Writes every metric in the Prometheus text exposition format.
+    void write(std::ostream& os) const;
+
+    /// Returns every metric in the Prometheus text exposition format.
+    std::string toString() const;
+
+    /// Writes the metrics to @p path through a temporary file and a
+    /// rename, so a scraper never reads a partial file.
+    /// @throws std::runtime_error if the file cannot be written.
+    void writeFile(const std::string& path) const;
+
+protected:
+    enum class Type
+    {
+        Counter,
+        Gauge,
+        Histogram
+    };
+
+    struct Family
+    {
+        Type type;
+        std::string help;
+        std::map<std::string, std::unique_ptr<Counter>> counters;     ///< By label string
+        std::map<std::string, std::unique_ptr<Gauge>> gauges;         ///< By label string
+        std::map<std::string, std::unique_ptr<Histogram>> histograms; ///< By label string
+    };
+
+    Family& family(const std::string& name, const std::string& help, Type type);
+
+    mutable std::mutex _mutex;
+    std::map<std::string, Family> _families;
+};
+
+
+} // namespace pacm
+} // namespace icy
+
+
+/// @}
@@ -14,6 +14,8 @@
 
 #include "icy/json/json.h"
 
+#include <cstdint>
+#include <mutex>
 #include <string_view>
 #include <vector>
 
@@ -22,6 +24,9 @@ namespace icy {
 namespace pacm {
 
 
+class WorkerPool;
+
+
 /// JSON-backed package metadata shared by local and remote package records.
 struct Package : public json::Value
 {
@@ -81,7 +86,7 @@ struct Package : public json::Value
         virtual std::string url(int index = 0) const;
 
         /// Returns the uncompressed file size in bytes, or 0 if not set.
-        virtual int fileSize() const;
+        virtual std::uint64_t fileSize() const;
 
         /// Returns true if the asset has the minimum required fields
         /// (file-name, version, mirrors).
@@ -107,8 +112,21 @@ struct Package : public json::Value
     /// Constructs a package from an existing JSON value.
     /// @param src JSON object containing package fields.
     Package(const json::Value& src);
+
+    /// Copies the JSON of @p other while holding its lock.
+    Package(const Package& other);
+    Package& operator=(const Package& other);
     virtual ~Package() noexcept;
 
+    /// Returns the lock guarding this package's JSON.
+    /// Accessors returning values lock it themselves, so packages can be
+    /// updated by their install task while other threads read them.
+    /// Hold it while using a reference returned by manifest(), errors(),
+    /// assets() or the like, and while serializing the package.
+    /// Each package has its own lock, so work on different packages
+    /// never contends.
+    std::recursive_mutex& mutex() const;
+
     /// Returns the package unique identifier.
     virtual std::string id() const;
 
@@ -124,6 +142,12 @@ struct Package : public json::Value
     /// Returns the package description string.
     virtual std::string description() const;
 
+    /// Returns the IDs of the packages this package depends on, from the
+    /// "dependencies" array. Entries may be ID strings or objects with an
+    /// "id" member. Dependencies are installed before this package is
+    /// finalized.
+    virtual StringVec dependencies() const;
+
     /// Returns true when the package has an "extension" object.
     virtual bool hasExtension() const;
 
@@ -140,6 +164,9 @@ struct Package : public json::Value
     /// Dumps the JSON representation of this package to @p ost.
     /// @param ost Output stream.
     virtual void print(std::ostream& ost) const;
+
+protected:
+    mutable std::recursive_mutex _mutex;
 };
 
 
@@ -238,6 +265,16 @@ struct LocalPackage : public Package
     /// Set's the installation directory for this package.
     virtual void setInstallDir(const std::string& dir);
 
+    /// Sets the versioned install root for this package.
+    /// When set, each version is installed into `<root>/<version>` and
+    /// the install directory is the `<root>/current` symlink.
+    /// Pass an empty string to revert to the flat layout.
+    virtual void setInstallRoot(const std::string& dir);
+
+    /// Sets the version which has been extracted but not yet finalized.
+    /// Pass an empty string to clear it.
+    virtual void setPendingVersion(const std::string& version);
+
     /// Sets the installed asset, once installed.
     /// This method also sets the version.
     virtual void setInstalledAsset(const Package::Asset& installedRemoteAsset);
@@ -270,6 +307,18 @@ struct LocalPackage : public Package
     /// Returns the installation directory for this package.
     virtual std::string installDir() const;
 
+    /// Returns the versioned install root, or empty for the flat layout.
+    virtual std::string installRoot() const;
+
+    /// Returns true if the package uses the versioned install layout.
+    virtual bool isVersioned() const;
+
+    /// Returns the directory holding the given version of a versioned install.
+    /// Throws if the package does not use the versioned layout.
+    virtual std::string getVersionDir(const std::string& version) const;
+
+    /// Returns the version awaiting finalization, or empty if none.
+    virtual std::string pendingVersion() const;
 
     /// Returns the pinned version string, or empty if no lock is set.
     virtual std::string versionLock() const;
@@ -292,7 +341,40 @@ struct LocalPackage : public Package
     /// Returns the installation manifest.
     virtual Manifest manifest();
 
-    virtual bool verifyInstallManifest(bool allowEmpty = false);
+    /// Returns true if every file and directory in the manifest exists
+    /// in the install directory.
+    ///
+    /// Entries are grouped by directory and each directory is listed
+    /// once, on the worker threads of @p pool if given. The result is
+    /// cached against a fingerprint of the manifest and the modification
+    /// times of its directories, so an unchanged install is verified with
+    /// one stat per directory.
+    /// @param allowEmpty Return true for an empty manifest.
+    /// @param pool Lists directories in parallel; null lists them on the
+    ///             calling thread.
+    virtual bool verifyInstallManifest(bool allowEmpty = false, WorkerPool* pool = nullptr);
+
+    /// Returns a reference to the JSON array of retained versions.
+    /// Each entry holds the "version", "asset" and "manifest" of a
+    /// version which is still on disk, oldest first.
+    virtual json::Value& retainedVersions();
+
+    /// Records the installed asset and manifest as a retained version,
+    /// replacing any existing entry for the same version.
+    virtual void retainInstalledVersion();
+
+    /// Drops the oldest retained versions until at most @p limit remain.
+    /// The installed version is never dropped.
+    /// @return The versions that were dropped, oldest first.
+    virtual StringVec pruneRetainedVersions(size_t limit);
+
+    /// Returns true if @p version has a retained entry.
+    virtual bool isVersionRetained(const std::string& version);
+
+    /// Makes a retained version the installed one by restoring its
+    /// asset and manifest. Package files are not touched.
+    /// Throws if the version is not retained.
+    virtual void restoreRetainedVersion(const std::string& version);
 
     /// Returns the full full path of the installed file.
     /// Thrown an exception if the install directory is unset.
@@ -317,6 +399,23 @@ struct LocalPackage : public Package
     virtual void clearErrors();
 
     virtual bool valid() const;
+
+protected:
+    /// Last verifyInstallManifest() result. Copies of the package start
+    /// with an empty cache.
+    struct VerifyCache
+    {
+        VerifyCache() = default;
+        VerifyCache(const VerifyCache&) {}
+        VerifyCache& operator=(const VerifyCache&);
+
+        std::mutex mutex;
+        uint64_t fingerprint = 0;
+        bool valid = false;
+        bool result = false;
+    };
+
+    VerifyCache _verifyCache;
 };
 
 
@@ -14,16 +14,26 @@
 
 #include "icy/collection.h"
 #include "icy/json/json.h"
+#include "icy/pacm/async.h"
+#include "icy/pacm/checksum.h"
 #include "icy/pacm/config.h"
 #include "icy/pacm/installmonitor.h"
 #include "icy/pacm/installtask.h"
+#include "icy/pacm/metrics.h"
 #include "icy/pacm/package.h"
+#include "icy/pacm/tracer.h"
+#include "icy/pacm/workerpool.h"
 #include "icy/platform.h"
 #include "icy/stateful.h"
 #include "icy/filesystem.h"
 #include "icy/task.h"
+#include <array>
+#include <cstdint>
+#include <functional>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <stdexcept>
 #include <string_view>
 
@@ -58,6 +68,269 @@ using LocalPackageStore = KeyedStore<std::string, LocalPackage>;
 using RemotePackageStore = KeyedStore<std::string, RemotePackage>;
 
 
+/// Aggregated outcome of a batched uninstall.
+struct UninstallResult
+{
+    StringVec packages;      ///< IDs of the packages which were uninstalled
+    StringVec failed;        ///< IDs which could not be uninstalled
+    StringVec errors;        ///< All errors, including nonfatal file errors
+    size_t filesRemoved = 0; ///< Installed files deleted from disk
+    size_t dirsRemoved = 0;  ///< Directories pruned once emptied
+
+    /// Returns true if every requested package was uninstalled.
+    /// Files which could not be deleted do not fail the uninstall.
+    bool success() const { return failed.empty(); }
+};
+
+
+/// Called with the result of one uninstall batch.
+using UninstallCallback = std::function<void(const UninstallResult&)>;
+
+
+/// Estimated heap footprint of one package store.
+///
+/// JSON sizes are derived from the DOM layout and the standard library
+/// containers backing it, excluding allocator overhead, so they are
+/// close estimates rather than exact allocation counts.
+struct StoreMemoryStats
+{
+    size_t packages = 0;        ///< Packages in the store
+    size_t assets = 0;          ///< Remote assets, or installed assets of local packages
+    size_t manifestEntries = 0; ///< Installed file entries of local packages
+    size_t objectBytes = 0;     ///< Package objects and store entries
+    size_t domBytes = 0;        ///< JSON values, object members and arrays
+    size_t stringBytes = 0;     ///< Heap storage of JSON keys and string values
+    size_t assetBytes = 0;      ///< Share of domBytes and stringBytes held by assets
+    size_t manifestBytes = 0;   ///< Share of domBytes and stringBytes held by manifests
+
+    /// Returns the bytes held by the store.
+    size_t totalBytes() const { return objectBytes + domBytes + stringBytes; }
+};
+
+
+/// Estimated heap footprint of the package manager's metadata.
+struct MemoryStats
+{
+    StoreMemoryStats remote; ///< Remote package index
+    StoreMemoryStats local;  ///< Local packages and manifests
+    size_t snapshotBytes = 0; ///< Package copies held by the latest snapshot
+
+    /// Returns the bytes held by both stores and the snapshot.
+    size_t totalBytes() const
+    {
+        return remote.totalBytes() + local.totalBytes() + snapshotBytes;
+    }
+};
+
+
+/// Immutable map of packages by ID for snapshots.
+/// Entries are split by hash into buckets which are shared between
+/// copies, so replacing a single package copies one bucket rather than
+/// the whole map. Iteration order is unspecified.
+template <class T>
+class PackageMap
+{
+public:
+    using Ptr = std::shared_ptr<const T>;
+    using Entries = std::map<std::string, Ptr>;
+
+    PackageMap() = default;
+
+    /// Builds the map from every entry of @p entries.
+    explicit PackageMap(const Entries& entries)
+    {
+        std::array<Entries, kBuckets> buckets;
+        for (const auto& [id, package] : entries)
+            buckets[bucket(id)].emplace(id, package);
+        for (size_t i = 0; i < kBuckets; i++) {
+            if (!buckets[i].empty())
+                _buckets[i] = std::make_shared<const Entries>(std::move(buckets[i]));
+        }
+        _size = entries.size();
+    }
+
+    /// Returns a copy of the map with @p id set to @p package, or
+    /// removed if @p package is null. Only the affected bucket is copied.
+    PackageMap with(const std::string& id, Ptr package) const
+    {
+        PackageMap next(*this);
+        size_t index = bucket(id);
+        auto entries = _buckets[index] ? std::make_shared<Entries>(*_buckets[index])
+                                       : std::make_shared<Entries>();
+        size_t before = entries->size();
+        if (package)
+            (*entries)[id] = std::move(package);
+        else
+            entries->erase(id);
+        next._size = _size - before + entries->size();
+        next._buckets[index] = entries->empty() ? nullptr : std::move(entries);
+        return next;
+    }
+
+    /// Returns the package with the given ID, or nullptr.
+    Ptr find(const std::string& id) const
+    {
+        const auto& entries = _buckets[bucket(id)];
+        if (!entries)
+            return nullptr;
+        auto it = entries->find(id);
+        return it != entries->end() ? it->second : nullptr;
+    }
+
+    /// Calls @p fn with the ID and package of every entry.
+    void forEach(const std::function<void(const std::string&, const Ptr&)>& fn) const
+    {
+        for (const auto& entries : _buckets) {
+            if (entries) {
+                for (const auto& [id, package] : *entries)
+                    fn(id, package);
+            }
+        }
+    }
+
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+protected:
+    static constexpr size_t kBuckets = 64;
+
+    static size_t bucket(const std::string& id) { return std::hash<std::string>()(id) % kBuckets; }
+
+    std::array<std::shared_ptr<const Entries>, kBuckets> _buckets;
+    size_t _size = 0;
+};
+
+
+/// Immutable view of the package stores at one point in time.
+/// A published snapshot is never modified, so it may be read from any
+/// thread without locking for as long as the reader holds on to it.
+/// Unchanged packages are shared between consecutive snapshots.
+/// Local packages are published without their manifest, which is kept
+/// in `manifests` and shared until it changes, so a state change does
+/// not copy the installed file list.
+struct PackageSnapshot
+{
+    using Ptr = std::shared_ptr<const PackageSnapshot>;
+    using LocalMap = PackageMap<LocalPackage>;
+    using RemoteMap = PackageMap<RemotePackage>;
+    using ManifestMap = PackageMap<json::Value>;
+
+    std::shared_ptr<const LocalMap> local;         ///< Local packages by ID, without manifests
+    std::shared_ptr<const RemoteMap> remote;       ///< Remote packages by ID
+    std::shared_ptr<const ManifestMap> manifests;  ///< Local package manifests by ID
+    uint64_t version = 0;                          ///< Incremented on every publish
+
+    /// Returns the local package with the given ID, or nullptr.
+    std::shared_ptr<const LocalPackage> localPackage(const std::string& id) const
+    {
+        return local->find(id);
+    }
+
+    /// Returns the remote package with the given ID, or nullptr.
+    std::shared_ptr<const RemotePackage> remotePackage(const std::string& id) const
+    {
+        return remote->find(id);
+    }
+
+    /// Returns the manifest array of the local package with the given
+    /// ID, or nullptr.
+    std::shared_ptr<const json::Value> localManifest(const std::string& id) const
+    {
+        return manifests->find(id);
+    }
+};
+
+
+class Pacm_API PackageManager;
+class Pacm_API Transaction;
+
+
+/// Awaitable returned by PackageManager::queryRemote().
+class Pacm_API QueryAwaiter
+{
+public:
+    QueryAwaiter(PackageManager& manager, uv::Loop* loop);
+    ~QueryAwaiter() noexcept;
+
+    QueryAwaiter(const QueryAwaiter&) = delete;
+    QueryAwaiter& operator=(const QueryAwaiter&) = delete;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+
+    /// @throws std::runtime_error if the server responded with an error
+    ///         status or the index could not be parsed.
+    void await_resume();
+
+protected:
+    void onResponse(const http::Response& response);
+
+    PackageManager& _manager;
+    uv::Loop* _loop;
+    std::coroutine_handle<> _handle;
+    bool _connected;
+    int _status;
+    std::string _error;
+};
+
+
+/// Awaitable returned by PackageManager::install() and update().
+/// Completes with the finished task, or a nullptr if there was
+/// nothing to install. May be moved until it is awaited, so several
+/// installs can be collected and awaited together.
+class Pacm_API InstallAwaiter
+{
+public:
+    explicit InstallAwaiter(InstallTask::Ptr task);
+    InstallAwaiter(InstallAwaiter&& other) noexcept;
+    ~InstallAwaiter() noexcept;
+
+    InstallAwaiter(const InstallAwaiter&) = delete;
+    InstallAwaiter& operator=(const InstallAwaiter&) = delete;
+    InstallAwaiter& operator=(InstallAwaiter&&) = delete;
+
+    bool await_ready() const noexcept { return !_task || _task->complete(); }
+    void await_suspend(std::coroutine_handle<> handle);
+    InstallTask::Ptr await_resume() noexcept { return _task; }
+
+protected:
+    void onComplete(InstallTask& task);
+
+    InstallTask::Ptr _task;
+    std::coroutine_handle<> _handle;
+    bool _connected;
+};
+
+
+/// Awaitable returned by PackageManager::uninstall().
+class Pacm_API UninstallAwaiter
+{
+public:
+    UninstallAwaiter(PackageManager& manager, StringVec ids, uv::Loop* loop);
+    ~UninstallAwaiter() noexcept;
+
+    UninstallAwaiter(const UninstallAwaiter&) = delete;
+    UninstallAwaiter& operator=(const UninstallAwaiter&) = delete;
+
+    bool await_ready() const noexcept { return _ids.empty(); }
+    void await_suspend(std::coroutine_handle<> handle);
+    UninstallResult await_resume() { return std::move(_state->result); }
+
+protected:
+    /// Shared with the batch callback, which may outlive the awaiter.
+    struct State
+    {
+        UninstallResult result;
+        std::coroutine_handle<> handle;
+    };
+
+    PackageManager& _manager;
+    StringVec _ids;
+    uv::Loop* _loop;
+    std::shared_ptr<State> _state;
+};
+
+
 /// Loads package manifests and coordinates install, update, and uninstall workflows.
 class Pacm_API PackageManager
 {
@@ -76,11 +349,40 @@ public:
         std::string installDir; ///< Directory where packages will be installed
 
         std::string platform;          ///< Platform (win32, linux, mac)
-        std::string checksumAlgorithm; ///< Checksum algorithm (MDS/SHA1)
+        std::string checksumAlgorithm; ///< Checksum algorithm (SHA256, SHA256-TREE, ...)
 
         bool clearFailedCache; ///< This flag tells the package manager weather or not
                                ///< to clear the package cache if installation fails.
 
+        bool versionedInstalls; ///< Install each version into `installDir/<id>/<version>`
+                                ///< and activate it by swapping the `current` symlink.
+
+        int retainedVersions; ///< Number of versions kept on disk per versioned
+                              ///< package, including the current one, for rollback.
+
+        unsigned workerThreads; ///< Size of the worker pool used for extraction,
+                                ///< finalization and filesystem work; 0 uses the
+                                ///< hardware concurrency.
+
+        bool contentStore; ///< Keep extracted files once in `dataDir/.store/<id>/<version>`
+                           ///< and materialize them into the install directory with
+                           ///< reflinks, so reinstalling a stored version costs no data I/O.
+
+        bool storeHardlinks; ///< Hardlink from the content store when reflinks are not
+                             ///< supported. Only for read-only payloads, since writing
+                             ///< to an installed file would modify the stored copy.
+
+        unsigned maxConcurrentInstalls; ///< Install tasks started at once by installPackages();
+                                        ///< 0 uses the worker pool size.
+
+        std::string metricsFile; ///< If set, metrics are written here in the Prometheus
+                                 ///< text format after each index query, batch of
+                                 ///< installations and uninstall.
+
+        bool checksumCache; ///< Remember verified archive checksums in
+                            ///< `dataDir/checksums.cache`, keyed by file identity,
+                            ///< so unchanged archives are not hashed again.
+
         Options(const std::string& root = getCwd())
         {
             tempDir = fs::makePath(root, DEFAULT_PACKAGE_TEMP_DIR);
@@ -91,6 +393,13 @@ public:
             platform = DEFAULT_PLATFORM;
             checksumAlgorithm = DEFAULT_CHECKSUM_ALGORITHM;
             clearFailedCache = true;
+            versionedInstalls = false;
+            retainedVersions = 2;
+            workerThreads = 0;
+            contentStore = false;
+            storeHardlinks = false;
+            maxConcurrentInstalls = 0;
+            checksumCache = true;
         }
     };
 
@@ -124,6 +433,10 @@ public:
     /// Queries the server for a list of available packages.
     virtual void queryRemotePackages();
 
+    /// Returns why the last remote package query failed, or an empty
+    /// string if it succeeded. Set before RemotePackageResponse is emitted.
+    virtual std::string queryError() const;
+
     /// Loads all local package manifests from file system.
     /// Clears all in memory package manifests.
     virtual void loadLocalPackages();
@@ -156,10 +469,15 @@ public:
     installPackage(const std::string& name,
                    const InstallOptions& options = InstallOptions());
 
-    /// Installs multiple packages.
-    /// The same options will be passed to each task.
+    /// Installs multiple packages along with their dependencies.
+    /// The same options will be passed to each task, except that a
+    /// version is only applied to the requested packages.
+    /// Every package is finalized only after its dependencies, while
+    /// downloads and extraction of independent packages overlap.
     /// If a InstallMonitor instance was passed in the tasks will need to
-    /// be started, otherwise they will be auto-started.
+    /// be started, otherwise they will be auto-started at most
+    /// `maxConcurrentInstalls` at a time, by descending `priority` and
+    /// then smallest asset first.
     /// The PackageManager does not take ownership of the InstallMonitor.
     virtual bool
     installPackages(const StringVec& ids,
@@ -186,12 +504,30 @@ public:
     /// Updates all installed packages.
     virtual bool updateAllPackages(bool whiny = false);
 
-    /// Uninstalls multiple packages.
+    /// Uninstalls multiple packages as one batch.
+    /// The files of all packages are deleted in parallel on the worker
+    /// pool, then directories left empty are pruned bottom-up.
+    /// UninstallComplete is emitted with the aggregated result.
     virtual bool uninstallPackages(const StringVec& ids, bool whiny = false);
 
     /// Uninstalls a single package.
     virtual bool uninstallPackage(const std::string& id, bool whiny = false);
 
+    /// Uninstalls multiple packages like uninstallPackages(), but deletes
+    /// the files off the event loop thread. @p done is called with the
+    /// result of this batch, then UninstallComplete is emitted, on the
+    /// @p loop thread once done. Must be called from that thread.
+    /// Packages in the batch cannot be installed or uninstalled again
+    /// until it completes; such requests fail.
+    virtual void uninstallPackagesAsync(const StringVec& ids,
+                                        uv::Loop* loop = uv::defaultLoop(),
+                                        UninstallCallback done = nullptr);
+
+    /// Creates a transaction which stages installs, updates and
+    /// uninstalls and applies them all or none of them.
+    /// See Transaction for details.
+    virtual std::shared_ptr<Transaction> beginTransaction();
+
     /// Returns true if there are updates available that have
     /// not yet been finalized. Packages may be unfinalized if
     /// there were files in use at the time of installation.
@@ -203,6 +539,64 @@ public:
     /// will fail.
     virtual bool finalizeInstallations(bool whiny = false);
 
+    /// Points the `current` symlink of a versioned package at the
+    /// given version directory. The swap is a single atomic rename,
+    /// so processes already running keep the version they mapped
+    /// while new processes resolve the new one.
+    /// Throws if the package is not versioned or the version is missing.
+    virtual void activatePackageVersion(LocalPackage& package,
+                                        const std::string& version);
+
+    /// Records the installed version of a versioned package for rollback
+    /// and deletes version directories beyond the `retainedVersions` limit.
+    virtual void retainPackageVersion(LocalPackage& package);
+
+    /// Switches a versioned package back to a retained version without
+    /// downloading or extracting anything. If no version is given the
+    /// most recently installed version other than the current one is used.
+    /// The package is not version locked, so a later update will move it
+    /// forward again unless setVersionLock() is called.
+    virtual bool rollbackPackage(const std::string& id,
+                                 const std::string& version = "",
+                                 bool whiny = false);
+
+    //
+    /// Coroutine Methods
+    ///
+    /// These wrap the signal based methods above for use with co_await
+    /// from an Async coroutine running on the manager's event loop.
+    /// The awaiting coroutine is resumed from the loop rather than from
+    /// inside the completion signal.
+
+    /// Queries the remote package index and completes once the
+    /// response has been parsed into remotePackages().
+    /// The awaiting coroutine is resumed on @p loop.
+    virtual QueryAwaiter queryRemote(uv::Loop* loop = uv::defaultLoop());
+
+    /// Installs a package and its dependencies like installPackages(),
+    /// and completes with the finished task, which may have failed or
+    /// been cancelled. Completes with a nullptr if the package is already
+    /// up-to-date. A package which is already being installed is awaited
+    /// as it is. Tasks are scheduled straight away, so several installs
+    /// run concurrently until they are awaited.
+    virtual InstallAwaiter install(const std::string& id,
+                                   const InstallOptions& options = InstallOptions());
+
+    /// Updates a package like install(). Throws if the package does not exist.
+    virtual InstallAwaiter update(const std::string& id,
+                                  const InstallOptions& options = InstallOptions());
+
+    /// Uninstalls packages with uninstallPackagesAsync() and completes
+    /// with the batch result.
+    virtual UninstallAwaiter uninstall(const StringVec& ids,
+                                       uv::Loop* loop = uv::defaultLoop());
+
+    /// Returns the given packages and all of their transitive dependencies
+    /// in install order, with each package after its dependencies.
+    /// @throws std::runtime_error if a package is unknown or the
+    ///         dependencies contain a cycle.
+    virtual StringVec resolveDependencies(const StringVec& ids) const;
+
     //
     /// Task Helper Methods
 
@@ -214,6 +608,8 @@ public:
 
     /// Aborts all package installation tasks. All tasks must
     /// be aborted before clearing local or remote manifests.
+    /// Returns once running stage work has reached a cancellation
+    /// checkpoint; partial output is removed in the background.
     virtual void cancelAllTasks();
 
     //
@@ -287,6 +683,18 @@ public:
     /// given package ID.
     std::string getPackageDataDir(std::string_view id);
 
+    /// Returns the content store directory for the given package version.
+    /// The directory is not created.
+    std::string getPackageStoreDir(std::string_view id, std::string_view version);
+
+    /// Returns true if the content store holds a complete extraction of
+    /// the given package version.
+    bool hasStoredPackage(std::string_view id, std::string_view version);
+
+    /// Removes the content store for the given package ID, or the whole
+    /// store if no ID is given.
+    void clearContentStore(std::string_view id = "");
+
     //
     /// Accessors
 
@@ -297,28 +705,93 @@ public:
     /// Returns a read-only view of the current options.
     [[nodiscard]] virtual const Options& options() const;
 
+    /// Returns the worker pool used for filesystem work, creating it
+    /// with `Options::workerThreads` threads on first use. The pool
+    /// does not change the manager's state, so const methods may use it.
+    virtual WorkerPool& workerPool() const;
+
+    /// Returns the cache of verified checksums, loading it on first use,
+    /// or nullptr if `Options::checksumCache` is disabled.
+    virtual ChecksumCache* checksumCache();
+
+    /// Returns the metrics recorded by this manager: index fetch and
+    /// parse times, cache hits, download, extract and finalize times and
+    /// sizes, failures by stage, and active and queued tasks.
+    virtual MetricsRegistry& metrics();
+
+    /// Sets the tracer which records index queries, install stages,
+    /// extracted entries, finalization and uninstalls; null disables
+    /// tracing. Set it before starting any work.
+    virtual void setTracer(std::shared_ptr<Tracer> tracer);
+
+    /// Returns the tracer, or null if tracing is disabled.
+    virtual Tracer* tracer() const;
+
+    /// Writes the metrics to `Options::metricsFile`, if set, and emits
+    /// MetricsUpdated. Called after each index query and uninstall, and
+    /// once no installation tasks remain.
+    virtual void exportMetrics();
+
     /// Returns a reference to the in-memory remote package store.
+    /// The store is modified on the event loop thread; other threads
+    /// should read from snapshot() instead.
     virtual RemotePackageStore& remotePackages();
 
     /// Returns a reference to the in-memory local package store.
+    /// The store is modified on the event loop thread; other threads
+    /// should read from snapshot() instead.
     virtual LocalPackageStore& localPackages();
 
+    /// Returns the estimated memory held by the package stores and the
+    /// latest snapshot, broken down by JSON DOM, strings, assets and
+    /// manifests. Walks every package, so call it on the event loop
+    /// thread and not on a hot path.
+    virtual MemoryStats memoryStats() const;
+
+    /// Returns the latest published snapshot of the package stores.
+    /// Never blocks on the manager or its tasks, and is safe to call
+    /// from any thread.
+    PackageSnapshot::Ptr snapshot() const;
+
+    /// Publishes a new snapshot of both package stores.
+    /// Called after bulk changes such as loading or parsing packages.
+    /// Packages which compare equal to their previous entry are shared
+    /// rather than copied.
+    virtual void publishSnapshot();
+
+    /// Publishes the current state of a single local package, sharing
+    /// every other entry with the previous snapshot. A package which
+    /// is no longer in the store is removed from the snapshot.
+    virtual void publishPackage(const std::string& id);
+
     //
     /// Events
 
     /// Signals when the remote package list have been
-    /// downloaded from the server.
+    /// downloaded from the server and parsed. Also emitted when the
+    /// request or the parsing failed, see queryError().
     Signal<void(const http::Response&)> RemotePackageResponse;
 
     /// Signals when a package is uninstalled.
     Signal<void(LocalPackage&)> PackageUninstalled;
 
+    /// Signals when an uninstall batch completes.
+    Signal<void(const UninstallResult&)> UninstallComplete;
+
+    /// Signals when the metrics have been updated, so they can be
+    /// exported somewhere other than `Options::metricsFile`.
+    Signal<void(const MetricsRegistry&)> MetricsUpdated;
+
+    /// Signals when a package is rolled back to a retained version.
+    Signal<void(LocalPackage&)> PackageRolledBack;
+
     /// Signals when an installation task is created,
     /// before it is started.
     Signal<void(InstallTask&)> InstallTaskCreated;
 
     /// Signals when a package installation tasks completes,
-    /// either successfully or in error.
+    /// either successfully or in error. The task stats() hold
+    /// its final stage timings and throughput.
     Signal<void(const InstallTask&)> InstallTaskComplete;
 
 protected:
@@ -327,12 +800,90 @@ protected:
 
     void onPackageInstallComplete(InstallTask& task);
 
+    /// Queues a task to be started once a scheduling slot is free.
+    /// Queued dependencies of the task inherit its priority.
+    void scheduleTask(const InstallTask::Ptr& task);
+
+    /// Starts queued tasks up to the `maxConcurrentInstalls` limit,
+    /// highest priority first and then shortest download first.
+    /// Tasks held before finalization keep their slot but are not
+    /// counted, so a transaction larger than the limit is not stuck
+    /// behind its own staged packages.
+    void startScheduledTasks();
+
+    /// Records the stage timings and outcome of a completed task.
+    void recordTaskMetrics(const InstallTask& task);
+
+    /// Updates the active and queued task gauges. Requires _mutex.
+    void updateTaskGauges();
+
+    /// Removes tasks which were created but never started.
+    void discardTasks(const InstallTaskPtrVec& tasks);
+
+    /// Saves the checksum cache if it has changed, logging failures.
+    /// Called once no installation tasks remain, and on uninitialize().
+    void saveChecksumCache();
+
+    /// A task waiting for a scheduling slot.
+    struct QueuedTask
+    {
+        InstallTask::Ptr task;
+        int priority;
+        std::uint64_t fileSize; ///< Asset size in bytes, 0 if unknown
+    };
+
+    /// Files scheduled for removal by an uninstall batch.
+    struct UninstallBatch
+    {
+        struct Entry
+        {
+            std::string id;
+            std::string installDir;         ///< Flat layout directory to prune
+            std::string installRoot;        ///< Versioned layout root to remove
+            std::vector<std::string> files; ///< Installed file paths
+        };
+
+        std::vector<Entry> entries;
+        UninstallResult result;
+        UninstallCallback done; ///< Called with the result before UninstallComplete
+    };
+
+    /// Collects the installed files of each package. Loop thread only.
+    UninstallBatch prepareUninstall(const StringVec& ids, bool whiny);
+
+    /// Deletes the files of a batch. Safe to call from any thread.
+    void removeUninstallFiles(UninstallBatch& batch);
+
+    /// Removes manifests and package records and emits the result.
+    /// Loop thread only.
+    void completeUninstall(UninstallBatch& batch);
+
+    /// Returns true if an asynchronous uninstall of the package is
+    /// pending. Requires _mutex.
+    bool isUninstalling(const std::string& id) const;
+
+    /// Makes @p next the published snapshot.
+    void swapSnapshot(PackageSnapshot::Ptr next);
+
 protected:
     mutable std::mutex _mutex;
     LocalPackageStore _localPackages;
     RemotePackageStore _remotePackages;
     InstallTaskPtrVec _tasks;
+    std::vector<QueuedTask> _queuedTasks;      ///< Scheduled tasks not started yet
+    std::vector<InstallTask*> _scheduledTasks; ///< Scheduled tasks which are running
+    StringVec _uninstalling;                   ///< Packages in pending uninstall batches
     Options _options;
+    mutable std::unique_ptr<WorkerPool> _workerPool; ///< Created on first use
+    std::unique_ptr<ChecksumCache> _checksumCache;
+    MetricsRegistry _metrics;
+    std::shared_ptr<Tracer> _tracer;
+    PackageSnapshot::Ptr _snapshot;        ///< Guarded by _snapshotMutex
+    mutable std::mutex _snapshotMutex;     ///< Held only to copy or swap _snapshot
+    std::mutex _publishMutex;              ///< Serializes writers; readers never take it
+    std::string _queryError;
+
+    friend class Transaction;
 };
 
 
@@ -0,0 +1,125 @@
+///
+//
+// icey
+// Copyright (c) 2005, icey <https://0state.com>
+//
+// SPDX-License-Identifier: LGPL-2.1+
+//
+/// @addtogroup pacm
+/// @{
+
+
+#pragma once
+
+
+#include "icy/json/json.h"
+#include "icy/pacm/config.h"
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace icy {
+namespace pacm {
+
+
+/// Records timed spans and writes them in the Chrome trace event format,
+/// which can be viewed in about://tracing or Perfetto.
+///
+/// Spans are grouped into lanes, shown as threads in the viewer. Each
+/// thread has its own lane, and named lanes can be created for work
+/// which moves between threads, such as an install task. Spans in a
+/// lane must nest. All methods are thread safe.
+class Pacm_API Tracer
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /// Times a span from construction to destruction.
+    /// Does nothing if the tracer is null, so spans can be placed
+    /// unconditionally.
+    class Pacm_API Span
+    {
+    public:
+        /// @param lane Lane to record in; 0 uses the calling thread.
+        Span(Tracer* tracer, std::string name, const char* category, uint64_t lane = 0);
+        ~Span() noexcept;
+
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+
+        /// Attaches an argument shown with the span.
+        void arg(const std::string& key, json::Value value);
+
+    protected:
+        Tracer* _tracer;
+        std::string _name;
+        const char* _category;
+        uint64_t _lane;
+        Clock::time_point _start;
+        json::Value _args;
+    };
+
+    Tracer();
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    /// Records a span in @p lane; 0 uses the calling thread.
+    void complete(const std::string& name, const char* category,
+                  Clock::time_point start, Clock::time_point end,
+                  uint64_t lane = 0, json::Value args = json::Value());
+
+    /// Creates a lane labelled @p name and returns its ID.
+    uint64_t lane(const std::string& name);
+
+    /// Returns the lane of the calling thread.
+    uint64_t threadLane();
+
+    /// Returns the number of recorded spans.
+    size_t size() const;
+
+    /// Discards the recorded spans; lanes are kept.
+    void clear();
+
+    /// Returns the trace as a Chrome trace event JSON object.
+    json::Value toJson() const;
+
+    /// Writes the trace as Chrome trace event JSON.
+    void write(std::ostream& os) const;
+
+    /// Writes the trace to @p path.
+    /// @throws std::runtime_error if the file cannot be written.
+    void writeFile(const std::string& path) const;
+
+protected:
+    struct Event
+    {
+        std::string name;
+        const char* category;
+        uint64_t lane;
+        Clock::time_point start;
+        Clock::time_point end;
+        json::Value args;
+    };
+
+    mutable std::mutex _mutex;
+    Clock::time_point _origin;
+    std::vector<Event> _events;
+    std::map<uint64_t, std::string> _laneNames;
+    std::map<std::thread::id, uint64_t> _threadLanes;
+    uint64_t _nextLane;
+};
+
+
+} // namespace pacm
+} // namespace icy
+
+
+/// @}
@@ -0,0 +1,161 @@
+///
+//
+// icey
+// Copyright (c) 2005, icey <https://0state.com>
+//
+// SPDX-License-Identifier: LGPL-2.1+
+//
+/// @addtogroup pacm
+/// @{
+
+
+#pragma once
+
+
+#include "icy/pacm/config.h"
+#include "icy/pacm/installtask.h"
+#include "icy/pacm/packagemanager.h"
+
+#include <memory>
+
+
+namespace icy {
+namespace pacm {
+
+
+/// Stages a set of installs, updates and uninstalls and applies them as
+/// one unit.
+///
+/// On commit() every package is scheduled for download and extraction
+/// like any other install, and held before finalization. Once all of
+/// them are staged they are finalized together, and the uninstalls are
+/// applied last. If any package fails to stage, nothing is finalized
+/// and every package is restored to its previous state. If a package fails to finalize, the
+/// packages already finalized are rolled back to their previous version.
+///
+/// Rolling back a finalized package requires the versioned install
+/// layout (`Options::versionedInstalls`), where the previous version is
+/// still on disk. Files overwritten in the flat layout, including by a
+/// finalization which failed part way, cannot be restored; such a
+/// transaction ends in the Failed state rather than RolledBack.
+class Pacm_API Transaction : public std::enable_shared_from_this<Transaction>
+{
+public:
+    using Ptr = std::shared_ptr<Transaction>;
+
+    /// Transaction life cycle.
+    enum class State
+    {
+        Pending,    ///< Collecting operations
+        Staging,    ///< Downloading and extracting
+        Committing, ///< Finalizing staged packages
+        Committed,  ///< All operations applied
+        RolledBack, ///< Nothing applied, or all changes reverted
+        Failed      ///< Some changes were applied and could not be reverted
+    };
+
+    /// Use PackageManager::beginTransaction().
+    explicit Transaction(PackageManager& manager);
+    virtual ~Transaction() noexcept;
+
+    Transaction(const Transaction&) = delete;
+    Transaction& operator=(const Transaction&) = delete;
+
+    /// Stages the installation of a package.
+    virtual void install(const std::string& id,
+                         const InstallOptions& options = InstallOptions());
+
+    /// Stages the update of an installed package.
+    virtual void update(const std::string& id,
+                        const InstallOptions& options = InstallOptions());
+
+    /// Stages the removal of an installed package.
+    virtual void uninstall(const std::string& id);
+
+    /// Starts staging all packages. Complete is emitted once the
+    /// transaction has been committed or rolled back; a package which
+    /// cannot be installed rolls the transaction back.
+    /// The transaction keeps itself alive until then.
+    /// @throws std::runtime_error if the transaction was already committed.
+    virtual void commit();
+
+    /// Aborts a transaction which is still staging and restores every
+    /// package. Has no effect once the commit has begun.
+    virtual void rollback();
+
+    /// Returns the current state.
+    virtual State state() const;
+
+    /// Returns true once committed, rolled back or failed.
+    virtual bool complete() const;
+
+    /// Returns true if the transaction was committed.
+    virtual bool success() const;
+
+    /// Returns the errors which caused a rollback or failure. A committed
+    /// transaction may report nonfatal uninstall errors.
+    virtual const StringVec& errors() const;
+
+    /// Signals when the transaction is committed, rolled back or failed.
+    Signal<void(Transaction&)> Complete;
+
+protected:
+    /// A staged install or update.
+    struct Operation
+    {
+        std::string id;
+        InstallOptions options;
+        bool update = false;
+        InstallTask::Ptr task;
+        json::Value backup;          ///< Local package before the transaction
+        bool existed = false;        ///< Local package existed before
+        std::string previousVersion; ///< Installed versioned layout version
+        bool scheduled = false; ///< Handed to the manager scheduler
+        bool staged = false;
+        bool partial = false; ///< Flat finalization failed after files may have moved
+    };
+
+    void onTaskStateChange(void* sender, InstallationState& state,
+                           const InstallationState& oldState);
+    void onTaskComplete(InstallTask& task);
+    void onUninstallComplete(const UninstallResult& result);
+
+    /// Releases every hold once all packages are staged.
+    void commitStaged();
+
+    /// Cancels staging tasks and restores packages once they are done.
+    void abort(const std::string& error);
+
+    /// Called once every task has completed.
+    void tasksComplete();
+
+    /// Restores the local packages to their state before the transaction.
+    void restorePackages();
+
+    /// Rolls back packages finalized before a commit failure.
+    void revertCommitted();
+
+    void finish(State state);
+
+    Operation* find(const InstallTask& task);
+
+    /// Returns the event loop of the transaction's tasks.
+    uv::Loop* loop() const;
+
+    PackageManager& _manager;
+    std::vector<Operation> _operations;
+    StringVec _uninstalls;
+    StringVec _errors;
+    State _state;
+    size_t _remaining; ///< Tasks which have not completed
+    bool _aborting;
+    bool _irreversible; ///< Changes were applied which cannot be reverted
+    Ptr _self;
+};
+
+
+} // namespace pacm
+} // namespace icy
+
+
+/// @}
@@ -0,0 +1,98 @@
+///
+//
+// icey
+// Copyright (c) 2005, icey <https://0state.com>
+//
+// SPDX-License-Identifier: LGPL-2.1+
+//
+/// @addtogroup pacm
+/// @{
+
+
+#pragma once
+
+
+#include "icy/loop.h"
+#include "icy/pacm/config.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace icy {
+namespace pacm {
+
+
+/// Fixed-size pool of worker threads for blocking filesystem and CPU work.
+class Pacm_API WorkerPool
+{
+public:
+    /// @param threads Number of worker threads; 0 uses the hardware concurrency.
+    explicit WorkerPool(unsigned threads = 0);
+
+    /// Finishes all queued jobs and joins the worker threads.
+    ~WorkerPool() noexcept;
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+    WorkerPool(WorkerPool&&) = delete;
+    WorkerPool& operator=(WorkerPool&&) = delete;
+
+    /// Queues @p job to run on a worker thread. Jobs with a higher
+    /// @p priority run first; jobs of equal priority run in order.
+    /// Exceptions thrown by the job are logged and swallowed.
+    void post(std::function<void()> job, int priority = 0);
+
+    /// Calls @p fn for every index in [0, count) using the worker threads
+    /// and the calling thread, and returns once all calls have finished.
+    /// The calling thread always takes part, so this is safe to call from
+    /// a worker thread even when the pool is saturated.
+    /// The first exception thrown by @p fn is rethrown after all calls finish.
+    /// Helper jobs are queued at the priority of the job running on the
+    /// calling thread, or 0 from any other thread.
+    void parallelFor(size_t count, const std::function<void(size_t)>& fn);
+
+    /// Calls @p fn like parallelFor(), queuing the helper jobs at @p priority.
+    void parallelFor(size_t count, const std::function<void(size_t)>& fn, int priority);
+
+    /// Runs @p work on a worker thread, then calls @p done on the thread
+    /// running @p loop with the exception thrown by @p work, if any.
+    /// Must be called from the loop thread. The pending job keeps the
+    /// loop alive until @p done has been called.
+    void submit(uv::Loop* loop, std::function<void()> work,
+                std::function<void(std::exception_ptr)> done, int priority = 0);
+
+    /// Returns the number of worker threads.
+    unsigned size() const;
+
+    /// Returns the priority of the job running on the calling thread,
+    /// or 0 if it is not running a pool job.
+    static int currentPriority();
+
+protected:
+    void work();
+
+    struct Job
+    {
+        std::function<void()> fn;
+        int priority;
+    };
+
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::deque<Job> _jobs; ///< Ordered by descending priority
+    std::vector<std::thread> _threads;
+    bool _stopping;
+};
+
+
+} // namespace pacm
+} // namespace icy
+
+
+/// @}
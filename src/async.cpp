@@ -0,0 +1,54 @@
+///
+//
+// icey
+// Copyright (c) 2005, icey <https://0state.com>
+//
+// SPDX-License-Identifier: LGPL-2.1+
+//
+/// @addtogroup pacm
+/// @{
+
+
+#include "icy/pacm/async.h"
+
+
+namespace icy {
+namespace pacm {
+
+
+void runOnLoop(uv::Loop* loop, std::function<void()> fn)
+{
+    // A one-shot async handle runs on the next loop iteration, after the
+    // current callback and its signal dispatch have fully unwound.
+    struct Call
+    {
+        uv_async_t async;
+        std::function<void()> fn;
+    };
+
+    auto call = new Call;
+    call->fn = std::move(fn);
+    call->async.data = call;
+    uv_async_init(loop, &call->async, [](uv_async_t* async) {
+        auto call = static_cast<Call*>(async->data);
+        auto fn = std::move(call->fn);
+        uv_close(reinterpret_cast<uv_handle_t*>(async), [](uv_handle_t* handle) {
+            delete static_cast<Call*>(handle->data);
+        });
+        fn();
+    });
+    uv_async_send(&call->async);
+}
+
+
+void resumeOnLoop(uv::Loop* loop, std::coroutine_handle<> handle)
+{
+    runOnLoop(loop, [handle]() { handle.resume(); });
+}
+
+
+} // namespace pacm
+} // namespace icy
+
+
+/// @}
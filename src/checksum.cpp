@@ -0,0 +1,398 @@
+///
+//
+// icey
+// Copyright (c) 2005, icey <https://0state.com>
+//
+// SPDX-License-Identifier: LGPL-2.1+
+//
+/// @addtogroup pacm
+/// @{
+
+
+#include "icy/pacm/checksum.h"
+#include "icy/crypto/hash.h"
+#include "icy/json/json.h"
+#include "icy/logger.h"
+#include "icy/pacm/workerpool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+
+namespace icy {
+namespace pacm {
+
+
+namespace {
+
+
+/// Read size for streamed digests; large enough to keep the hardware
+/// accelerated hash busy between reads.
+constexpr size_t kReadSize = 1024 * 1024;
+
+
+/// Files modified more recently than this before hashing began are not
+/// cached, covering file systems with coarse timestamps.
+constexpr std::chrono::seconds kRacyInterval(2);
+
+
+std::string toHex(const ByteVec& digest)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(digest.size() * 2);
+    for (auto byte : digest) {
+        hex += digits[(static_cast<unsigned char>(byte) >> 4) & 0xf];
+        hex += digits[static_cast<unsigned char>(byte) & 0xf];
+    }
+    return hex;
+}
+
+
+/// Returns the root digest from the file size and the chunk digests.
+std::string treeRoot(uint64_t size, const std::vector<ByteVec>& leaves)
+{
+    char length[8];
+    for (int i = 0; i < 8; i++)
+        length[i] = static_cast<char>((size >> (8 * i)) & 0xff);
+
+    crypto::Hash root("SHA256");
+    root.update(length, sizeof(length));
+    for (const auto& leaf : leaves)
+        root.update(leaf.data(), leaf.size());
+    return toHex(root.digest());
+}
+
+
+std::string streamChecksum(const std::string& algorithm, const std::string& path,
+                           const std::function<void()>& checkpoint)
+{
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if (!file)
+        throw std::runtime_error("Cannot open file: " + path);
+
+    crypto::Hash engine(algorithm);
+    std::vector<char> buffer(kReadSize);
+    while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
+        if (checkpoint)
+            checkpoint();
+        engine.update(buffer.data(), static_cast<size_t>(file.gcount()));
+    }
+    if (file.bad())
+        throw std::runtime_error("Cannot read file: " + path);
+    return toHex(engine.digest());
+}
+
+
+std::string treeFileChecksum(const std::string& path, WorkerPool* pool,
+                             const std::function<void()>& checkpoint)
+{
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(path, ec);
+    if (ec)
+        throw std::runtime_error("Cannot open file: " + path + ": " + ec.message());
+
+    const size_t chunkSize = TREE_CHECKSUM_CHUNK_SIZE;
+    size_t chunks = static_cast<size_t>((size + chunkSize - 1) / chunkSize);
+    std::vector<ByteVec> leaves(chunks);
+
+    // Each stripe reads a contiguous run of chunks through its own
+    // stream and buffer, so reads stay sequential per thread.
+    size_t stripes = std::min<size_t>(chunks, pool ? pool->size() + 1 : 1);
+    auto hashStripe = [&](size_t stripe) {
+        size_t first = chunks * stripe / stripes;
+        size_t last = chunks * (stripe + 1) / stripes;
+
+        std::ifstream file(path, std::ios::in | std::ios::binary);
+        if (!file)
+            throw std::runtime_error("Cannot open file: " + path);
+        file.seekg(static_cast<std::streamoff>(first * chunkSize));
+
+        std::vector<char> buffer(chunkSize);
+        for (size_t chunk = first; chunk < last; chunk++) {
+            if (checkpoint)
+                checkpoint();
+            size_t length = static_cast<size_t>(
+                std::min<uint64_t>(chunkSize, size - uint64_t(chunk) * chunkSize));
+            if (!file.read(buffer.data(), length))
+                throw std::runtime_error("Cannot read file: " + path);
+
+            crypto::Hash leaf("SHA256");
+            leaf.update(buffer.data(), length);
+            leaves[chunk] = leaf.digest();
+        }
+    };
+
+    if (stripes > 1)
+        pool->parallelFor(stripes, hashStripe);
+    else if (stripes == 1)
+        hashStripe(0);
+    return treeRoot(size, leaves);
+}
+
+
+} // namespace
+
+
+std::string checksumFile(const std::string& algorithm, const std::string& path,
+                         WorkerPool* pool, const std::function<void()>& checkpoint)
+{
+    if (algorithm == TREE_CHECKSUM_ALGORITHM)
+        return treeFileChecksum(path, pool, checkpoint);
+    return streamChecksum(algorithm, path, checkpoint);
+}
+
+
+std::string treeChecksum(const char* data, size_t size)
+{
+    const size_t chunkSize = TREE_CHECKSUM_CHUNK_SIZE;
+    std::vector<ByteVec> leaves;
+    for (size_t offset = 0; offset < size; offset += chunkSize) {
+        crypto::Hash leaf("SHA256");
+        leaf.update(data + offset, std::min(chunkSize, size - offset));
+        leaves.push_back(leaf.digest());
+    }
+    return treeRoot(size, leaves);
+}
+
+
+//
+// File Identity
+//
+
+
+FileIdentity FileIdentity::of(const std::string& path, std::error_code& ec)
+{
+    FileIdentity identity;
+    ec.clear();
+#ifdef _WIN32
+    auto status = std::filesystem::status(path, ec);
+    if (ec)
+        return identity;
+    if (!std::filesystem::is_regular_file(status)) {
+        ec = std::make_error_code(std::errc::invalid_argument);
+        return identity;
+    }
+    identity.size = std::filesystem::file_size(path, ec);
+    if (ec)
+        return identity;
+    auto mtime = std::chrono::clock_cast<std::chrono::system_clock>(
+        std::filesystem::last_write_time(path, ec));
+    if (ec)
+        return identity;
+    identity.mtimeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           mtime.time_since_epoch())
+                           .count();
+#else
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) {
+        ec = std::error_code(errno, std::generic_category());
+        return identity;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        ec = std::make_error_code(std::errc::invalid_argument);
+        return identity;
+    }
+#ifdef __APPLE__
+    const auto& mtime = st.st_mtimespec;
+    const auto& ctime = st.st_ctimespec;
+#else
+    const auto& mtime = st.st_mtim;
+    const auto& ctime = st.st_ctim;
+#endif
+    identity.device = static_cast<uint64_t>(st.st_dev);
+    identity.inode = static_cast<uint64_t>(st.st_ino);
+    identity.size = static_cast<uint64_t>(st.st_size);
+    identity.mtimeNs = int64_t(mtime.tv_sec) * 1000000000 + mtime.tv_nsec;
+    identity.ctimeNs = int64_t(ctime.tv_sec) * 1000000000 + ctime.tv_nsec;
+#endif
+    return identity;
+}
+
+
+bool FileIdentity::operator==(const FileIdentity& other) const
+{
+    return device == other.device && inode == other.inode && size == other.size &&
+           mtimeNs == other.mtimeNs && ctimeNs == other.ctimeNs;
+}
+
+
+//
+// Checksum Cache
+//
+
+
+ChecksumCache::ChecksumCache(std::string path)
+    : _path(std::move(path))
+{
+}
+
+
+std::string ChecksumCache::checksum(const std::string& algorithm, const std::string& path,
+                                    WorkerPool* pool, const std::function<void()>& checkpoint)
+{
+    std::string digest = lookup(algorithm, path);
+    if (!digest.empty())
+        return digest;
+    _misses.fetch_add(1, std::memory_order_relaxed);
+
+    // Hash without the lock, and only remember the result if the file
+    // was not modified while or shortly before it was read
+    std::error_code ec;
+    auto before = FileIdentity::of(path, ec);
+    auto started = std::chrono::system_clock::now();
+    digest = checksumFile(algorithm, path, pool, checkpoint);
+    if (ec)
+        return digest;
+
+    auto after = FileIdentity::of(path, ec);
+    auto settled = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       (started - kRacyInterval).time_since_epoch())
+                       .count();
+    if (ec || after != before || after.mtimeNs >= settled)
+        return digest;
+
+    std::lock_guard<std::mutex> guard(_mutex);
+    load();
+    _entries[path] = Entry{after, algorithm, digest};
+    _dirty = true;
+    return digest;
+}
+
+
+std::string ChecksumCache::lookup(const std::string& algorithm, const std::string& path)
+{
+    std::error_code ec;
+    auto identity = FileIdentity::of(path, ec);
+
+    std::lock_guard<std::mutex> guard(_mutex);
+    load();
+    auto it = _entries.find(path);
+    if (it == _entries.end())
+        return "";
+    if (ec || it->second.identity != identity) {
+        _entries.erase(it);
+        _dirty = true;
+        return "";
+    }
+    if (it->second.algorithm != algorithm)
+        return "";
+    _hits.fetch_add(1, std::memory_order_relaxed);
+    return it->second.digest;
+}
+
+
+void ChecksumCache::invalidate(const std::string& path)
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    load();
+    if (_entries.erase(path))
+        _dirty = true;
+}
+
+
+void ChecksumCache::clear()
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    load();
+    if (!_entries.empty())
+        _dirty = true;
+    _entries.clear();
+}
+
+
+size_t ChecksumCache::size()
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    load();
+    return _entries.size();
+}
+
+
+void ChecksumCache::load()
+{
+    if (_loaded)
+        return;
+    _loaded = true;
+    if (_path.empty() || !std::filesystem::exists(_path))
+        return;
+
+    try {
+        json::Value root;
+        json::loadFile(_path, root);
+        json::Value entries = root.value("entries", json::Value::object());
+        for (const auto& [path, value] : entries.items()) {
+            Entry entry;
+            entry.algorithm = value.at("algorithm").get<std::string>();
+            entry.digest = value.at("digest").get<std::string>();
+            entry.identity.device = value.at("device").get<uint64_t>();
+            entry.identity.inode = value.at("inode").get<uint64_t>();
+            entry.identity.size = value.at("size").get<uint64_t>();
+            entry.identity.mtimeNs = value.at("mtime").get<int64_t>();
+            entry.identity.ctimeNs = value.at("ctime").get<int64_t>();
+
+            // Drop files which have changed or gone since the last run
+            std::error_code ec;
+            if (FileIdentity::of(path, ec) == entry.identity && !ec)
+                _entries[path] = std::move(entry);
+            else
+                _dirty = true;
+        }
+    } catch (std::exception& exc) {
+        SWarn << "Ignoring invalid checksum cache: " << _path << ": " << exc.what() << std::endl;
+        _entries.clear();
+        _dirty = true;
+    }
+}
+
+
+void ChecksumCache::save()
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    if (!_dirty || _path.empty())
+        return;
+
+    json::Value entries = json::Value::object();
+    for (const auto& [path, entry] : _entries) {
+        entries[path] = {{"algorithm", entry.algorithm},
+                         {"digest", entry.digest},
+                         {"device", entry.identity.device},
+                         {"inode", entry.identity.inode},
+                         {"size", entry.identity.size},
+                         {"mtime", entry.identity.mtimeNs},
+                         {"ctime", entry.identity.ctimeNs}};
+    }
+    json::Value root = {{"version", 1}, {"entries", std::move(entries)}};
+
+    std::string temp = _path + ".tmp";
+    {
+        std::ofstream file(temp, std::ios::out | std::ios::trunc);
+        if (!file)
+            throw std::runtime_error("Cannot write checksum cache: " + temp);
+        file << root.dump();
+        if (!file.flush())
+            throw std::runtime_error("Cannot write checksum cache: " + temp);
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(temp, _path, ec);
+    if (ec)
+        throw std::runtime_error("Cannot write checksum cache: " + _path + ": " + ec.message());
+    _dirty = false;
+}
+
+
+} // namespace pacm
+} // namespace icy
+
+
+/// @}
@@ -0,0 +1,481 @@
+///
+//
+// icey
+// Copyright (c) 2005, icey <https://0state.com>
+//
+// SPDX-License-Identifier: LGPL-2.1+
+//
+/// @addtogroup pacm
+/// @{
+
+
+#include "icy/pacm/fileops.h"
+#include "icy/pacm/tracer.h"
+#include "icy/pacm/workerpool.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <set>
+#include <system_error>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+namespace stdfs = std::filesystem;
+
+
+namespace icy {
+namespace pacm {
+
+
+namespace {
+
+
+bool isBusyError(const std::error_code& ec)
+{
+    return ec == std::errc::device_or_resource_busy ||
+           ec == std::errc::text_file_busy
+#ifdef _WIN32
+           // Sharing violations surface as access denied on Windows
+           || ec == std::errc::permission_denied
+#endif
+        ;
+}
+
+
+// Returns the failed result for a tree which cannot be walked.
+FileResult walkError(const stdfs::path& sourceDir, const std::error_code& ec)
+{
+    FileResult result;
+    result.source = sourceDir.string();
+    result.error = ec.message() + ": " + result.source;
+    return result;
+}
+
+
+#ifdef __linux__
+struct FileDescriptor
+{
+    int fd;
+    explicit FileDescriptor(int fd)
+        : fd(fd)
+    {
+    }
+    ~FileDescriptor()
+    {
+        if (fd >= 0)
+            ::close(fd);
+    }
+};
+
+
+std::system_error lastError(const std::string& what)
+{
+    return std::system_error(errno, std::generic_category(), what);
+}
+#endif
+
+
+// Copies a file, symlink or directory tree across devices and removes
+// the source once the copy is in place. Files are copied to a temporary
+// name and renamed over the target so readers never see a partial file.
+void copyEntry(const stdfs::path& source, const stdfs::path& target)
+{
+    auto status = stdfs::symlink_status(source);
+    if (stdfs::is_directory(status)) {
+        stdfs::create_directories(target);
+        for (const auto& entry : stdfs::directory_iterator(source))
+            copyEntry(entry.path(), target / entry.path().filename());
+        stdfs::remove(source);
+        return;
+    }
+
+    stdfs::path temp(target.string() + ".pacm-tmp");
+    stdfs::remove(temp);
+    if (stdfs::is_symlink(status))
+        stdfs::copy_symlink(source, temp);
+    else
+        cloneFile(source.string(), temp.string());
+    stdfs::rename(temp, target);
+    stdfs::remove(source);
+}
+
+
+// Creates @p target as a reflink of @p source. Returns false without
+// leaving a target behind if the filesystem cannot share extents.
+bool reflinkFile(const std::string& source, const std::string& target)
+{
+#ifdef __linux__
+    FileDescriptor in(::open(source.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat st;
+    if (in.fd < 0 || ::fstat(in.fd, &st) != 0)
+        return false;
+
+    FileDescriptor out(::open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                              st.st_mode & 07777));
+    if (out.fd < 0)
+        return false;
+    if (::ioctl(out.fd, FICLONE, in.fd) == 0)
+        return true;
+
+    ::unlink(target.c_str());
+#endif
+    return false;
+}
+
+
+// Materializes a single file or symlink at a temporary name beside
+// the target and renames it into place.
+FileResult linkFile(const stdfs::path& source, const stdfs::path& target, bool allowHardlinks)
+{
+    FileResult result;
+    result.source = source.string();
+    result.target = target.string();
+
+    try {
+        stdfs::path temp(target.string() + ".pacm-tmp");
+        stdfs::remove(temp);
+
+        std::error_code ec;
+        if (stdfs::is_symlink(source)) {
+            stdfs::copy_symlink(source, temp);
+            result.outcome = FileResult::Copied;
+        } else if (reflinkFile(source.string(), temp.string())) {
+            result.outcome = FileResult::Linked;
+        } else {
+            if (allowHardlinks)
+                stdfs::create_hard_link(source, temp, ec);
+            if (allowHardlinks && !ec) {
+                result.outcome = FileResult::Linked;
+            } else {
+                cloneFile(source.string(), temp.string());
+                result.outcome = FileResult::Copied;
+            }
+        }
+
+        stdfs::rename(temp, target, ec);
+        if (ec) {
+            stdfs::remove(temp);
+            result.outcome = isBusyError(ec) ? FileResult::Busy : FileResult::Failed;
+            result.error = ec.message() + ": " + result.target;
+        } else if (stdfs::exists(stdfs::symlink_status(temp))) {
+            // Renaming a hardlink over another link to the same inode is
+            // a successful no-op which leaves the temporary name behind.
+            stdfs::remove(temp);
+        }
+    } catch (std::exception& exc) {
+        result.outcome = FileResult::Failed;
+        result.error = exc.what();
+    }
+    return result;
+}
+
+
+} // namespace
+
+
+bool cloneFile(const std::string& source, const std::string& target)
+{
+#ifdef __linux__
+    FileDescriptor in(::open(source.c_str(), O_RDONLY | O_CLOEXEC));
+    if (in.fd < 0)
+        throw lastError("open " + source);
+
+    struct stat st;
+    if (::fstat(in.fd, &st) != 0)
+        throw lastError("stat " + source);
+
+    FileDescriptor out(::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                              st.st_mode & 07777));
+    if (out.fd < 0)
+        throw lastError("open " + target);
+
+    // Share extents when the filesystem supports it
+    if (::ioctl(out.fd, FICLONE, in.fd) == 0)
+        return true;
+
+    // Copy in kernel space, falling back to read/write when the kernel
+    // refuses copy_file_range() between these filesystems.
+    off_t remaining = st.st_size;
+    bool kernelCopy = true;
+    while (remaining > 0 && kernelCopy) {
+        ssize_t n = ::copy_file_range(in.fd, nullptr, out.fd, nullptr,
+                                      static_cast<size_t>(remaining), 0);
+        if (n > 0) {
+            remaining -= n;
+            continue;
+        }
+        if (n == 0)
+            break;
+        if (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)
+            kernelCopy = false;
+        else
+            throw lastError("copy " + source);
+    }
+
+    if (!kernelCopy) {
+        char buffer[64 * 1024];
+        while (true) {
+            ssize_t n = ::read(in.fd, buffer, sizeof(buffer));
+            if (n == 0)
+                break;
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw lastError("read " + source);
+            }
+            for (ssize_t written = 0; written < n;) {
+                ssize_t w = ::write(out.fd, buffer + written, static_cast<size_t>(n - written));
+                if (w < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    throw lastError("write " + target);
+                }
+                written += w;
+            }
+        }
+    }
+    return false;
+#else
+    stdfs::copy_file(source, target, stdfs::copy_options::overwrite_existing);
+    return false;
+#endif
+}
+
+
+FileResult moveFile(const std::string& source, const std::string& target)
+{
+    FileResult result;
+    result.source = source;
+    result.target = target;
+
+    std::error_code ec;
+    stdfs::rename(source, target, ec);
+    if (!ec) {
+        result.outcome = FileResult::Moved;
+        return result;
+    }
+
+    if (ec == std::errc::cross_device_link) {
+        try {
+            copyEntry(source, target);
+            result.outcome = FileResult::Copied;
+        } catch (std::exception& exc) {
+            result.outcome = FileResult::Failed;
+            result.error = exc.what();
+        }
+        return result;
+    }
+
+    result.outcome = isBusyError(ec) ? FileResult::Busy : FileResult::Failed;
+    result.error = ec.message() + ": " + target;
+    return result;
+}
+
+
+FileResultVec moveTree(const std::string& sourceDir, const std::string& targetDir,
+                       WorkerPool* pool, Tracer* tracer)
+{
+    // Walk the source tree and create the target directory skeleton
+    // up front so the moves below are independent of each other.
+    // Directories missing from the target are moved wholesale.
+    std::vector<std::pair<stdfs::path, stdfs::path>> moves;
+    FileResultVec results;
+    const stdfs::path root(sourceDir);
+    const stdfs::path dest(targetDir);
+
+    std::error_code ec;
+    stdfs::create_directories(dest, ec);
+
+    // A tree which cannot be walked fails before anything is moved
+    std::error_code walk;
+    stdfs::recursive_directory_iterator it(root, walk);
+    for (; !walk && it != stdfs::recursive_directory_iterator(); it.increment(walk)) {
+        stdfs::path target = dest / it->path().lexically_relative(root);
+        if (it->is_directory(ec) && !it->is_symlink(ec)) {
+            if (stdfs::is_directory(target, ec))
+                continue; // merge into the existing directory
+
+            if (!stdfs::exists(stdfs::symlink_status(target, ec))) {
+                moves.emplace_back(it->path(), target);
+                it.disable_recursion_pending();
+                continue;
+            }
+
+            FileResult result;
+            result.source = it->path().string();
+            result.target = target.string();
+            result.error = "A file is in the way of directory: " + result.target;
+            results.push_back(std::move(result));
+            it.disable_recursion_pending();
+            continue;
+        }
+
+        moves.emplace_back(it->path(), target);
+    }
+    if (walk) {
+        results.push_back(walkError(root, walk));
+        return results;
+    }
+
+    size_t offset = results.size();
+    results.resize(offset + moves.size());
+    auto move = [&](size_t index) {
+        // Recorded on the lane of the worker thread doing the move
+        Tracer::Span span(tracer, moves[index].first.lexically_relative(root).string(), "finalize");
+        results[offset + index] = moveFile(moves[index].first.string(),
+                                           moves[index].second.string());
+    };
+
+    if (pool && moves.size() > 1)
+        pool->parallelFor(moves.size(), move);
+    else {
+        for (size_t i = 0; i < moves.size(); i++)
+            move(i);
+    }
+
+    return results;
+}
+
+
+FileResultVec linkTree(const std::string& sourceDir, const std::string& targetDir,
+                       bool allowHardlinks, WorkerPool* pool, Tracer* tracer)
+{
+    // Directories are always created rather than linked, so the
+    // source tree is never modified through the target.
+    std::vector<std::pair<stdfs::path, stdfs::path>> links;
+    FileResultVec results;
+    const stdfs::path root(sourceDir);
+    const stdfs::path dest(targetDir);
+
+    std::error_code ec;
+    stdfs::create_directories(dest, ec);
+
+    // A tree which cannot be walked fails before anything is linked
+    std::error_code walk;
+    stdfs::recursive_directory_iterator it(root, walk);
+    for (; !walk && it != stdfs::recursive_directory_iterator(); it.increment(walk)) {
+        stdfs::path target = dest / it->path().lexically_relative(root);
+        if (it->is_directory(ec) && !it->is_symlink(ec)) {
+            stdfs::create_directories(target, ec);
+            if (ec) {
+                FileResult result;
+                result.source = it->path().string();
+                result.target = target.string();
+                result.error = ec.message() + ": " + result.target;
+                results.push_back(std::move(result));
+                it.disable_recursion_pending();
+            }
+            continue;
+        }
+
+        links.emplace_back(it->path(), target);
+    }
+    if (walk) {
+        results.push_back(walkError(root, walk));
+        return results;
+    }
+
+    size_t offset = results.size();
+    results.resize(offset + links.size());
+    auto link = [&](size_t index) {
+        // Recorded on the lane of the worker thread doing the link
+        Tracer::Span span(tracer, links[index].first.lexically_relative(root).string(), "finalize");
+        results[offset + index] = linkFile(links[index].first, links[index].second,
+                                           allowHardlinks);
+    };
+
+    if (pool && links.size() > 1)
+        pool->parallelFor(links.size(), link);
+    else {
+        for (size_t i = 0; i < links.size(); i++)
+            link(i);
+    }
+
+    return results;
+}
+
+
+FileResultVec removeFiles(const std::vector<std::string>& paths, WorkerPool* pool)
+{
+    FileResultVec results(paths.size());
+    auto remove = [&](size_t index) {
+        FileResult& result = results[index];
+        result.source = paths[index];
+
+        std::error_code ec;
+        auto status = stdfs::symlink_status(result.source, ec);
+        if (stdfs::is_directory(status)) {
+            result.outcome = FileResult::Removed; // left to pruneEmptyDirs()
+            return;
+        }
+
+        stdfs::remove(result.source, ec);
+        if (!ec || ec == std::errc::no_such_file_or_directory) {
+            result.outcome = FileResult::Removed;
+            return;
+        }
+
+        result.outcome = isBusyError(ec) ? FileResult::Busy : FileResult::Failed;
+        result.error = ec.message() + ": " + result.source;
+    };
+
+    if (pool && paths.size() > 1)
+        pool->parallelFor(paths.size(), remove);
+    else {
+        for (size_t i = 0; i < paths.size(); i++)
+            remove(i);
+    }
+
+    return results;
+}
+
+
+size_t pruneEmptyDirs(const std::string& root, const std::vector<std::string>& paths)
+{
+    const stdfs::path base = stdfs::path(root).lexically_normal();
+
+    // Collect every directory between the paths and the root
+    std::set<stdfs::path> dirs;
+    for (const auto& path : paths) {
+        stdfs::path dir = stdfs::path(path).lexically_normal();
+        if (!dir.has_filename())
+            dir = dir.parent_path(); // trailing separator
+        if (!stdfs::is_directory(stdfs::symlink_status(dir)))
+            dir = dir.parent_path();
+
+        auto relative = dir.lexically_relative(base);
+        if (relative.empty() || *relative.begin() == "..")
+            continue; // outside the root
+
+        while (dir != base && dirs.insert(dir).second)
+            dir = dir.parent_path();
+    }
+
+    // Deepest first, so parents are empty by the time we reach them
+    std::vector<stdfs::path> ordered(dirs.begin(), dirs.end());
+    std::sort(ordered.begin(), ordered.end(), [](const stdfs::path& a, const stdfs::path& b) {
+        return std::distance(a.begin(), a.end()) > std::distance(b.begin(), b.end());
+    });
+
+    size_t removed = 0;
+    for (const auto& dir : ordered) {
+        std::error_code ec;
+        if (stdfs::is_empty(dir, ec) && !ec && stdfs::remove(dir, ec))
+            removed++;
+    }
+    return removed;
+}
+
+
+} // namespace pacm
+} // namespace icy
+
+
+/// @}
@@ -37,7 +37,7 @@ void InstallMonitor::onInstallStateChange(void* sender,
 {
     auto task = reinterpret_cast<InstallTask*>(sender);
 
-    SDebug << "onInstallStateChange: " << task << ": " << state << endl;
+    PacmDebug << "onInstallStateChange: " << task << ": " << state << endl;
 
     InstallStateChange.emit(*task, state, oldState);
 }
@@ -47,7 +47,7 @@ void InstallMonitor::onInstallComplete(InstallTask& task)
 {
     // auto task = reinterpret_cast<InstallTask*>(sender);
 
-    SDebug << "Package Install Complete: " << task.state().toString() << endl;
+    PacmDebug << "Package Install Complete: " << task.state().toString() << endl;
 
     // Notify listeners when each package completes.
     InstallComplete.emit(*task.local());
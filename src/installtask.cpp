@@ -11,17 +11,22 @@
 
 #include "icy/pacm/installtask.h"
 #include "icy/archo/zipfile.h"
-#include "icy/crypto/hash.h"
 #include "icy/http/authenticator.h"
 #include "icy/http/client.h"
 #include "icy/logger.h"
 #include "icy/packetio.h"
+#include "icy/pacm/checksum.h"
+#include "icy/pacm/fileops.h"
 #include "icy/pacm/package.h"
 #include "icy/pacm/packagemanager.h"
 
 #include "icy/filesystem.h"
 
 #include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <utility>
+#include <vector>
 
 using namespace std;
 
@@ -40,10 +45,20 @@ InstallTask::InstallTask(PackageManager& manager, LocalPackage* local, RemotePac
     , _downloading(false)
     , _dlconn(nullptr)
     , _loop(loop)
+    , _wakeup(nullptr)
+    , _working(false)
+    , _workDone(false)
+    , _busyFiles(false)
+    , _cancelling(false)
+    , _traceLane(0)
+    , _holdFinalize(false)
 {
     LTrace("Create");
+    _stats.created = InstallStats::Clock::now();
     if (!valid())
         throw std::runtime_error("Invalid install task configuration");
+    if (auto tracer = _manager.tracer())
+        _traceLane = tracer->lane("install " + _local->id());
 }
 
 
@@ -51,13 +66,17 @@ InstallTask::~InstallTask() noexcept
 {
     LTrace("Destory");
 
-    // :)
+    // Worker jobs reference the task, so let them finish first.
+    // A cancelled job stops at its next checkpoint.
+    waitForWork();
+    closeWakeup();
+    cleanupPartialPaths();
 }
 
 
 void InstallTask::start()
 {
-    STrace << "Starting: Name=" << _local->name()
+    PacmTrace << "Starting: Name=" << _local->name()
            << ", Version= " << _options.version
            << ", SDK Version=" << _options.sdkVersion << endl;
 
@@ -72,8 +91,25 @@ void InstallTask::start()
         _remote->latestSDKAsset(_options.sdkVersion); // throw if none
     }
 
+    // Versioned installs live in <base>/<id>/<version> and are
+    // exposed to the application through <base>/<id>/current.
+    if (_manager.options().versionedInstalls) {
+        validatePathComponent(_local->id(), "InstallTask");
+        std::string root;
+        if (!_options.installDir.empty())
+            root = fs::makePath(_options.installDir, _local->id());
+        else if (_local->isVersioned())
+            root = _local->installRoot();
+        else
+            root = fs::makePath(_manager.options().installDir, _local->id());
+
+        root = fs::normalize(root);
+        _local->setInstallRoot(root);
+        _options.installDir = fs::makePath(root, PACKAGE_CURRENT_LINK);
+    }
+
     // Set default install directory if none was given
-    if (_options.installDir.empty()) {
+    else if (_options.installDir.empty()) {
 
         // Use the current install dir if the local package already exists
         if (!_local->installDir().empty()) {
@@ -90,26 +126,122 @@ void InstallTask::start()
     _options.installDir = fs::normalize(_options.installDir);
     _local->setInstallDir(_options.installDir);
 
-    // Create the directory
-    fs::mkdirr(_options.installDir);
+    // Create the directory. The `current` link of a versioned install
+    // is created on finalize, so only its parent root is created here.
+    if (_local->isVersioned())
+        fs::mkdirr(_local->installRoot());
+    else
+        fs::mkdirr(_options.installDir);
 
     // If the package failed previously we might need
     // to clear the file cache.
     if (_manager.options().clearFailedCache)
         _manager.clearPackageCache(*_local);
 
-    _runner.start(std::bind(&InstallTask::run, this));
-
-    // Increment the event loop while the task active
-    _runner.handle().ref();
+    // Stage transitions are driven by completion events through an
+    // async handle, which also keeps the event loop alive while the
+    // task is active.
+    _wakeup = new uv_async_t;
+    _wakeup->data = this;
+    uv_async_init(_loop, _wakeup, [](uv_async_t* handle) {
+        if (auto task = static_cast<InstallTask*>(handle->data))
+            task->run();
+    });
+    wakeup();
 }
 
 
 void InstallTask::cancel(bool flag)
 {
     basic::Runnable::cancel(flag);
-    if (flag)
+    _cancelling = flag;
+    if (flag) {
+        // Abort the download now rather than waiting for it to complete
+        if (_dlconn) {
+            PacmDebug << "Aborting download" << endl;
+            _dlconn->IncomingProgress -= slot(this, &InstallTask::onDownloadProgress);
+            _dlconn->Complete -= slot(this, &InstallTask::onDownloadComplete);
+            _dlconn->close();
+            _dlconn = nullptr;
+            _downloading = false;
+        }
+
         setState(this, InstallationState::Cancelled);
+        wakeup();
+    }
+}
+
+
+void InstallTask::wakeup()
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    if (_wakeup)
+        uv_async_send(_wakeup);
+}
+
+
+bool InstallTask::offload(void (InstallTask::*work)())
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_working)
+        return false;
+
+    if (_workDone) {
+        _workDone = false;
+        if (auto error = std::exchange(_workError, nullptr))
+            std::rethrow_exception(error);
+        return true;
+    }
+
+    _working = true;
+    lock.unlock();
+    _manager.workerPool().post([this, work]() {
+        std::exception_ptr error;
+        try {
+            (this->*work)();
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        // Everything is done under the lock, since the task may be
+        // destroyed as soon as waitForWork() can acquire it.
+        std::lock_guard<std::mutex> guard(_mutex);
+        _working = false;
+        _workDone = true;
+        _workError = error;
+        _workCond.notify_all();
+        if (_wakeup)
+            uv_async_send(_wakeup);
+    }, _options.priority);
+    return false;
+}
+
+
+bool InstallTask::working() const
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    return _working;
+}
+
+
+void InstallTask::waitForWork()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _workCond.wait(lock, [this]() { return !_working; });
+}
+
+
+void InstallTask::closeWakeup()
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    if (!_wakeup)
+        return;
+
+    _wakeup->data = nullptr;
+    uv_close(reinterpret_cast<uv_handle_t*>(_wakeup), [](uv_handle_t* handle) {
+        delete reinterpret_cast<uv_async_t*>(handle);
+    });
+    _wakeup = nullptr;
 }
 
 
@@ -120,26 +252,55 @@ void InstallTask::run()
         switch (state().id()) {
             case InstallationState::None:
                 setProgress(0);
+
+                // A version held by the content store needs no download
+                if (hasStoredVersion()) {
+                    setState(this, InstallationState::Extracting);
+                    setProgress(75);
+                    break;
+                }
+
                 doDownload();
                 setState(this, InstallationState::Downloading);
                 break;
             case InstallationState::Downloading:
                 if (_downloading)
-                    return; // skip until download completes
+                    return; // woken again once the download completes
 
                 setState(this, InstallationState::Extracting);
+                setProgress(75);
                 break;
             case InstallationState::Extracting:
-                setProgress(75);
-                doExtract();
+                if (!offload(&InstallTask::doExtract))
+                    return; // woken again once extraction completes
+
                 setState(this, InstallationState::Finalizing);
+                setProgress(90);
                 break;
             case InstallationState::Finalizing:
-                setProgress(90);
-                doFinalize();
+                // Dependency files must be in place before ours
+                if (!_dependencies.empty())
+                    return; // woken again once dependencies are installed
+                if (_holdFinalize)
+                    return; // woken again once the hold is released
+
+                if (!offload(&InstallTask::doFinalize))
+                    return; // woken again once finalization completes
+
+                // The package requires finalizing at a later date.
+                // The current task will be cancelled, and the package
+                // saved with the Installing state.
+                if (_busyFiles) {
+                    PacmDebug << "Finalization failed, cancelling task" << endl;
+                    cancel();
+                    break;
+                }
+
                 local->setState("Installed");
                 local->clearErrors();
                 local->setInstalledAsset(getRemoteAsset());
+                if (local->isVersioned())
+                    _manager.retainPackageVersion(*local);
                 setProgress(100); // set before state change
 
                 // Transition the internal state if finalization was a success.
@@ -150,11 +311,18 @@ void InstallTask::run()
                 setComplete(); // complete and destroy
                 return;
             case InstallationState::Cancelled:
+                if (working())
+                    return; // woken again once the worker is done
+
+                cleanupPartialPaths();
                 local->setState("Failed");
                 setProgress(100);
                 setComplete(); // complete and destroy
                 return;
             case InstallationState::Failed:
+                if (working())
+                    return; // woken again once the worker is done
+
                 local->setState("Failed");
                 if (_error.any())
                     local->addError(_error.message);
@@ -169,17 +337,27 @@ void InstallTask::run()
         _error.message = exc.what();
         setState(this, InstallationState::Failed);
     }
+
+    // Run the next stage straight away unless we are waiting on the
+    // download, which wakes us again from onDownloadComplete().
+    if (!_downloading)
+        wakeup();
 }
 
 
 void InstallTask::onStateChange(InstallationState& state, const InstallationState& oldState)
 {
-    SDebug << "State changed: " << oldState << " => " << state << endl;
+    PacmDebug << "State changed: " << oldState << " => " << state << endl;
 
     // Set the package install task so we know from which state to
     // resume installation.
     // TODO: Should this be reset by the clearFailedCache option?
     local()->setInstallState(state.toString());
+    _manager.publishPackage(local()->id());
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _stats.transitions.push_back({state.id(), InstallStats::Clock::now()});
+    }
 
     Stateful<InstallationState>::onStateChange(state, oldState);
 }
@@ -203,8 +381,9 @@ void InstallTask::doDownload()
         cred.authenticate(_dlconn->request());
     }
 
-    SDebug << "Initializing download: URL=" << asset.url() << ", File path=" << outfile << endl;
+    PacmDebug << "Initializing download: URL=" << asset.url() << ", File path=" << outfile << endl;
 
+    addPartialPath(outfile);
     _dlconn->setReadStream(
         new std::ofstream(outfile, std::ios_base::out | std::ios_base::binary));
     _dlconn->IncomingProgress += slot(this, &InstallTask::onDownloadProgress);
@@ -217,7 +396,7 @@ void InstallTask::doDownload()
 
 void InstallTask::onDownloadProgress(const double& progress)
 {
-    SDebug << "Download progress: " << progress << endl;
+    PacmTrace << "Download progress: " << progress << endl;
 
     // Progress 1 - 75 covers download
     // Increments of 10 or greater
@@ -229,21 +408,44 @@ void InstallTask::onDownloadProgress(const double& progress)
 
 void InstallTask::onDownloadComplete(const http::Response& response)
 {
-    SDebug << "Download complete: " << response << endl;
+    PacmDebug << "Download complete: " << response << endl;
+    std::string outfile = _manager.getCacheFilePath(getRemoteAsset().fileName());
+    removePartialPath(outfile);
+    {
+        std::error_code ec;
+        auto size = std::filesystem::file_size(outfile, ec);
+        std::lock_guard<std::mutex> guard(_mutex);
+        _stats.bytesDownloaded = ec ? 0 : size;
+    }
     _dlconn->close();
     _dlconn = nullptr;
     _downloading = false;
+    wakeup();
 }
 
 
 void InstallTask::doExtract()
 {
-    setState(this, InstallationState::Extracting);
-
     Package::Asset asset = getRemoteAsset();
     if (!asset.valid())
         throw std::runtime_error("The package can't be extracted");
 
+    // Reuse a complete extraction from the content store
+    bool contentStore = _manager.options().contentStore;
+    std::string storeDir;
+    if (contentStore) {
+        storeDir = _manager.getPackageStoreDir(_local->id(), asset.version());
+        if (_manager.hasStoredPackage(_local->id(), asset.version())) {
+            PacmDebug << "Using stored package: " << storeDir << endl;
+            json::Value manifest;
+            json::loadFile(storeDir + ".json", manifest);
+            std::lock_guard<std::recursive_mutex> guard(_local->mutex());
+            _local->manifest().root = manifest;
+            _local->setPendingVersion(asset.version());
+            return;
+        }
+    }
+
     // Get the input file and check veracity
     std::string archivePath(_manager.getCacheFilePath(asset.fileName()));
     if (!fs::exists(archivePath))
@@ -255,87 +457,152 @@ void InstallTask::doExtract()
     // Verify file checksum if one was provided
     std::string originalChecksum(asset.checksum());
     if (!originalChecksum.empty()) {
-        std::string computedChecksum(crypto::checksum(
+        Tracer::Span span(_manager.tracer(), "checksum", "extract", _traceLane);
+        auto started = InstallStats::Clock::now();
+        std::string computedChecksum(computeChecksum(
             _manager.options().checksumAlgorithm, archivePath));
-        SDebug << "Verify checksum: original=" << originalChecksum
+        {
+            std::lock_guard<std::mutex> guard(_mutex);
+            _stats.checksumTime += InstallStats::Clock::now() - started;
+        }
+        PacmDebug << "Verify checksum: original=" << originalChecksum
                << ", computed=" << computedChecksum << endl;
         if (originalChecksum != computedChecksum)
             throw std::runtime_error("Checksum verification failed: " + fs::extname(archivePath));
     }
 
-    // Create the output directory
-    std::string tempDir(_manager.getPackageDataDir(_local->id()));
+    // Create the output directory. Content store extractions go to a
+    // partial directory which is only published once complete.
+    std::string tempDir(contentStore ? storeDir + ".partial"
+                                     : _manager.getPackageDataDir(_local->id()));
+    addPartialPath(tempDir);
+    if (contentStore) {
+        std::filesystem::remove_all(tempDir);
+        fs::mkdirr(tempDir);
+    }
 
-    SDebug << "Unpacking archive: " << archivePath << " to " << tempDir << endl;
+    PacmDebug << "Unpacking archive: " << archivePath << " to " << tempDir << endl;
 
     // Reset the local installation manifest before extraction
-    _local->manifest().root.clear();
+    {
+        std::lock_guard<std::recursive_mutex> guard(_local->mutex());
+        _local->manifest().root.clear();
+        _local->setPendingVersion(asset.version());
+    }
 
-    // Decompress the archive
+    // Decompress the archive, checking for cancellation between entries
     archo::ZipFile zip(archivePath);
     while (true) {
+        checkCancelled();
+
         // Validate zip entry name to prevent path traversal attacks
         std::string entryName = zip.currentFileName();
         if (entryName.find("..") != std::string::npos)
             throw std::runtime_error("Path traversal detected in archive entry: " + entryName);
+        Tracer::Span span(_manager.tracer(), entryName, "extract", _traceLane);
 
         (void)zip.extractCurrentFile(tempDir, true);
+        {
+            std::error_code ec;
+            auto size = std::filesystem::file_size(fs::makePath(tempDir, entryName), ec);
+            std::lock_guard<std::mutex> guard(_mutex);
+            _stats.entries++;
+            if (!ec)
+                _stats.bytesWritten += size;
+        }
 
         // Add the extracted file to the package install manifest
         // Note: Manifest stores relative paths
-        _local->manifest().addFile(entryName);
+        {
+            std::lock_guard<std::recursive_mutex> guard(_local->mutex());
+            _local->manifest().addFile(entryName);
+        }
 
         if (!zip.goToNextFile())
             break;
     }
+
+    if (contentStore) {
+        std::filesystem::remove_all(storeDir);
+        fs::rename(tempDir, storeDir);
+        std::lock_guard<std::recursive_mutex> guard(_local->mutex());
+        json::saveFile(storeDir + ".json", _local->manifest().root);
+    }
+    removePartialPath(tempDir);
 }
 
 
 void InstallTask::doFinalize()
 {
-    setState(this, InstallationState::Finalizing);
-
-    bool errors = false;
+    // Last chance to cancel: a flat install is not interrupted once
+    // files start moving, since that would leave a mixed-version tree.
+    checkCancelled();
+    _busyFiles = false;
     std::string tempDir(_manager.getPackageDataDir(_local->id()));
     std::string installDir = options().installDir;
 
+    if (_local->isVersioned()) {
+        doFinalizeVersion(tempDir);
+        return;
+    }
+
     // Ensure the install directory exists
     fs::mkdirr(installDir);
-    SDebug << "Finalizing to: " << installDir << endl;
-
-    // Move all extracted files to the installation path
-    std::vector<std::string> entries;
-    fs::readdir(tempDir, entries);
-    for (const auto& source : entries) {
-        try {
-            std::string target = fs::makePath(installDir, fs::filename(source));
-
-            SDebug << "moving file: " << source << " => " << target << endl;
-            fs::rename(source, target);
-        } catch (std::exception& exc) {
-            // The previous version files may be currently in use,
-            // in which case PackageManager::finalizeInstallations()
-            // must be called from an external process before the
-            // installation can be completed.
-            errors = true;
-            SError << "finalize error: " << exc.what() << endl;
-            _local->addError(exc.what());
+    PacmDebug << "Finalizing to: " << installDir << endl;
+
+    // Move all extracted files to the installation path, merging into
+    // existing directories. Entries on another filesystem are copied.
+    // Content store files are linked in place and the store is kept.
+    std::string failure;
+    Tracer::Span span(_manager.tracer(), "finalizeFiles", "finalize", _traceLane);
+    span.arg("target", installDir);
+    FileResultVec results =
+        _manager.options().contentStore
+            ? linkTree(storeDir(), installDir, _manager.options().storeHardlinks,
+                       &_manager.workerPool(), _manager.tracer())
+            : moveTree(tempDir, installDir, &_manager.workerPool(), _manager.tracer());
+    for (const auto& result : results) {
+        switch (result.outcome) {
+            case FileResult::Moved:
+            case FileResult::Copied:
+            case FileResult::Linked:
+            case FileResult::Removed:
+                PacmTrace << "moved file: " << result.source << " => " << result.target << endl;
+                break;
+            case FileResult::Busy:
+                // The previous version files may be currently in use,
+                // in which case PackageManager::finalizeInstallations()
+                // must be called from an external process before the
+                // installation can be completed.
+                _busyFiles = true;
+                SError << "finalize error: file in use: " << result.error << endl;
+                _local->addError(result.error);
+                break;
+            case FileResult::Failed:
+                SError << "finalize error: " << result.error << endl;
+                if (failure.empty())
+                    failure = result.error;
+                break;
         }
     }
 
-    // The package requires finalizing at a later date.
-    // The current task will be cancelled, and the package
-    // saved with the Installing state.
-    if (errors) {
-        SDebug << "Finalization failed, cancelling task" << endl;
-        cancel();
+    // Anything other than a busy file will not go away by retrying
+    // later, so fail the installation.
+    if (!failure.empty())
+        throw std::runtime_error("Cannot finalize package files: " + failure);
+
+    // Leave the package for finalizeInstallations()
+    if (_busyFiles) {
+        PacmDebug << "Finalization incomplete: files in use" << endl;
         return;
     }
 
+    _local->setPendingVersion("");
+
     // Remove the temporary output folder if the installation
     // was successfully finalized.
     try {
-        SDebug << "Removing temp directory: " << tempDir << endl;
+        PacmDebug << "Removing temp directory: " << tempDir << endl;
         fs::rmdir(tempDir);
     } catch (std::exception& exc) {
         // While testing on a windows system this fails regularly
@@ -344,17 +611,96 @@ void InstallTask::doFinalize()
         SWarn << "cannot remove temp directory: " << exc.what() << endl;
     }
 
-    SDebug << "finalization complete" << endl;
+    PacmDebug << "finalization complete" << endl;
+}
+
+
+void InstallTask::doFinalizeVersion(const std::string& tempDir)
+{
+    std::string version = _local->pendingVersion();
+    if (version.empty())
+        throw std::runtime_error("No extracted package version to finalize.");
+
+    // The staged tree becomes the version directory with a single
+    // rename, so a failure can never leave a mixed-version tree.
+    std::string versionDir = _local->getVersionDir(version);
+    std::string partial = versionDir + ".partial";
+
+    PacmDebug << "Finalizing version: " << tempDir << " => " << versionDir << endl;
+    Tracer::Span span(_manager.tracer(), "renameVersion", "finalize", _traceLane);
+    span.arg("target", versionDir);
+    addPartialPath(partial);
+    std::filesystem::remove_all(partial);
+    if (_manager.options().contentStore) {
+        // Link the stored files into the partial directory
+        for (const auto& result : linkTree(storeDir(), partial, _manager.options().storeHardlinks,
+                                           &_manager.workerPool(), _manager.tracer())) {
+            if (!result.ok())
+                throw std::runtime_error("Cannot finalize package files: " + result.error);
+        }
+    } else {
+        std::error_code ec;
+        std::filesystem::rename(tempDir, partial, ec);
+        if (ec == std::errc::cross_device_link) {
+            // Copy into the partial directory on the target filesystem
+            for (const auto& result :
+                 moveTree(tempDir, partial, &_manager.workerPool(), _manager.tracer())) {
+                if (!result.ok())
+                    throw std::runtime_error("Cannot finalize package files: " + result.error);
+            }
+            std::filesystem::remove_all(tempDir);
+        } else if (ec)
+            throw std::runtime_error("Cannot finalize package version: " + ec.message());
+    }
+
+    // Nothing is visible until the version is activated, so cancelling
+    // here leaves the installed version untouched.
+    checkCancelled();
+
+    if (!fs::exists(versionDir)) {
+        std::filesystem::rename(partial, versionDir);
+        removePartialPath(partial);
+        _manager.activatePackageVersion(*_local, version);
+    } else {
+        // Reinstalling a version whose directory `current` may point
+        // at: switch `current` to the staged tree before the old one
+        // is removed, then publish the tree under the version name.
+        PacmDebug << "Replacing version directory: " << versionDir << endl;
+        removePartialPath(partial);
+        _manager.activatePackageVersion(*_local, version + ".partial");
+        fs::rmdir(versionDir);
+        for (const auto& result :
+             linkTree(partial, versionDir, true, &_manager.workerPool(), _manager.tracer())) {
+            if (!result.ok())
+                throw std::runtime_error("Cannot finalize package files: " + result.error);
+        }
+        _manager.activatePackageVersion(*_local, version);
+        std::error_code ec;
+        std::filesystem::remove_all(partial, ec);
+        if (ec)
+            SWarn << "Cannot remove staged version: " << partial << ": " << ec.message() << endl;
+    }
+    _local->setPendingVersion("");
+
+    PacmDebug << "finalization complete" << endl;
 }
 
 
 void InstallTask::setComplete()
 {
     {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _stats.finished = InstallStats::Clock::now();
+
+        using ms = std::chrono::milliseconds;
         SInfo << "Package installed: "
               << "Name=" << _local->name() << ", Version=" << _local->version()
               << ", Package State=" << _local->state()
-              << ", Package Install State=" << _local->installState() << endl;
+              << ", Package Install State=" << _local->installState()
+              << ", Time=" << std::chrono::duration_cast<ms>(_stats.totalTime()).count() << "ms"
+              << ", Downloaded=" << _stats.bytesDownloaded
+              << ", Written=" << _stats.bytesWritten
+              << ", Entries=" << _stats.entries << endl;
 #ifdef _DEBUG
         _local->print(cout);
 #endif
@@ -366,8 +712,9 @@ void InstallTask::setComplete()
             _dlconn->close();
     }
 
-    // Cancel the runner and schedule for deletion
-    _runner.cancel();
+    // Stop scheduling stages and release the event loop
+    closeWakeup();
+    traceStages();
 
     // The task will be destroyed
     // as a result of this signal.
@@ -384,6 +731,73 @@ void InstallTask::setProgress(int value)
 }
 
 
+bool InstallTask::hasStoredVersion() const
+{
+    return _manager.options().contentStore && _remote &&
+           _manager.hasStoredPackage(_local->id(), getRemoteAsset().version());
+}
+
+
+std::string InstallTask::storeDir() const
+{
+    return _manager.getPackageStoreDir(_local->id(), _local->pendingVersion());
+}
+
+
+void InstallTask::checkCancelled() const
+{
+    if (_cancelling)
+        throw std::runtime_error("Installation cancelled");
+}
+
+
+std::string InstallTask::computeChecksum(const std::string& algorithm,
+                                         const std::string& path) const
+{
+    auto checkpoint = [this]() { checkCancelled(); };
+    if (auto* cache = _manager.checksumCache())
+        return cache->checksum(algorithm, path, &_manager.workerPool(), checkpoint);
+    return checksumFile(algorithm, path, &_manager.workerPool(), checkpoint);
+}
+
+
+void InstallTask::addPartialPath(const std::string& path)
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    _partialPaths.push_back(path);
+}
+
+
+void InstallTask::removePartialPath(const std::string& path)
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    _partialPaths.erase(std::remove(_partialPaths.begin(), _partialPaths.end(), path),
+                        _partialPaths.end());
+}
+
+
+void InstallTask::cleanupPartialPaths()
+{
+    StringVec paths;
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (!_cancelling || _partialPaths.empty())
+            return;
+        paths = std::exchange(_partialPaths, {});
+    }
+
+    // Large trees can take a while to delete, so don't block the
+    // caller; the pool finishes queued jobs before it is destroyed.
+    _manager.workerPool().post([paths]() {
+        for (const auto& path : paths) {
+            PacmDebug << "Removing partial output: " << path << endl;
+            std::error_code ec;
+            std::filesystem::remove_all(path, ec);
+        }
+    });
+}
+
+
 Package::Asset InstallTask::getRemoteAsset() const
 {
     return !_options.version.empty()
@@ -400,6 +814,128 @@ int InstallTask::progress() const
 }
 
 
+void InstallTask::traceStages()
+{
+    auto tracer = _manager.tracer();
+    if (!tracer)
+        return;
+
+    InstallStats stats = this->stats();
+    auto finished = stats.finished != InstallStats::Clock::time_point()
+                        ? stats.finished
+                        : InstallStats::Clock::now();
+    tracer->complete(_local->id(), "install", stats.created, finished, _traceLane,
+                     {{"state", state().toString()}, {"bytesDownloaded", stats.bytesDownloaded},
+                      {"bytesWritten", stats.bytesWritten}, {"entries", stats.entries}});
+
+    // Each stage lasts until the next transition; terminal states end the task
+    InstallationState names;
+    for (size_t i = 0; i + 1 < stats.transitions.size(); i++) {
+        tracer->complete(names.str(stats.transitions[i].state), "stage",
+                         stats.transitions[i].time, stats.transitions[i + 1].time, _traceLane);
+    }
+}
+
+
+InstallStats InstallTask::stats() const
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    return _stats;
+}
+
+
+//
+// Install Stats
+//
+
+
+InstallStats::Clock::duration InstallStats::stateTime(unsigned int state) const
+{
+    Clock::duration total{};
+    for (size_t i = 0; i < transitions.size(); i++) {
+        if (transitions[i].state != state)
+            continue;
+        Clock::time_point end = i + 1 < transitions.size() ? transitions[i + 1].time
+                                : finished != Clock::time_point() ? finished
+                                                                   : Clock::now();
+        total += end - transitions[i].time;
+    }
+    return total;
+}
+
+
+InstallStats::Clock::duration InstallStats::totalTime() const
+{
+    return (finished != Clock::time_point() ? finished : Clock::now()) - created;
+}
+
+
+double InstallStats::downloadRate() const
+{
+    auto seconds = std::chrono::duration<double>(stateTime(InstallationState::Downloading)).count();
+    return seconds > 0 ? bytesDownloaded / seconds : 0;
+}
+
+
+double InstallStats::extractRate() const
+{
+    auto seconds = std::chrono::duration<double>(stateTime(InstallationState::Extracting)).count();
+    return seconds > 0 ? bytesWritten / seconds : 0;
+}
+
+
+void InstallTask::setDependencies(const StringVec& ids)
+{
+    _dependencies = ids;
+}
+
+
+StringVec InstallTask::pendingDependencies() const
+{
+    return _dependencies;
+}
+
+
+void InstallTask::onDependencyComplete(const InstallTask& dependency)
+{
+    std::string id = dependency.local()->id();
+    auto it = std::find(_dependencies.begin(), _dependencies.end(), id);
+    if (it == _dependencies.end())
+        return;
+
+    _dependencies.erase(it);
+    if (complete())
+        return;
+
+    if (!dependency.success()) {
+        SError << "Dependency not installed: " << id << endl;
+        _error.message = "Dependency not installed: " + id;
+        setState(this, InstallationState::Failed);
+    }
+    wakeup();
+}
+
+
+void InstallTask::setHoldFinalize(bool hold)
+{
+    _holdFinalize = hold;
+    if (!hold)
+        wakeup();
+}
+
+
+bool InstallTask::holdFinalize() const
+{
+    return _holdFinalize;
+}
+
+
+bool InstallTask::hasBusyFiles() const
+{
+    return _busyFiles;
+}
+
+
 bool InstallTask::valid() const
 {
     return !stateEquals(InstallationState::Failed) && _local->valid() &&
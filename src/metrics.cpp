@@ -0,0 +1,258 @@
+///
+//
+// icey
+// Copyright (c) 2005, icey <https://0state.com>
+//
+// SPDX-License-Identifier: LGPL-2.1+
+//
+/// @addtogroup pacm
+/// @{
+
+
+#include "icy/pacm/metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+
+using namespace std;
+
+
+namespace icy {
+namespace pacm {
+
+
+namespace {
+
+
+/// Formats label pairs as `name="value",...`, escaping the values.
+std::string formatLabels(const MetricsRegistry::Labels& labels)
+{
+    std::string out;
+    for (const auto& [name, value] : labels) {
+        if (!out.empty())
+            out += ',';
+        out += name;
+        out += "=\"";
+        for (char c : value) {
+            switch (c) {
+                case '\\':
+                    out += "\\\\";
+                    break;
+                case '"':
+                    out += "\\\"";
+                    break;
+                case '\n':
+                    out += "\\n";
+                    break;
+                default:
+                    out += c;
+            }
+        }
+        out += '"';
+    }
+    return out;
+}
+
+
+/// Formats a sample value; integral values are written without an exponent.
+std::string formatValue(double value)
+{
+    if (std::isinf(value))
+        return value > 0 ? "+Inf" : "-Inf";
+    if (std::isnan(value))
+        return "NaN";
+
+    char buf[32];
+    if (value == std::floor(value) && std::fabs(value) < 1e15)
+        std::snprintf(buf, sizeof(buf), "%.0f", value);
+    else
+        std::snprintf(buf, sizeof(buf), "%.9g", value);
+    return buf;
+}
+
+
+void writeSample(std::ostream& os, const std::string& name,
+                 const std::string& labels, double value)
+{
+    os << name;
+    if (!labels.empty())
+        os << '{' << labels << '}';
+    os << ' ' << formatValue(value) << '\n';
+}
+
+
+} // namespace
+
+
+//
+// Histogram
+//
+
+
+Histogram::Histogram(std::vector<double> bounds)
+    : _bounds(std::move(bounds))
+    , _counts(new std::atomic<uint64_t>[_bounds.size() + 1])
+{
+    if (!std::is_sorted(_bounds.begin(), _bounds.end()))
+        throw std::invalid_argument("Histogram bounds must be ascending");
+    for (size_t i = 0; i <= _bounds.size(); i++)
+        _counts[i].store(0, std::memory_order_relaxed);
+}
+
+
+void Histogram::observe(double value)
+{
+    size_t bucket = std::lower_bound(_bounds.begin(), _bounds.end(), value) - _bounds.begin();
+    _counts[bucket].fetch_add(1, std::memory_order_relaxed);
+    _sum.fetch_add(value, std::memory_order_relaxed);
+    _count.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+std::vector<uint64_t> Histogram::counts() const
+{
+    std::vector<uint64_t> counts(_bounds.size() + 1);
+    for (size_t i = 0; i < counts.size(); i++)
+        counts[i] = _counts[i].load(std::memory_order_relaxed);
+    return counts;
+}
+
+
+std::vector<double> Histogram::secondsBounds()
+{
+    return {0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120, 300};
+}
+
+
+//
+// Metrics Registry
+//
+
+
+MetricsRegistry::Family& MetricsRegistry::family(const std::string& name,
+                                                 const std::string& help, Type type)
+{
+    auto it = _families.find(name);
+    if (it == _families.end()) {
+        it = _families.emplace(name, Family()).first;
+        it->second.type = type;
+        it->second.help = help;
+    } else if (it->second.type != type)
+        throw std::logic_error("Metric registered with another type: " + name);
+    return it->second;
+}
+
+
+Counter& MetricsRegistry::counter(const std::string& name, const std::string& help,
+                                  const Labels& labels)
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    auto& series = family(name, help, Type::Counter).counters[formatLabels(labels)];
+    if (!series)
+        series = std::make_unique<Counter>();
+    return *series;
+}
+
+
+Gauge& MetricsRegistry::gauge(const std::string& name, const std::string& help,
+                              const Labels& labels)
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    auto& series = family(name, help, Type::Gauge).gauges[formatLabels(labels)];
+    if (!series)
+        series = std::make_unique<Gauge>();
+    return *series;
+}
+
+
+Histogram& MetricsRegistry::histogram(const std::string& name, const std::string& help,
+                                      const std::vector<double>& bounds, const Labels& labels)
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    auto& series = family(name, help, Type::Histogram).histograms[formatLabels(labels)];
+    if (!series)
+        series = std::make_unique<Histogram>(bounds);
+    return *series;
+}
+
+
+void MetricsRegistry::write(std::ostream& os) const
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    for (const auto& [name, family] : _families) {
+        os << "# HELP " << name << ' ' << family.help << '\n';
+        switch (family.type) {
+            case Type::Counter:
+                os << "# TYPE " << name << " counter\n";
+                for (const auto& [labels, counter] : family.counters)
+                    writeSample(os, name, labels, counter->value());
+                break;
+            case Type::Gauge:
+                os << "# TYPE " << name << " gauge\n";
+                for (const auto& [labels, gauge] : family.gauges)
+                    writeSample(os, name, labels, gauge->value());
+                break;
+            case Type::Histogram:
+                os << "# TYPE " << name << " histogram\n";
+                for (const auto& [labels, histogram] : family.histograms) {
+                    // Buckets are cumulative in the exposition format
+                    std::string prefix = labels.empty() ? "" : labels + ",";
+                    auto counts = histogram->counts();
+                    uint64_t cumulative = 0;
+                    for (size_t i = 0; i < counts.size(); i++) {
+                        cumulative += counts[i];
+                        double bound = i < histogram->bounds().size()
+                                           ? histogram->bounds()[i]
+                                           : INFINITY;
+                        writeSample(os, name + "_bucket",
+                                    prefix + "le=\"" + formatValue(bound) + "\"",
+                                    static_cast<double>(cumulative));
+                    }
+                    writeSample(os, name + "_sum", labels, histogram->sum());
+                    writeSample(os, name + "_count", labels,
+                                static_cast<double>(histogram->count()));
+                }
+                break;
+        }
+    }
+}
+
+
+std::string MetricsRegistry::toString() const
+{
+    std::ostringstream os;
+    write(os);
+    return os.str();
+}
+
+
+void MetricsRegistry::writeFile(const std::string& path) const
+{
+    std::string temp = path + ".tmp";
+    {
+        std::ofstream file(temp, std::ios::out | std::ios::trunc);
+        if (!file)
+            throw std::runtime_error("Cannot write metrics file: " + temp);
+        write(file);
+        if (!file.flush())
+            throw std::runtime_error("Cannot write metrics file: " + temp);
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(temp, path, ec);
+    if (ec)
+        throw std::runtime_error("Cannot write metrics file: " + path + ": " + ec.message());
+}
+
+
+} // namespace pacm
+} // namespace icy
+
+
+/// @}
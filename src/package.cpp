@@ -10,15 +10,65 @@
 
 
 #include "icy/pacm/package.h"
+#include "icy/pacm/config.h"
 #include "icy/filesystem.h"
 #include "icy/logger.h"
+#include "icy/pacm/workerpool.h"
 #include "icy/util.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <unordered_set>
+
 
 namespace icy {
 namespace pacm {
 
 
+namespace {
+
+
+/// Directories modified more recently than this are not cached, since
+/// a change within the timestamp granularity leaves the time unchanged.
+constexpr std::chrono::seconds kRacyInterval(2);
+
+
+uint64_t combineHash(uint64_t seed, uint64_t value)
+{
+    return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+}
+
+
+/// Returns @p name in the form compared against directory listings.
+std::string foldName(std::string name)
+{
+#ifdef _WIN32
+    // File names are case insensitive
+    std::transform(name.begin(), name.end(), name.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+#endif
+    return name;
+}
+
+
+/// Manifest entries which share a parent directory.
+struct ManifestDir
+{
+    std::string path;               ///< Directory in the install directory
+    std::vector<std::string> names; ///< Entry names within the directory
+    std::filesystem::file_time_type mtime;
+    bool exists = false;
+};
+
+
+} // namespace
+
+
 //
 // Base Package
 //
@@ -130,11 +180,34 @@ Package::Package(const json::Value& src)
 }
 
 
+Package::Package(const Package& other)
+    : json::Value(other.toJson())
+{
+}
+
+
+Package& Package::operator=(const Package& other)
+{
+    if (this != &other) {
+        json::Value copy = other.toJson();
+        std::lock_guard<std::recursive_mutex> guard(_mutex);
+        json::Value::operator=(std::move(copy));
+    }
+    return *this;
+}
+
+
 Package::~Package() noexcept
 {
 }
 
 
+std::recursive_mutex& Package::mutex() const
+{
+    return _mutex;
+}
+
+
 bool Package::valid() const
 {
     return !id().empty() && !name().empty() && !type().empty();
@@ -143,42 +216,70 @@ bool Package::valid() const
 
 json::Value Package::toJson() const
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     return json::Value(static_cast<const json::Value&>(*this));
 }
 
 
 std::string Package::id() const
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     return (*this)["id"].get<std::string>();
 }
 
 
 std::string Package::type() const
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     return (*this)["type"].get<std::string>();
 }
 
 
 std::string Package::name() const
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     return (*this)["name"].get<std::string>();
 }
 
 
 std::string Package::author() const
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     return (*this)["author"].get<std::string>();
 }
 
 
 std::string Package::description() const
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     return (*this)["description"].get<std::string>();
 }
 
 
+StringVec Package::dependencies() const
+{
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
+    StringVec ids;
+    auto it = find("dependencies");
+    if (it == end() || !it->is_array())
+        return ids;
+
+    for (const auto& value : *it) {
+        if (value.is_string())
+            ids.push_back(value.get<std::string>());
+        else if (value.is_object() && value.contains("id") && value.at("id").is_string())
+            ids.push_back(value.at("id").get<std::string>());
+        else
+            throw std::runtime_error("Invalid dependency in package " + id());
+    }
+
+    return ids;
+}
+
+
 bool Package::hasExtension() const
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     auto it = find("extension");
     return it != end() && it->is_object();
 }
@@ -186,6 +287,7 @@ bool Package::hasExtension() const
 
 Package::Extension Package::extension() const
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     auto it = find("extension");
     if (it == end() || !it->is_object())
         throw std::runtime_error("Package does not contain extension metadata");
@@ -195,6 +297,7 @@ Package::Extension Package::extension() const
 
 void Package::print(std::ostream& ost) const
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     ost << dump();
 }
 
@@ -245,9 +348,9 @@ std::string Package::Asset::url(int index) const
 }
 
 
-int Package::Asset::fileSize() const
+std::uint64_t Package::Asset::fileSize() const
 {
-    return root.value("file-size", 0);
+    return root.value("file-size", std::uint64_t(0));
 }
 
 
@@ -299,12 +402,14 @@ RemotePackage::~RemotePackage() noexcept
 
 json::Value& RemotePackage::assets()
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     return (*this)["assets"];
 }
 
 
 Package::Asset RemotePackage::latestAsset()
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     json::Value& assets = this->assets();
     if (assets.empty())
         throw std::runtime_error("Package has no assets");
@@ -327,6 +432,7 @@ Package::Asset RemotePackage::latestAsset()
 
 Package::Asset RemotePackage::assetVersion(const std::string& version)
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     json::Value& assets = this->assets();
     if (assets.empty())
         throw std::runtime_error("Package has no assets");
@@ -348,6 +454,7 @@ Package::Asset RemotePackage::assetVersion(const std::string& version)
 
 Package::Asset RemotePackage::latestSDKAsset(const std::string& version)
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     json::Value& assets = this->assets();
     if (assets.empty())
         throw std::runtime_error("Package has no assets");
@@ -405,18 +512,21 @@ LocalPackage::~LocalPackage() noexcept
 
 Package::Asset LocalPackage::asset()
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     return Package::Asset((*this)["asset"]);
 }
 
 
 LocalPackage::Manifest LocalPackage::manifest()
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     return Manifest((*this)["manifest"]);
 }
 
 
 void LocalPackage::setState(const std::string& state)
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     if (state != "Installing" && state != "Installed" && state != "Failed" && state != "Uninstalled")
         throw std::invalid_argument("Invalid package state: " + state);
 
@@ -426,12 +536,14 @@ void LocalPackage::setState(const std::string& state)
 
 void LocalPackage::setInstallState(const std::string& state)
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     (*this)["install-state"] = state;
 }
 
 
 void LocalPackage::setVersion(const std::string& version)
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     if (state() != "Installed")
         throw std::runtime_error(
             "Package must be installed before the version is set.");
@@ -454,22 +566,58 @@ bool LocalPackage::isFailed() const
 
 std::string LocalPackage::state() const
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     return value("state", "Installing");
 }
 
 
 std::string LocalPackage::installState() const
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     return value("install-state", "None");
 }
 
 
 std::string LocalPackage::installDir() const
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     return value("install-dir", "");
 }
 
 
+std::string LocalPackage::installRoot() const
+{
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
+    return value("install-root", "");
+}
+
+
+bool LocalPackage::isVersioned() const
+{
+    return !installRoot().empty();
+}
+
+
+std::string LocalPackage::getVersionDir(const std::string& version) const
+{
+    std::string root = installRoot();
+    if (root.empty())
+        throw std::runtime_error("Package does not use the versioned install layout.");
+    if (version.empty() || version.find_first_of("/\\") != std::string::npos ||
+        version.find("..") != std::string::npos)
+        throw std::runtime_error("Invalid package version directory: " + version);
+
+    return fs::makePath(root, version);
+}
+
+
+std::string LocalPackage::pendingVersion() const
+{
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
+    return value("pending-version", "");
+}
+
+
 std::string LocalPackage::getInstalledFilePath(const std::string& fileName, bool whiny)
 {
     std::string dir = installDir();
@@ -504,6 +652,7 @@ std::string LocalPackage::extensionEntryPointPath(bool whiny) const
 
 void LocalPackage::setVersionLock(const std::string& version)
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     if (version.empty())
         (*this).erase("version-lock");
     else
@@ -513,6 +662,7 @@ void LocalPackage::setVersionLock(const std::string& version)
 
 void LocalPackage::setSDKVersionLock(const std::string& version)
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     if (version.empty())
         (*this).erase("sdk-version-lock");
     else
@@ -522,44 +672,236 @@ void LocalPackage::setSDKVersionLock(const std::string& version)
 
 std::string LocalPackage::version() const
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     return value("version", "0.0.0");
 }
 
 
 std::string LocalPackage::versionLock() const
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     return value("version-lock", "");
 }
 
 
 std::string LocalPackage::sdkLockedVersion() const
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     return value("sdk-version-lock", "");
 }
 
 
-bool LocalPackage::verifyInstallManifest(bool allowEmpty)
+bool LocalPackage::verifyInstallManifest(bool allowEmpty, WorkerPool* pool)
 {
-    SDebug << name() << ": Verifying install manifest" << std::endl;
+    std::string packageName = name();
+    PacmDebug << packageName << ": Verifying install manifest" << std::endl;
 
-    // Check file system for each manifest file
-    LocalPackage::Manifest manifest = this->manifest();
-    for (const auto& entry : manifest.root) {
-        std::string path = this->getInstalledFilePath(entry.get<std::string>(), false);
-        SDebug << name() << ": Checking exists: " << path << std::endl;
+    // Copy the manifest so that the file system is checked without
+    // holding the package lock
+    json::Value files;
+    std::string root;
+    {
+        std::lock_guard<std::recursive_mutex> guard(_mutex);
+        files = manifest().root;
+        root = installDir();
+    }
+    if (files.empty())
+        return allowEmpty;
+
+    // Group the entries by parent directory, so each directory is
+    // listed once instead of stating every file
+    std::map<std::string, size_t> index;
+    std::vector<ManifestDir> dirs;
+    // Versioned installs swap the `current` link, so the resolved root
+    // is part of the fingerprint
+    std::error_code ec;
+    auto resolved = std::filesystem::weakly_canonical(root, ec);
+    uint64_t fingerprint = std::hash<std::string>()(ec ? root : resolved.string());
+    for (const auto& entry : files) {
+        std::string file = entry.get<std::string>();
+        fingerprint = combineHash(fingerprint, std::hash<std::string>()(file));
+        while (!file.empty() && (file.back() == '/' || file.back() == '\\'))
+            file.pop_back(); // directory entries
+        if (file.empty())
+            continue;
+
+        auto pos = file.find_last_of("/\\");
+        std::string parent = pos == std::string::npos ? "" : file.substr(0, pos);
+        auto [it, added] = index.emplace(parent, dirs.size());
+        if (added) {
+            dirs.emplace_back();
+            dirs.back().path = parent.empty() ? root : fs::makePath(root, parent);
+            if (dirs.back().path.empty())
+                dirs.back().path = ".";
+        }
+        dirs[it->second].names.push_back(file.substr(pos + 1));
+    }
 
-        if (!fs::exists(fs::normalize(path))) {
-            SError << name() << ": Missing file: " << path << std::endl;
-            return false;
+    auto forEach = [pool](size_t count, const std::function<void(size_t)>& fn) {
+        if (pool)
+            pool->parallelFor(count, fn);
+        else {
+            for (size_t i = 0; i < count; i++)
+                fn(i);
         }
+    };
+
+    // Any change to the listed names changes the modification time of
+    // the directory, so an unchanged fingerprint reuses the last result.
+    // Directories modified within the timestamp granularity are not
+    // trusted.
+    forEach(dirs.size(), [&](size_t i) {
+        std::error_code ec;
+        dirs[i].mtime = std::filesystem::last_write_time(dirs[i].path, ec);
+        dirs[i].exists = !ec;
+    });
+    bool settled = true;
+    auto racy = std::filesystem::file_time_type::clock::now() - kRacyInterval;
+    for (const auto& dir : dirs) {
+        fingerprint = combineHash(fingerprint, dir.exists);
+        fingerprint = combineHash(fingerprint, dir.mtime.time_since_epoch().count());
+        if (dir.mtime >= racy)
+            settled = false;
+    }
+    {
+        std::lock_guard<std::mutex> guard(_verifyCache.mutex);
+        if (_verifyCache.valid && _verifyCache.fingerprint == fingerprint)
+            return _verifyCache.result;
     }
 
-    return allowEmpty ? true : !manifest.empty();
+    std::atomic<bool> complete{true};
+    forEach(dirs.size(), [&](size_t i) {
+        const auto& dir = dirs[i];
+        PacmTrace << packageName << ": Listing: " << dir.path << std::endl;
+
+        std::unordered_set<std::string> present;
+        std::error_code ec;
+        if (dir.exists) {
+            for (std::filesystem::directory_iterator it(dir.path, ec), end;
+                 !ec && it != end; it.increment(ec))
+                present.insert(foldName(it->path().filename().string()));
+        }
+        if (!dir.exists || ec) {
+            SError << packageName << ": Missing directory: " << dir.path << std::endl;
+            complete = false;
+            return;
+        }
+
+        // Report the first missing entry of each directory
+        for (const auto& name : dir.names) {
+            if (!present.count(foldName(name))) {
+                SError << packageName << ": Missing file: "
+                       << fs::makePath(dir.path, name) << std::endl;
+                complete = false;
+                return;
+            }
+        }
+    });
+
+    if (settled) {
+        std::lock_guard<std::mutex> guard(_verifyCache.mutex);
+        _verifyCache.fingerprint = fingerprint;
+        _verifyCache.result = complete;
+        _verifyCache.valid = true;
+    }
+    return complete;
+}
+
+
+LocalPackage::VerifyCache& LocalPackage::VerifyCache::operator=(const VerifyCache&)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    valid = false;
+    return *this;
+}
+
+
+json::Value& LocalPackage::retainedVersions()
+{
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
+    json::Value& node = (*this)["retained-versions"];
+    if (node.is_null())
+        node = json::Value::array();
+    else if (!node.is_array())
+        throw std::runtime_error("Package retained versions must be an array.");
+    return node;
+}
+
+
+void LocalPackage::retainInstalledVersion()
+{
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
+    if (state() != "Installed")
+        throw std::runtime_error(
+            "Package must be installed before its version can be retained.");
+
+    json::Value entry;
+    entry["version"] = version();
+    entry["asset"] = (*this)["asset"];
+    entry["manifest"] = manifest().root;
+
+    json::Value& retained = retainedVersions();
+    for (auto it = retained.begin(); it != retained.end(); ++it) {
+        if (it->value("version", "") == version()) {
+            retained.erase(it);
+            break;
+        }
+    }
+    retained.push_back(std::move(entry));
+}
+
+
+StringVec LocalPackage::pruneRetainedVersions(size_t limit)
+{
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
+    StringVec dropped;
+    json::Value& retained = retainedVersions();
+    std::string current = version();
+    for (auto it = retained.begin(); it != retained.end() && retained.size() > limit;) {
+        std::string entryVersion = it->value("version", "");
+        if (entryVersion == current) {
+            ++it;
+            continue;
+        }
+        dropped.push_back(entryVersion);
+        it = retained.erase(it);
+    }
+    return dropped;
+}
+
+
+bool LocalPackage::isVersionRetained(const std::string& version)
+{
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
+    for (const auto& entry : retainedVersions()) {
+        if (entry.value("version", "") == version)
+            return true;
+    }
+    return false;
+}
+
+
+void LocalPackage::restoreRetainedVersion(const std::string& version)
+{
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
+    for (auto& entry : retainedVersions()) {
+        if (entry.value("version", "") != version)
+            continue;
+
+        setState("Installed");
+        (*this)["asset"] = entry["asset"];
+        (*this)["manifest"] = entry["manifest"];
+        setVersion(version);
+        return;
+    }
+
+    throw std::runtime_error("Package version is not retained: " + version);
 }
 
 
 void LocalPackage::setInstalledAsset(const Package::Asset& installedRemoteAsset)
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     if (state() != "Installed")
         throw std::runtime_error(
             "Package must be installed before asset can be set.");
@@ -574,12 +916,34 @@ void LocalPackage::setInstalledAsset(const Package::Asset& installedRemoteAsset)
 
 void LocalPackage::setInstallDir(const std::string& dir)
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     (*this)["install-dir"] = dir;
 }
 
 
+void LocalPackage::setInstallRoot(const std::string& dir)
+{
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
+    if (dir.empty())
+        (*this).erase("install-root");
+    else
+        (*this)["install-root"] = dir;
+}
+
+
+void LocalPackage::setPendingVersion(const std::string& version)
+{
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
+    if (version.empty())
+        (*this).erase("pending-version");
+    else
+        (*this)["pending-version"] = version;
+}
+
+
 json::Value& LocalPackage::errors()
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     json::Value& node = (*this)["errors"];
     if (node.is_null())
         node = json::Value::array();
@@ -591,12 +955,14 @@ json::Value& LocalPackage::errors()
 
 void LocalPackage::addError(const std::string& message)
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     errors().push_back(message);
 }
 
 
 std::string LocalPackage::lastError() const
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     auto it = find("errors");
     if (it == end())
         return "";
@@ -608,6 +974,7 @@ std::string LocalPackage::lastError() const
 
 void LocalPackage::clearErrors()
 {
+    std::lock_guard<std::recursive_mutex> guard(_mutex);
     auto it = find("errors");
     if (it == end())
         return;
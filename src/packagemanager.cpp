@@ -15,10 +15,17 @@
 #include "icy/http/client.h"
 #include "icy/json/json.h"
 #include "icy/packetio.h"
+#include "icy/pacm/fileops.h"
 #include "icy/pacm/package.h"
+#include "icy/pacm/transaction.h"
 #include "icy/util.h"
 
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <functional>
 #include <memory>
+#include <type_traits>
 
 
 using namespace std;
@@ -31,11 +38,16 @@ namespace pacm {
 PackageManager::PackageManager(const Options& options)
     : _options(options)
 {
+    publishSnapshot();
 }
 
 
 PackageManager::~PackageManager() noexcept
 {
+    // Pool jobs refer to tasks, stores and the checksum cache, so stop
+    // the tasks and join the workers before any member is destroyed.
+    cancelAllTasks();
+    _workerPool.reset();
 }
 
 
@@ -56,21 +68,34 @@ bool PackageManager::initialized() const
 void PackageManager::uninitialize()
 {
     cancelAllTasks();
+    saveChecksumCache();
 
-    std::lock_guard<std::mutex> guard(_mutex);
-    _remotePackages.clear();
-    _localPackages.clear();
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _remotePackages.clear();
+        _localPackages.clear();
+    }
+    publishSnapshot();
 }
 
 
 void PackageManager::cancelAllTasks()
 {
-    std::lock_guard<std::mutex> guard(_mutex);
-    auto it = _tasks.begin();
-    while (it != _tasks.end()) {
-        (*it)->cancel();
-        it = _tasks.erase(it);
+    InstallTaskPtrVec tasks;
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        tasks = std::move(_tasks);
+        _tasks.clear();
+        _queuedTasks.clear();
+        _scheduledTasks.clear();
+        updateTaskGauges();
     }
+
+    // Cancel outside the lock, since releasing a task waits for its
+    // worker job to reach a cancellation checkpoint.
+    for (auto& task : tasks)
+        task->cancel();
+    tasks.clear();
 }
 
 
@@ -86,7 +111,7 @@ void PackageManager::createDirectories()
 void PackageManager::queryRemotePackages()
 {
     std::lock_guard<std::mutex> guard(_mutex);
-    SDebug << "Querying server: " << _options.endpoint << _options.indexURI << endl;
+    PacmDebug << "Querying server: " << _options.endpoint << _options.indexURI << endl;
 
     if (!_tasks.empty())
         throw std::runtime_error("Cannot load packages while tasks are active.");
@@ -110,12 +135,41 @@ void PackageManager::queryRemotePackages()
             cred.authenticate(conn->request());
         }
 
-        conn->Complete += [&](const http::Response& response) {
-            STrace << "On package response complete: " << response << endl;
+        // The client owns the connection until it is closed, so capture
+        // a plain pointer rather than the local shared pointer.
+        auto started = std::chrono::steady_clock::now();
+        conn->Complete += [this, c = conn.get(), started](const http::Response& response) {
+            PacmTrace << "On package response complete: " << response << endl;
+
+            if (_tracer)
+                _tracer->complete("queryRemotePackages", "index", started,
+                                  std::chrono::steady_clock::now());
+            std::string data = c->readStream<std::stringstream>().str();
+            _metrics.histogram("pacm_index_fetch_seconds", "Package index fetch latency")
+                .observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+            _metrics.gauge("pacm_index_size_bytes", "Size of the last package index")
+                .set(static_cast<double>(data.size()));
+            // Listeners are always notified, so a failed query or an
+            // unparsable index never leaves a waiting caller behind.
+            std::string error;
+            if (!response.success()) {
+                _metrics.counter("pacm_failures_total", "Failures by stage", {{"stage", "Index"}}).inc();
+                error = "HTTP status " + std::to_string(static_cast<int>(response.getStatus()));
+            } else {
+                try {
+                    parseRemotePackages(data);
+                } catch (std::exception& exc) {
+                    error = exc.what();
+                }
+            }
+            {
+                std::lock_guard<std::mutex> guard(_mutex);
+                _queryError = error;
+            }
 
-            parseRemotePackages(conn->readStream<std::stringstream>().str());
             RemotePackageResponse.emit(response);
-            conn->close();
+            c->close();
+            exportMetrics();
         };
 
         conn->start();
@@ -126,8 +180,17 @@ void PackageManager::queryRemotePackages()
 }
 
 
+std::string PackageManager::queryError() const
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    return _queryError;
+}
+
+
 void PackageManager::parseRemotePackages(const std::string& data)
 {
+    Tracer::Span span(_tracer.get(), "parseRemotePackages", "index");
+    auto started = std::chrono::steady_clock::now();
     try {
         json::Value root = json::Value::parse(data.begin(), data.end());
         _remotePackages.clear();
@@ -143,8 +206,14 @@ void PackageManager::parseRemotePackages(const std::string& data)
         }
     } catch (std::invalid_argument& exc) {
         SError << "Invalid server JSON response: " << exc.what() << endl;
+        _metrics.counter("pacm_failures_total", "Failures by stage", {{"stage", "Parse"}}).inc();
         throw exc;
     }
+    _metrics.histogram("pacm_index_parse_seconds", "Package index parse time")
+        .observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+    _metrics.gauge("pacm_remote_packages", "Packages in the remote index")
+        .set(static_cast<double>(_remotePackages.size()));
+    publishSnapshot();
 }
 
 
@@ -167,7 +236,7 @@ void PackageManager::loadLocalPackages()
 
 void PackageManager::loadLocalPackages(const std::string& dir)
 {
-    SDebug << "Loading manifests: " << dir << endl;
+    PacmDebug << "Loading manifests: " << dir << endl;
 
     std::vector<std::string> dirEntries;
     fs::readdir(dir, dirEntries);
@@ -178,13 +247,13 @@ void PackageManager::loadLocalPackages(const std::string& dir)
                 json::Value root;
                 json::loadFile(path, root);
 
-                SDebug << "Loading package manifest: " << path << endl;
+                PacmDebug << "Loading package manifest: " << path << endl;
                 auto package = std::make_unique<LocalPackage>(root);
                 if (!package->valid()) {
                     throw std::runtime_error("The local package is invalid.");
                 }
 
-                SDebug << "local package added: " << package->name() << endl;
+                PacmDebug << "local package added: " << package->name() << endl;
                 auto id = package->id();
                 localPackages().tryAdd(id, std::move(package));
             } catch (std::exception& exc) {
@@ -192,12 +261,13 @@ void PackageManager::loadLocalPackages(const std::string& dir)
             }
         }
     }
+    publishSnapshot();
 }
 
 
 bool PackageManager::saveLocalPackages(bool whiny)
 {
-    STrace << "Saving local packages" << endl;
+    PacmTrace << "Saving local packages" << endl;
 
     bool res = true;
     auto& toSave = localPackages();
@@ -216,7 +286,8 @@ bool PackageManager::saveLocalPackage(LocalPackage& package, bool whiny)
         validatePathComponent(package.id(), "saveLocalPackage");
         std::string path(util::format("%s/%s.json", options().dataDir.c_str(),
                                       package.id().c_str()));
-        SDebug << "Saving local package: " << package.id() << endl;
+        PacmDebug << "Saving local package: " << package.id() << endl;
+        std::lock_guard<std::recursive_mutex> guard(package.mutex());
         json::saveFile(path, package);
         res = true;
     } catch (std::exception& exc) {
@@ -236,7 +307,7 @@ InstallTask::Ptr
 PackageManager::installPackage(const std::string& name,
                                const InstallOptions& options) //, bool whiny
 {
-    SDebug << "Install package: " << name << endl;
+    PacmDebug << "Install package: " << name << endl;
 
     // Try to update our remote package list if none exist.
     // TODO: Consider storing a remote package cache file.
@@ -256,7 +327,7 @@ PackageManager::installPackage(const std::string& name,
         // a better way of sending the asset/version to the InstallTask.
         opts.version = asset.version();
 
-        SDebug << "Installing asset: " << asset.root.dump(4) << endl;
+        PacmDebug << "Installing asset: " << asset.root.dump(4) << endl;
     } catch (std::exception& exc) {
         SWarn << "No installable assets: " << exc.what() << endl;
         return nullptr;
@@ -277,7 +348,7 @@ PackageManager::getLatestInstallableAsset(const PackagePair& pair,
     bool isInstalledAndVerified =
         pair.local->isInstalled() && pair.local->verifyInstallManifest();
 
-    SDebug << "Get asset to install:"
+    PacmDebug << "Get asset to install:"
            << "\n\tName: " << pair.local->name()
            << "\n\tDesired Version: " << options.version
            << "\n\tDesired SDK Version: " << options.sdkVersion
@@ -290,7 +361,7 @@ PackageManager::getLatestInstallableAsset(const PackagePair& pair,
     std::string version(options.version.empty() ? pair.local->versionLock()
                                                 : options.version);
     if (!version.empty()) {
-        SDebug << "Get specific asset version: " << version << endl;
+        PacmDebug << "Get specific asset version: " << version << endl;
 
         // Ensure the version lock option doesn't conflict with the saved
         // package
@@ -320,7 +391,7 @@ PackageManager::getLatestInstallableAsset(const PackagePair& pair,
                                ? pair.local->sdkLockedVersion()
                                : options.sdkVersion);
     if (!sdkVersion.empty()) {
-        SDebug << "Get latest asset for SDK version: " << sdkVersion << endl;
+        PacmDebug << "Get latest asset for SDK version: " << sdkVersion << endl;
 
         // Ensure the SDK version lock option doesn't conflict with the saved
         // package
@@ -371,26 +442,124 @@ bool PackageManager::installPackages(const StringVec& ids,
                                      InstallMonitor* monitor, bool whiny)
 {
     bool res = false;
+    InstallTaskPtrVec tasks;
     try {
-        for (const auto& id : ids) {
-            auto task = installPackage(id, options); //, whiny
-            if (task) {
-                if (monitor)
-                    monitor->addTask(task); // manual start
-                else
-                    task->start(); // auto start
-                res = true;
+        // Resolve first so that an unknown package or a dependency cycle
+        // fails the call before any task is created.
+        StringVec order = resolveDependencies(ids);
+
+        for (const auto& id : order) {
+            bool requested = std::find(ids.begin(), ids.end(), id) != ids.end();
+            if (!requested) {
+                // A dependency which is already being installed is
+                // waited on rather than installed again.
+                if (getInstallTask(id))
+                    continue;
+
+                // An installed dependency which is no longer in the
+                // index cannot be updated, and is used as it is.
+                auto pair = getPackagePair(id);
+                if (!pair.remote && pair.local && pair.local->isInstalled())
+                    continue;
             }
+
+            InstallOptions opts(options);
+            if (!requested)
+                opts.version.clear();
+
+            auto task = installPackage(id, opts); //, whiny
+            if (!task) {
+                // A dependency with nothing installable fails the batch,
+                // rather than its dependents being finalized without it.
+                auto pair = getPackagePair(id);
+                if (!requested && !(pair.local && pair.local->isInstalled()))
+                    throw std::runtime_error("No installable asset for dependency: " + id);
+                continue; // up-to-date
+            }
+            tasks.push_back(task);
+
+            // Only dependencies which are still being installed are
+            // waited on; installed ones are already in place.
+            StringVec pending;
+            for (const auto& dependency : task->remote()->dependencies()) {
+                if (getInstallTask(dependency))
+                    pending.push_back(dependency);
+            }
+            task->setDependencies(pending);
         }
     } catch (std::exception& exc) {
+        // Nothing is started unless every task could be created
+        discardTasks(tasks);
         SError << "Installation failed: " << exc.what() << endl;
         if (whiny)
-            throw exc;
+            throw;
+        return false;
+    }
+
+    for (auto& task : tasks) {
+        if (monitor)
+            monitor->addTask(task); // manual start
+        else
+            scheduleTask(task); // auto start
+        res = true;
     }
     return res;
 }
 
 
+void PackageManager::discardTasks(const InstallTaskPtrVec& tasks)
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    for (const auto& task : tasks)
+        _tasks.erase(std::remove(_tasks.begin(), _tasks.end(), task), _tasks.end());
+    updateTaskGauges();
+}
+
+
+StringVec PackageManager::resolveDependencies(const StringVec& ids) const
+{
+    // Depth first search emitting each package after its dependencies.
+    // Packages on the current path are `visiting`; meeting one of them
+    // again means the dependencies contain a cycle.
+    StringVec order;
+    std::vector<std::string> path;
+    std::function<void(const std::string&)> visit = [&](const std::string& id) {
+        if (std::find(order.begin(), order.end(), id) != order.end())
+            return;
+        if (std::find(path.begin(), path.end(), id) != path.end()) {
+            std::string cycle;
+            for (const auto& item : path)
+                cycle += item + " -> ";
+            throw std::runtime_error("Dependency cycle: " + cycle + id);
+        }
+
+        StringVec dependencies;
+        {
+            std::lock_guard<std::mutex> guard(_mutex);
+            if (auto* remote = _remotePackages.get(id))
+                dependencies = remote->dependencies();
+            else if (auto* local = _localPackages.get(id))
+                dependencies = local->dependencies();
+            else if (path.empty())
+                throw std::runtime_error("Package not found: " + id);
+            else
+                throw std::runtime_error("Unresolved dependency " + id +
+                                         " of package " + path.back());
+        }
+
+        path.push_back(id);
+        for (const auto& dependency : dependencies)
+            visit(dependency);
+        path.pop_back();
+        order.push_back(id);
+    };
+
+    for (const auto& id : ids)
+        visit(id);
+    return order;
+}
+
+
 InstallTask::Ptr PackageManager::updatePackage(const std::string& name,
                                                const InstallOptions& options)
 {
@@ -417,7 +586,7 @@ bool PackageManager::updatePackages(const StringVec& ids,
 {
     // An update action is essentially the same as an install action,
     // except we make sure local package exists before continuing.
-    StringVec toUpdate(ids);
+    StringVec toUpdate;
     {
         for (const auto& id : ids) {
             if (!localPackages().contains(id)) {
@@ -451,74 +620,204 @@ bool PackageManager::updateAllPackages(bool whiny)
 
 bool PackageManager::uninstallPackage(const std::string& id, bool whiny)
 {
-    SDebug << "Uninstalling: " << id << endl;
+    return uninstallPackages(StringVec{id}, whiny);
+}
 
-    try {
-        auto* package = localPackages().get(id);
-        if (!package)
-            throw std::runtime_error("Package not found: " + id);
-        try {
-            // Delete package files from manifest
-            // NOTE: If some files fail to delete we still consider the
-            // uninstall a success.
-            LocalPackage::Manifest manifest = package->manifest();
-            if (!manifest.empty()) {
-                for (const auto& entry : manifest.root) {
-                    std::string path(package->getInstalledFilePath(entry.get<std::string>()));
-                    SDebug << "Delete file: " << path << endl;
-                    try {
-                        fs::unlink(path);
-                    } catch (std::exception& exc) {
-                        SError << "Error deleting file: " << exc.what() << ": "
-                               << path << endl;
-                    }
+
+bool PackageManager::uninstallPackages(const StringVec& ids, bool whiny)
+{
+    PacmDebug << "Uninstall packages: " << ids.size() << endl;
+
+    UninstallBatch batch = prepareUninstall(ids, whiny);
+    removeUninstallFiles(batch);
+    completeUninstall(batch);
+    return batch.result.success();
+}
+
+
+void PackageManager::uninstallPackagesAsync(const StringVec& ids, uv::Loop* loop,
+                                            UninstallCallback done)
+{
+    PacmDebug << "Uninstall packages async: " << ids.size() << endl;
+
+    auto batch = std::make_shared<UninstallBatch>(prepareUninstall(ids, false));
+    batch->done = std::move(done);
+    {
+        // Claim the packages until the batch completes
+        std::lock_guard<std::mutex> guard(_mutex);
+        for (const auto& entry : batch->entries)
+            _uninstalling.push_back(entry.id);
+    }
+    workerPool().submit(
+        loop, [this, batch]() { removeUninstallFiles(*batch); },
+        [this, batch](std::exception_ptr error) {
+            if (error) {
+                try {
+                    std::rethrow_exception(error);
+                } catch (std::exception& exc) {
+                    SError << "Uninstall error: " << exc.what() << endl;
+                    batch->result.errors.push_back(exc.what());
                 }
-                manifest.root.clear();
-            } else {
-                SDebug << "Uninstall: Empty package manifest: " << id << endl;
             }
+            completeUninstall(*batch);
+        });
+}
+
 
-            // Delete package manifest file
+PackageManager::UninstallBatch PackageManager::prepareUninstall(const StringVec& ids, bool whiny)
+{
+    Tracer::Span span(_tracer.get(), "prepareUninstall", "uninstall");
+    UninstallBatch batch;
+    for (const auto& id : ids) {
+        try {
+            auto* package = localPackages().get(id);
+            if (!package)
+                throw std::runtime_error("Package not found: " + id);
+            if (getInstallTask(id))
+                throw std::runtime_error(package->name() + " is currently installing.");
+            {
+                std::lock_guard<std::mutex> guard(_mutex);
+                if (isUninstalling(id))
+                    throw std::runtime_error(package->name() + " is currently uninstalling.");
+            }
             validatePathComponent(package->id(), "uninstallPackage");
+
+            UninstallBatch::Entry entry;
+            entry.id = id;
+            if (package->isVersioned()) {
+                // Versioned packages own their install root, so all
+                // retained versions and the `current` link go at once.
+                entry.installRoot = package->installRoot();
+            } else {
+                entry.installDir = package->installDir();
+                std::lock_guard<std::recursive_mutex> guard(package->mutex());
+                for (const auto& file : package->manifest().root)
+                    entry.files.push_back(package->getInstalledFilePath(file.get<std::string>()));
+                if (entry.files.empty()) {
+                    PacmDebug << "Uninstall: Empty package manifest: " << id << endl;
+                }
+            }
+            batch.entries.push_back(std::move(entry));
+        } catch (std::exception& exc) {
+            SError << "Fatal uninstall error: " << exc.what() << endl;
+            if (whiny)
+                throw;
+            batch.result.failed.push_back(id);
+            batch.result.errors.push_back(exc.what());
+        }
+    }
+    return batch;
+}
+
+
+void PackageManager::removeUninstallFiles(UninstallBatch& batch)
+{
+    Tracer::Span span(_tracer.get(), "removeUninstallFiles", "uninstall");
+    // Delete the files of every package in one parallel pass
+    // NOTE: If some files fail to delete we still consider the
+    // uninstall a success.
+    std::vector<std::string> files;
+    for (const auto& entry : batch.entries) {
+        for (const auto& file : entry.files) {
+            if (!file.empty() && file.back() != '/' && file.back() != '\\')
+                files.push_back(file); // directories are pruned below
+        }
+    }
+
+    for (const auto& result : removeFiles(files, &workerPool())) {
+        if (result.ok())
+            batch.result.filesRemoved++;
+        else {
+            SError << "Error deleting file: " << result.error << endl;
+            batch.result.errors.push_back(result.error);
+        }
+    }
+
+    for (const auto& entry : batch.entries) {
+        if (!entry.installRoot.empty()) {
+            // std::filesystem never follows the `current` link
+            PacmDebug << "Delete install root: " << entry.installRoot << endl;
+            std::error_code ec;
+            auto removed = std::filesystem::remove_all(entry.installRoot, ec);
+            if (ec)
+                batch.result.errors.push_back(ec.message() + ": " + entry.installRoot);
+            else
+                batch.result.filesRemoved += static_cast<size_t>(removed);
+        } else if (!entry.installDir.empty()) {
+            batch.result.dirsRemoved += pruneEmptyDirs(entry.installDir, entry.files);
+        }
+    }
+}
+
+
+void PackageManager::completeUninstall(UninstallBatch& batch)
+{
+    Tracer::Span span(_tracer.get(), "completeUninstall", "uninstall");
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        for (const auto& entry : batch.entries) {
+            auto it = std::find(_uninstalling.begin(), _uninstalling.end(), entry.id);
+            if (it != _uninstalling.end())
+                _uninstalling.erase(it);
+        }
+    }
+
+    for (const auto& entry : batch.entries) {
+        // Every package is reported, as uninstalled or failed
+        auto* package = localPackages().get(entry.id);
+        if (!package) {
+            batch.result.failed.push_back(entry.id);
+            batch.result.errors.push_back("Package not found: " + entry.id);
+            continue;
+        }
+
+        // Delete package manifest file
+        try {
             std::string path(options().dataDir);
-            path = fs::makePath(path, package->id() + ".json"); // manifest_
+            path = fs::makePath(path, entry.id + ".json"); // manifest_
 
-            SDebug << "Delete manifest: " << path << endl;
+            PacmDebug << "Delete manifest: " << path << endl;
             fs::unlink(path);
         } catch (std::exception& exc) {
             SError << "Nonfatal uninstall error: " << exc.what() << endl;
-            // Swallow and continue...
+            batch.result.errors.push_back(exc.what());
         }
 
         // Set the package as Uninstalled
-        package->setState("Uninstalled");
+        {
+            std::lock_guard<std::recursive_mutex> guard(package->mutex());
+            package->manifest().root.clear();
+            package->setState("Uninstalled");
+        }
 
         // Notify the outside application
         PackageUninstalled.emit(*package);
 
         // Free package reference from memory (unique_ptr handles deletion)
-        localPackages().erase(package->id());
-    } catch (std::exception& exc) {
-        SError << "Fatal uninstall error: " << exc.what() << endl;
-        if (whiny)
-            throw exc;
-        else
-            return false;
+        localPackages().erase(entry.id);
+        batch.result.packages.push_back(entry.id);
     }
 
-    return true;
+    SInfo << "Uninstalled packages: " << batch.result.packages.size()
+          << ", Files=" << batch.result.filesRemoved
+          << ", Directories=" << batch.result.dirsRemoved
+          << ", Errors=" << batch.result.errors.size() << endl;
+
+    publishSnapshot();
+    _metrics.counter("pacm_uninstalls_total", "Packages uninstalled", {{"result", "Uninstalled"}})
+        .inc(static_cast<double>(batch.result.packages.size()));
+    _metrics.counter("pacm_uninstalls_total", "Packages uninstalled", {{"result", "Failed"}})
+        .inc(static_cast<double>(batch.result.failed.size()));
+    if (batch.done)
+        batch.done(batch.result);
+    UninstallComplete.emit(batch.result);
+    exportMetrics();
 }
 
 
-bool PackageManager::uninstallPackages(const StringVec& ids, bool whiny)
+bool PackageManager::isUninstalling(const std::string& id) const
 {
-    SDebug << "Uninstall packages: " << ids.size() << endl;
-    bool res = true;
-    for (const auto& id : ids) {
-        if (!uninstallPackage(id, whiny))
-            res = false;
-    }
-    return res;
+    return std::find(_uninstalling.begin(), _uninstalling.end(), id) != _uninstalling.end();
 }
 
 
@@ -529,28 +828,40 @@ InstallTask::Ptr PackageManager::createInstallTask(PackagePair& pair, const Inst
     // Ensure we only have one task per package
     if (getInstallTask(pair.remote->id()))
         throw std::runtime_error(pair.remote->name() + " is already installing.");
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (isUninstalling(pair.remote->id()))
+            throw std::runtime_error(pair.remote->name() + " is currently uninstalling.");
+    }
 
     auto task = std::make_shared<InstallTask>(*this, pair.local, pair.remote, options);
     task->Complete += slot(this, &PackageManager::onPackageInstallComplete, -1, -1); // lowest priority to remove task
     {
         std::lock_guard<std::mutex> guard(_mutex);
         _tasks.push_back(task);
+        updateTaskGauges();
     }
     InstallTaskCreated.emit(*task);
     return task; // must call task->start()
 }
 
 
+std::shared_ptr<Transaction> PackageManager::beginTransaction()
+{
+    return std::make_shared<Transaction>(*this);
+}
+
+
 bool PackageManager::hasUnfinalizedPackages()
 {
-    SDebug << "checking for unfinalized packages" << endl;
+    PacmDebug << "checking for unfinalized packages" << endl;
 
     bool res = false;
     auto& packages = localPackages();
     for (auto& [key, pkg] : packages) {
         if (pkg->state() == "Installing" &&
             pkg->installState() == "Finalizing") {
-            SDebug << "finalization required: " << pkg->name() << endl;
+            PacmDebug << "finalization required: " << pkg->name() << endl;
             res = true;
         }
     }
@@ -561,7 +872,7 @@ bool PackageManager::hasUnfinalizedPackages()
 
 bool PackageManager::finalizeInstallations(bool whiny)
 {
-    SDebug << "Finalizing installations" << endl;
+    PacmDebug << "Finalizing installations" << endl;
 
     bool res = true;
     auto& packages = localPackages();
@@ -569,18 +880,25 @@ bool PackageManager::finalizeInstallations(bool whiny)
         try {
             if (pkg->state() == "Installing" &&
                 pkg->installState() == "Finalizing") {
-                SDebug << "Finalizing: " << pkg->name() << endl;
+                PacmDebug << "Finalizing: " << pkg->name() << endl;
 
                 // Create an install task on the stack - we only have
                 // to move some files around so no async required.
                 InstallTask task(*this, pkg.get(), nullptr);
+                task.setState(&task, InstallationState::Finalizing);
                 task.doFinalize();
 
-                if (pkg->state() != "Installed" || pkg->installState() != "Installed")
-                    LWarn("Package not in expected state after finalization");
+                if (task.hasBusyFiles()) {
+                    LWarn("Package files still in use after finalization");
+                    res = false;
+                } else {
+                    pkg->setState("Installed");
+                    pkg->clearErrors();
+                    task.setState(&task, InstallationState::Installed);
 
-                // Manually emit the install complete signal.
-                InstallTaskComplete.emit(task);
+                    // Manually emit the install complete signal.
+                    InstallTaskComplete.emit(task);
+                }
             }
         } catch (std::exception& exc) {
             SError << "Finalize Error: " << exc.what() << endl;
@@ -593,32 +911,409 @@ bool PackageManager::finalizeInstallations(bool whiny)
         saveLocalPackage(*pkg, false);
     }
 
+    publishSnapshot();
     return res;
 }
 
+void PackageManager::activatePackageVersion(LocalPackage& package,
+                                            const std::string& version)
+{
+    std::string versionDir = package.getVersionDir(version); // throw if not versioned
+    if (!fs::isdir(versionDir))
+        throw std::runtime_error("Package version is not installed: " + version);
+
+    // Create the new link beside the old one and rename it into place.
+    // rename(2) replaces the destination atomically, so there is never
+    // a moment where `current` is missing or half written.
+    std::string link = fs::makePath(package.installRoot(), PACKAGE_CURRENT_LINK);
+    std::string temp = link + ".tmp";
+    std::error_code ec;
+    std::filesystem::remove(temp, ec);
+    std::filesystem::create_directory_symlink(version, temp); // relative target
+    std::filesystem::rename(temp, link);
+
+    PacmDebug << "Activated version: " << package.id() << ": " << version << endl;
+}
+
+
+void PackageManager::retainPackageVersion(LocalPackage& package)
+{
+    package.retainInstalledVersion();
+
+    size_t limit = static_cast<size_t>(std::max(options().retainedVersions, 1));
+    for (const auto& version : package.pruneRetainedVersions(limit)) {
+        std::string dir = package.getVersionDir(version);
+        PacmDebug << "Removing retained version: " << dir << endl;
+        std::error_code ec;
+        std::filesystem::remove_all(dir, ec);
+        if (ec)
+            SWarn << "Cannot remove retained version: " << dir << ": " << ec.message() << endl;
+    }
+}
+
+
+bool PackageManager::rollbackPackage(const std::string& id,
+                                     const std::string& version, bool whiny)
+{
+    PacmDebug << "Rollback package: " << id << ": " << version << endl;
+
+    try {
+        auto* package = localPackages().get(id);
+        if (!package)
+            throw std::runtime_error("Package not found: " + id);
+        if (!package->isVersioned())
+            throw std::runtime_error("Package does not use the versioned install layout: " + id);
+        if (getInstallTask(id))
+            throw std::runtime_error(package->name() + " is currently installing.");
+
+        // Default to the newest retained version before the current one
+        std::string target(version);
+        if (target.empty()) {
+            std::lock_guard<std::recursive_mutex> guard(package->mutex());
+            const json::Value& retained = package->retainedVersions();
+            for (auto it = retained.rbegin(); it != retained.rend(); ++it) {
+                std::string entryVersion = it->value("version", "");
+                if (entryVersion != package->version()) {
+                    target = entryVersion;
+                    break;
+                }
+            }
+            if (target.empty())
+                throw std::runtime_error("No retained version to roll back to: " + id);
+        }
+
+        // Validate the target before the link is swapped, so a version
+        // which is on disk but not retained is never activated.
+        {
+            std::lock_guard<std::recursive_mutex> guard(package->mutex());
+            if (!package->isVersionRetained(target))
+                throw std::runtime_error("Package version is not retained: " + target);
+            activatePackageVersion(*package, target);
+            package->restoreRetainedVersion(target);
+            package->clearErrors();
+        }
+        saveLocalPackage(*package, true);
+
+        SInfo << "Package rolled back: " << id << ": " << target << endl;
+        publishPackage(id);
+        PackageRolledBack.emit(*package);
+    } catch (std::exception& exc) {
+        SError << "Rollback error: " << exc.what() << endl;
+        if (whiny)
+            throw;
+        return false;
+    }
+
+    return true;
+}
+
+
 void PackageManager::onPackageInstallComplete(InstallTask& task)
 {
-    STrace << "Install complete: " << task.state().toString() << endl;
+    PacmTrace << "Install complete: " << task.state().toString() << endl;
 
     // Save the local package
     saveLocalPackage(*task.local());
+    publishPackage(task.local()->id());
 
     // PackageInstallationComplete.emit(*task.local());
+    recordTaskMetrics(task);
     InstallTaskComplete.emit(task);
 
-    // Remove the task reference
+    // Remove the task reference. It is usually the last one, so keep
+    // the task alive until the dependents have been notified.
+    InstallTask::Ptr keep;
+    InstallTaskPtrVec dependents;
+    bool idle;
     {
         std::lock_guard<std::mutex> guard(_mutex);
         for (auto it = _tasks.begin(); it != _tasks.end(); it++) {
             if (it->get() == &task) {
+                keep = *it;
                 _tasks.erase(it);
                 break;
             }
         }
+        _scheduledTasks.erase(std::remove(_scheduledTasks.begin(), _scheduledTasks.end(), &task),
+                              _scheduledTasks.end());
+        dependents = _tasks;
+        idle = _tasks.empty();
+        updateTaskGauges();
+    }
+
+    // Release the tasks waiting on this package, and fill the freed slot
+    for (auto& dependent : dependents)
+        dependent->onDependencyComplete(task);
+    dependents.clear();
+    keep.reset();
+    startScheduledTasks();
+
+    // Write the cache and metrics files once per batch rather than
+    // after every package, since this runs on the loop thread.
+    if (idle) {
+        saveChecksumCache();
+        exportMetrics();
+    }
+}
+
+
+void PackageManager::scheduleTask(const InstallTask::Ptr& task)
+{
+    std::uint64_t fileSize = 0;
+    try {
+        fileSize = task->getRemoteAsset().fileSize();
+    } catch (std::exception&) {
+        // Unknown sizes sort first, like the smallest jobs
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        int priority = task->options().priority;
+        _queuedTasks.push_back({task, priority, fileSize});
+        updateTaskGauges();
+
+        // Raise queued dependencies to our priority, so that a high
+        // priority package is never stuck behind a low priority one.
+        StringVec pending = task->pendingDependencies();
+        while (!pending.empty()) {
+            std::string id = pending.back();
+            pending.pop_back();
+            for (auto& queued : _queuedTasks) {
+                if (queued.task->local()->id() == id && queued.priority < priority) {
+                    queued.priority = priority;
+                    for (const auto& dependency : queued.task->pendingDependencies())
+                        pending.push_back(dependency);
+                }
+            }
+        }
+    }
+    startScheduledTasks();
+}
+
+
+void PackageManager::startScheduledTasks()
+{
+    size_t limit = options().maxConcurrentInstalls;
+    if (limit == 0)
+        limit = workerPool().size();
+
+    while (true) {
+        InstallTask::Ptr task;
+        {
+            std::lock_guard<std::mutex> guard(_mutex);
+            size_t running = std::count_if(
+                _scheduledTasks.begin(), _scheduledTasks.end(), [](InstallTask* scheduled) {
+                    return !(scheduled->holdFinalize() &&
+                             scheduled->stateEquals(InstallationState::Finalizing));
+                });
+            if (_queuedTasks.empty() || running >= limit)
+                return;
+
+            // Only tasks whose dependencies have all been started are
+            // eligible, so a waiting task never holds a slot needed by
+            // one of its dependencies. Ties keep the queue order.
+            auto isQueued = [&](const std::string& id) {
+                return std::any_of(_queuedTasks.begin(), _queuedTasks.end(),
+                                   [&](const QueuedTask& queued) {
+                                       return queued.task->local()->id() == id;
+                                   });
+            };
+            auto best = _queuedTasks.end();
+            for (auto it = _queuedTasks.begin(); it != _queuedTasks.end(); ++it) {
+                auto pending = it->task->pendingDependencies();
+                if (std::any_of(pending.begin(), pending.end(), isQueued))
+                    continue;
+                if (best == _queuedTasks.end() || it->priority > best->priority ||
+                    (it->priority == best->priority && it->fileSize < best->fileSize))
+                    best = it;
+            }
+            if (best == _queuedTasks.end())
+                return; // only reached with a dependency cycle
+
+            task = best->task;
+            _queuedTasks.erase(best);
+            _scheduledTasks.push_back(task.get());
+            updateTaskGauges();
+        }
+
+        try {
+            task->start();
+        } catch (std::exception& exc) {
+            // Complete the task as failed through its Complete signal,
+            // so that awaiters and monitors see it finish, its dependents
+            // are released and the slot is reused. Completion is deferred
+            // to the loop, since the caller may not have connected yet.
+            SError << "Cannot start install task: " << exc.what() << endl;
+            task->local()->setState("Failed");
+            task->local()->addError(exc.what());
+            task->setState(task.get(), InstallationState::Failed);
+            runOnLoop(task->loop(), [task]() { task->setComplete(); });
+        }
     }
 }
 
 
+//
+// Coroutine methods
+//
+
+QueryAwaiter PackageManager::queryRemote(uv::Loop* loop)
+{
+    return QueryAwaiter(*this, loop);
+}
+
+
+InstallAwaiter PackageManager::install(const std::string& id,
+                                       const InstallOptions& options)
+{
+    // A package already being installed, perhaps as a dependency of an
+    // earlier install, is awaited rather than installed again.
+    if (auto task = getInstallTask(id))
+        return InstallAwaiter(task);
+
+    // Dependencies are installed first and every task goes through
+    // the scheduler, so the awaited task finishes after them.
+    installPackages({id}, options, nullptr, true);
+    return InstallAwaiter(getInstallTask(id));
+}
+
+
+InstallAwaiter PackageManager::update(const std::string& id,
+                                      const InstallOptions& options)
+{
+    if (auto task = getInstallTask(id))
+        return InstallAwaiter(task);
+
+    updatePackages({id}, options, nullptr, true);
+    return InstallAwaiter(getInstallTask(id));
+}
+
+
+UninstallAwaiter PackageManager::uninstall(const StringVec& ids, uv::Loop* loop)
+{
+    return UninstallAwaiter(*this, ids, loop);
+}
+
+
+QueryAwaiter::QueryAwaiter(PackageManager& manager, uv::Loop* loop)
+    : _manager(manager)
+    , _loop(loop)
+    , _connected(false)
+    , _status(0)
+{
+}
+
+
+QueryAwaiter::~QueryAwaiter() noexcept
+{
+    if (_connected)
+        _manager.RemotePackageResponse -= slot(this, &QueryAwaiter::onResponse);
+}
+
+
+void QueryAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    _handle = handle;
+    _manager.RemotePackageResponse += slot(this, &QueryAwaiter::onResponse);
+    _connected = true;
+    try {
+        _manager.queryRemotePackages();
+    } catch (...) {
+        _manager.RemotePackageResponse -= slot(this, &QueryAwaiter::onResponse);
+        _connected = false;
+        throw;
+    }
+}
+
+
+void QueryAwaiter::await_resume()
+{
+    if (_status >= 400)
+        throw std::runtime_error("Package query failed with HTTP status " +
+                                 std::to_string(_status));
+    if (!_error.empty())
+        throw std::runtime_error("Package query failed: " + _error);
+}
+
+
+void QueryAwaiter::onResponse(const http::Response& response)
+{
+    _status = static_cast<int>(response.getStatus());
+    _error = _manager.queryError();
+    _manager.RemotePackageResponse -= slot(this, &QueryAwaiter::onResponse);
+    _connected = false;
+    resumeOnLoop(_loop, _handle);
+}
+
+
+InstallAwaiter::InstallAwaiter(InstallTask::Ptr task)
+    : _task(std::move(task))
+    , _connected(false)
+{
+}
+
+
+InstallAwaiter::InstallAwaiter(InstallAwaiter&& other) noexcept
+    : _task(std::move(other._task))
+    , _connected(false)
+{
+    // Awaiters are only moved before they are awaited, so
+    // there is no slot to transfer.
+}
+
+
+InstallAwaiter::~InstallAwaiter() noexcept
+{
+    if (_connected)
+        _task->Complete -= slot(this, &InstallAwaiter::onComplete);
+}
+
+
+void InstallAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    _handle = handle;
+    _task->Complete += slot(this, &InstallAwaiter::onComplete);
+    _connected = true;
+}
+
+
+void InstallAwaiter::onComplete(InstallTask& task)
+{
+    task.Complete -= slot(this, &InstallAwaiter::onComplete);
+    _connected = false;
+    resumeOnLoop(task.loop(), _handle);
+}
+
+
+UninstallAwaiter::UninstallAwaiter(PackageManager& manager, StringVec ids, uv::Loop* loop)
+    : _manager(manager)
+    , _ids(std::move(ids))
+    , _loop(loop)
+    , _state(std::make_shared<State>())
+{
+}
+
+
+UninstallAwaiter::~UninstallAwaiter() noexcept
+{
+    // The batch may still complete, so it must not resume us
+    _state->handle = nullptr;
+}
+
+
+void UninstallAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    // Only this batch resumes us, whatever else is uninstalled meanwhile
+    _state->handle = handle;
+    _manager.uninstallPackagesAsync(_ids, _loop,
+                                    [state = _state, loop = _loop](const UninstallResult& result) {
+                                        state->result = result;
+                                        if (state->handle)
+                                            resumeOnLoop(loop, state->handle);
+                                    });
+}
+
+
 //
 // Task helper methods
 //
@@ -690,6 +1385,14 @@ PackagePairVec PackageManager::getPackagePairs() const
 PackagePairVec PackageManager::getUpdatablePackagePairs() const
 {
     PackagePairVec pairs = getPackagePairs();
+
+    // Verify the installed packages in parallel up front, so the checks
+    // below are answered from each package's verification cache.
+    workerPool().parallelFor(pairs.size(), [&pairs](size_t i) {
+        if (pairs[i].local && pairs[i].local->isInstalled())
+            pairs[i].local->verifyInstallManifest();
+    });
+
     for (auto it = pairs.begin(); it != pairs.end();) {
         if (!hasAvailableUpdates(*it)) {
             it = pairs.erase(it);
@@ -795,10 +1498,10 @@ bool PackageManager::hasCachedFile(Package::Asset& asset)
         return false;
 
     // Validate file size if the asset specifies one
-    int expectedSize = asset.fileSize();
+    std::uint64_t expectedSize = asset.fileSize();
     if (expectedSize > 0) {
         auto actualSize = fs::filesize(path);
-        if (static_cast<std::int64_t>(expectedSize) != actualSize)
+        if (actualSize < 0 || static_cast<std::uint64_t>(actualSize) != expectedSize)
             return false;
     }
 
@@ -829,6 +1532,40 @@ std::string PackageManager::getPackageDataDir(std::string_view id)
 }
 
 
+std::string PackageManager::getPackageStoreDir(std::string_view id, std::string_view version)
+{
+    validatePathComponent(id, "getPackageStoreDir");
+    validatePathComponent(version, "getPackageStoreDir");
+    std::string dir = fs::makePath(options().dataDir, PACKAGE_STORE_DIR);
+    dir = fs::makePath(dir, id);
+    return fs::makePath(dir, version);
+}
+
+
+bool PackageManager::hasStoredPackage(std::string_view id, std::string_view version)
+{
+    // The manifest is written beside the version directory once
+    // extraction has completed, so it doubles as the completion marker.
+    std::string dir = getPackageStoreDir(id, version);
+    return fs::isdir(dir) && fs::exists(dir + ".json");
+}
+
+
+void PackageManager::clearContentStore(std::string_view id)
+{
+    std::string dir = fs::makePath(options().dataDir, PACKAGE_STORE_DIR);
+    if (!id.empty()) {
+        validatePathComponent(id, "clearContentStore");
+        dir = fs::makePath(dir, id);
+    }
+
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+    if (ec)
+        SWarn << "Cannot clear content store: " << dir << ": " << ec.message() << endl;
+}
+
+
 PackageManager::Options& PackageManager::mutableOptions()
 {
     std::lock_guard<std::mutex> guard(_mutex);
@@ -843,6 +1580,134 @@ const PackageManager::Options& PackageManager::options() const
 }
 
 
+WorkerPool& PackageManager::workerPool() const
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    if (!_workerPool)
+        _workerPool = std::make_unique<WorkerPool>(_options.workerThreads);
+    return *_workerPool;
+}
+
+
+ChecksumCache* PackageManager::checksumCache()
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    if (!_options.checksumCache)
+        return nullptr;
+    if (!_checksumCache)
+        _checksumCache = std::make_unique<ChecksumCache>(
+            fs::makePath(_options.dataDir, CHECKSUM_CACHE_FILE));
+    return _checksumCache.get();
+}
+
+
+void PackageManager::saveChecksumCache()
+{
+    ChecksumCache* cache;
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        cache = _checksumCache.get();
+    }
+    if (!cache)
+        return;
+    try {
+        cache->save();
+    } catch (std::exception& exc) {
+        SWarn << "Cannot save checksum cache: " << exc.what() << endl;
+    }
+}
+
+
+MetricsRegistry& PackageManager::metrics()
+{
+    return _metrics;
+}
+
+
+void PackageManager::setTracer(std::shared_ptr<Tracer> tracer)
+{
+    _tracer = std::move(tracer);
+}
+
+
+Tracer* PackageManager::tracer() const
+{
+    return _tracer.get();
+}
+
+
+void PackageManager::exportMetrics()
+{
+    if (!_options.metricsFile.empty()) {
+        try {
+            _metrics.writeFile(_options.metricsFile);
+        } catch (std::exception& exc) {
+            SWarn << "Cannot export metrics: " << exc.what() << endl;
+        }
+    }
+    MetricsUpdated.emit(_metrics);
+}
+
+
+void PackageManager::recordTaskMetrics(const InstallTask& task)
+{
+    InstallStats stats = task.stats();
+    auto seconds = [&](unsigned int state) {
+        return std::chrono::duration<double>(stats.stateTime(state)).count();
+    };
+    auto entered = [&](unsigned int state) {
+        return std::any_of(stats.transitions.begin(), stats.transitions.end(),
+                           [&](const InstallStats::Transition& t) { return t.state == state; });
+    };
+
+    // A task which extracted without downloading used the content store
+    if (entered(InstallationState::Extracting)) {
+        if (entered(InstallationState::Downloading))
+            _metrics.counter("pacm_cache_misses_total", "Installs which downloaded their archive").inc();
+        else
+            _metrics.counter("pacm_cache_hits_total", "Installs served from the content store").inc();
+    }
+
+    if (entered(InstallationState::Downloading)) {
+        _metrics.histogram("pacm_download_seconds", "Archive download time")
+            .observe(seconds(InstallationState::Downloading));
+        _metrics.counter("pacm_download_bytes_total", "Archive bytes downloaded")
+            .inc(static_cast<double>(stats.bytesDownloaded));
+    }
+    if (entered(InstallationState::Extracting)) {
+        _metrics.histogram("pacm_extract_seconds", "Archive verification and extraction time")
+            .observe(seconds(InstallationState::Extracting));
+        _metrics.counter("pacm_extract_bytes_total", "Bytes written by extraction")
+            .inc(static_cast<double>(stats.bytesWritten));
+    }
+    if (entered(InstallationState::Finalizing)) {
+        _metrics.histogram("pacm_finalize_seconds", "Finalization time, including holds")
+            .observe(seconds(InstallationState::Finalizing));
+    }
+
+    // Failures are attributed to the stage which was running
+    std::string result = task.state().toString();
+    if (task.failed()) {
+        size_t count = stats.transitions.size();
+        std::string stage = InstallationState().str(
+            count >= 2 ? stats.transitions[count - 2].state
+                       : static_cast<unsigned int>(InstallationState::None));
+        _metrics.counter("pacm_failures_total", "Failures by stage", {{"stage", stage}}).inc();
+    }
+    _metrics.counter("pacm_installs_total", "Completed install tasks by result", {{"result", result}})
+        .inc();
+}
+
+
+void PackageManager::updateTaskGauges()
+{
+    _metrics.gauge("pacm_tasks_active", "Install tasks created and not queued")
+        .set(static_cast<double>(_tasks.size() - _queuedTasks.size()));
+    _metrics.gauge("pacm_tasks_queued", "Install tasks waiting for a scheduling slot")
+        .set(static_cast<double>(_queuedTasks.size()));
+}
+
+
 RemotePackageStore& PackageManager::remotePackages()
 {
     std::lock_guard<std::mutex> guard(_mutex);
@@ -857,6 +1722,282 @@ LocalPackageStore& PackageManager::localPackages()
 }
 
 
+PackageSnapshot::Ptr PackageManager::snapshot() const
+{
+    std::lock_guard<std::mutex> guard(_snapshotMutex);
+    return _snapshot;
+}
+
+
+namespace {
+
+
+/// Returns a copy of @p package without its manifest.
+std::shared_ptr<const LocalPackage> copyWithoutManifest(const LocalPackage& package)
+{
+    auto copy = std::make_shared<LocalPackage>();
+    json::Value& root = *copy;
+    root = json::Value::object();
+    for (auto it = package.begin(); it != package.end(); ++it) {
+        if (it.key() != "manifest")
+            root[it.key()] = it.value();
+    }
+    return copy;
+}
+
+
+/// Returns the manifest of @p package, sharing @p previous if it is
+/// unchanged. Comparing allocates nothing, unlike a copy.
+std::shared_ptr<const json::Value> shareManifest(const LocalPackage& package,
+                                                 std::shared_ptr<const json::Value> previous)
+{
+    auto it = package.find("manifest");
+    if (it == package.end())
+        return nullptr;
+    if (previous && *previous == *it)
+        return previous;
+    return std::make_shared<const json::Value>(*it);
+}
+
+
+/// Returns @p previous if it is equal to @p package, or a copy.
+std::shared_ptr<const RemotePackage> shareRemote(const RemotePackage& package,
+                                                 std::shared_ptr<const RemotePackage> previous)
+{
+    if (previous && static_cast<const json::Value&>(*previous) ==
+                        static_cast<const json::Value&>(package))
+        return previous;
+    return std::make_shared<const RemotePackage>(package);
+}
+
+
+} // namespace
+
+
+void PackageManager::publishSnapshot()
+{
+    std::lock_guard<std::mutex> publish(_publishMutex);
+
+    // Workers update packages under their own lock, so each one is
+    // locked while it is read. Re-parsing the index mostly yields
+    // unchanged packages, which keep their previous entry.
+    auto previous = snapshot();
+    PackageSnapshot::LocalMap::Entries local;
+    PackageSnapshot::RemoteMap::Entries remote;
+    PackageSnapshot::ManifestMap::Entries manifests;
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        for (const auto& [id, package] : _localPackages) {
+            std::lock_guard<std::recursive_mutex> packageGuard(package->mutex());
+            local.emplace(id, copyWithoutManifest(*package));
+            auto manifest = shareManifest(*package, previous ? previous->localManifest(id) : nullptr);
+            if (manifest)
+                manifests.emplace(id, std::move(manifest));
+        }
+        for (const auto& [id, package] : _remotePackages)
+            remote.emplace(id, shareRemote(*package, previous ? previous->remotePackage(id) : nullptr));
+    }
+
+    auto next = std::make_shared<PackageSnapshot>();
+    next->local = std::make_shared<const PackageSnapshot::LocalMap>(local);
+    next->remote = std::make_shared<const PackageSnapshot::RemoteMap>(remote);
+    next->manifests = std::make_shared<const PackageSnapshot::ManifestMap>(manifests);
+    next->version = previous ? previous->version + 1 : 1;
+    swapSnapshot(std::move(next));
+}
+
+
+void PackageManager::publishPackage(const std::string& id)
+{
+    std::lock_guard<std::mutex> publish(_publishMutex);
+
+    auto previous = snapshot();
+    auto previousManifest = previous->localManifest(id);
+    std::shared_ptr<const LocalPackage> copy;
+    std::shared_ptr<const json::Value> manifest;
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (auto* package = _localPackages.get(id)) {
+            std::lock_guard<std::recursive_mutex> packageGuard(package->mutex());
+            copy = copyWithoutManifest(*package);
+            manifest = shareManifest(*package, previousManifest);
+        }
+    }
+
+    // Replace one entry; the remote packages, every other local
+    // package and an unchanged manifest are shared with the previous
+    // snapshot.
+    auto next = std::make_shared<PackageSnapshot>();
+    next->local = std::make_shared<const PackageSnapshot::LocalMap>(
+        previous->local->with(id, std::move(copy)));
+    next->remote = previous->remote;
+    next->manifests = manifest == previousManifest
+                          ? previous->manifests
+                          : std::make_shared<const PackageSnapshot::ManifestMap>(
+                                previous->manifests->with(id, std::move(manifest)));
+    next->version = previous->version + 1;
+    swapSnapshot(std::move(next));
+}
+
+
+void PackageManager::swapSnapshot(PackageSnapshot::Ptr next)
+{
+    {
+        std::lock_guard<std::mutex> guard(_snapshotMutex);
+        _snapshot.swap(next);
+    }
+    // The previous snapshot is released here, outside the lock
+}
+
+
+namespace {
+
+
+/// Bytes of a red-black tree node besides its value: colour and three links.
+constexpr size_t kMapNodeOverhead = 4 * sizeof(void*);
+
+
+struct JsonFootprint
+{
+    size_t dom = 0;
+    size_t strings = 0;
+
+    size_t total() const { return dom + strings; }
+};
+
+
+/// Returns the heap bytes of a string which has outgrown its inline buffer.
+size_t stringHeapBytes(const std::string& str)
+{
+    static const size_t inlineCapacity = std::string().capacity();
+    return str.capacity() > inlineCapacity ? str.capacity() + 1 : 0;
+}
+
+
+/// Adds the heap storage owned by @p value. The value itself is
+/// counted by its parent container, or by the owning object.
+void measureJson(const json::Value& value, JsonFootprint& footprint)
+{
+    using Value = json::Value;
+    switch (value.type()) {
+        case Value::value_t::object: {
+            const auto& object = value.get_ref<const Value::object_t&>();
+            footprint.dom += sizeof(object) +
+                             object.size() * (sizeof(Value::object_t::value_type) + kMapNodeOverhead);
+            for (const auto& [key, child] : object) {
+                footprint.strings += stringHeapBytes(key);
+                measureJson(child, footprint);
+            }
+            break;
+        }
+        case Value::value_t::array: {
+            const auto& array = value.get_ref<const Value::array_t&>();
+            footprint.dom += sizeof(array) + array.capacity() * sizeof(Value);
+            for (const auto& child : array)
+                measureJson(child, footprint);
+            break;
+        }
+        case Value::value_t::string: {
+            const auto& str = value.get_ref<const Value::string_t&>();
+            footprint.dom += sizeof(str);
+            footprint.strings += stringHeapBytes(str);
+            break;
+        }
+        case Value::value_t::binary: {
+            const auto& binary = value.get_ref<const Value::binary_t&>();
+            footprint.dom += sizeof(binary) + binary.capacity();
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+
+/// Returns the footprint of member @p key of @p package, or nothing if absent.
+JsonFootprint measureMember(const json::Value& package, const char* key)
+{
+    JsonFootprint footprint;
+    auto it = package.find(key);
+    if (it != package.end())
+        measureJson(*it, footprint);
+    return footprint;
+}
+
+
+/// Adds one package and its store entry to @p stats.
+template <typename PackageT>
+void measurePackage(const std::string& id, const PackageT& package, StoreMemoryStats& stats)
+{
+    std::lock_guard<std::recursive_mutex> guard(package.mutex());
+    const json::Value& root = package;
+
+    JsonFootprint footprint;
+    measureJson(root, footprint);
+    stats.packages++;
+    stats.objectBytes += sizeof(PackageT) + sizeof(std::pair<const std::string, void*>) +
+                         kMapNodeOverhead + stringHeapBytes(id);
+    stats.domBytes += footprint.dom;
+    stats.stringBytes += footprint.strings;
+
+    if constexpr (std::is_same_v<PackageT, RemotePackage>) {
+        auto assets = root.find("assets");
+        if (assets != root.end() && assets->is_array())
+            stats.assets += assets->size();
+        stats.assetBytes += measureMember(root, "assets").total();
+    } else {
+        auto asset = root.find("asset");
+        if (asset != root.end() && asset->is_object() && !asset->empty())
+            stats.assets++;
+        stats.assetBytes += measureMember(root, "asset").total();
+
+        auto manifest = root.find("manifest");
+        if (manifest != root.end() && manifest->is_array())
+            stats.manifestEntries += manifest->size();
+        stats.manifestBytes += measureMember(root, "manifest").total();
+    }
+}
+
+
+} // namespace
+
+
+MemoryStats PackageManager::memoryStats() const
+{
+    // Each package is locked while it is measured, as in publishSnapshot()
+    MemoryStats stats;
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        for (const auto& [id, package] : _remotePackages)
+            measurePackage(id, *package, stats.remote);
+        for (const auto& [id, package] : _localPackages)
+            measurePackage(id, *package, stats.local);
+    }
+
+    // Snapshot packages and manifests are copies, each with a
+    // make_shared control block
+    if (auto current = snapshot()) {
+        StoreMemoryStats copies;
+        current->remote->forEach([&](const std::string& id, const auto& package) {
+            measurePackage(id, *package, copies);
+        });
+        current->local->forEach([&](const std::string& id, const auto& package) {
+            measurePackage(id, *package, copies);
+        });
+        size_t blocks = copies.packages;
+        current->manifests->forEach([&](const std::string&, const auto& manifest) {
+            JsonFootprint footprint;
+            measureJson(*manifest, footprint);
+            copies.domBytes += sizeof(json::Value) + footprint.dom;
+            copies.stringBytes += footprint.strings;
+            blocks++;
+        });
+        stats.snapshotBytes = copies.totalBytes() + blocks * 2 * sizeof(void*);
+    }
+    return stats;
+}
+
+
 } // namespace pacm
 } // namespace icy
 
@@ -0,0 +1,175 @@
+///
+//
+// icey
+// Copyright (c) 2005, icey <https://0state.com>
+//
+// SPDX-License-Identifier: LGPL-2.1+
+//
+/// @addtogroup pacm
+/// @{
+
+
+#include "icy/pacm/tracer.h"
+
+#include <fstream>
+#include <stdexcept>
+
+
+using namespace std;
+
+
+namespace icy {
+namespace pacm {
+
+
+//
+// Span
+//
+
+
+Tracer::Span::Span(Tracer* tracer, std::string name, const char* category, uint64_t lane)
+    : _tracer(tracer)
+    , _category(category)
+    , _lane(lane)
+{
+    if (_tracer) {
+        _name = std::move(name);
+        _start = Clock::now();
+    }
+}
+
+
+Tracer::Span::~Span() noexcept
+{
+    if (!_tracer)
+        return;
+    try {
+        _tracer->complete(_name, _category, _start, Clock::now(), _lane, std::move(_args));
+    } catch (std::exception&) {
+        // Tracing must never fail the traced operation
+    }
+}
+
+
+void Tracer::Span::arg(const std::string& key, json::Value value)
+{
+    if (_tracer)
+        _args[key] = std::move(value);
+}
+
+
+//
+// Tracer
+//
+
+
+Tracer::Tracer()
+    : _origin(Clock::now())
+    , _nextLane(1)
+{
+}
+
+
+void Tracer::complete(const std::string& name, const char* category,
+                      Clock::time_point start, Clock::time_point end,
+                      uint64_t lane, json::Value args)
+{
+    if (lane == 0)
+        lane = threadLane();
+
+    std::lock_guard<std::mutex> guard(_mutex);
+    _events.push_back({name, category, lane, start, end, std::move(args)});
+}
+
+
+uint64_t Tracer::lane(const std::string& name)
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    uint64_t id = _nextLane++;
+    _laneNames[id] = name;
+    return id;
+}
+
+
+uint64_t Tracer::threadLane()
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    auto it = _threadLanes.find(std::this_thread::get_id());
+    if (it != _threadLanes.end())
+        return it->second;
+
+    uint64_t id = _nextLane++;
+    _laneNames[id] = "thread " + std::to_string(_threadLanes.size() + 1);
+    _threadLanes[std::this_thread::get_id()] = id;
+    return id;
+}
+
+
+size_t Tracer::size() const
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    return _events.size();
+}
+
+
+void Tracer::clear()
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    _events.clear();
+}
+
+
+json::Value Tracer::toJson() const
+{
+    using us = std::chrono::duration<double, std::micro>;
+
+    std::lock_guard<std::mutex> guard(_mutex);
+    json::Value events = json::Value::array();
+
+    // Lane labels, sorted by creation order in the viewer
+    for (const auto& [id, name] : _laneNames) {
+        events.push_back({{"name", "thread_name"}, {"ph", "M"}, {"pid", 1}, {"tid", id},
+                          {"args", {{"name", name}}}});
+        events.push_back({{"name", "thread_sort_index"}, {"ph", "M"}, {"pid", 1}, {"tid", id},
+                          {"args", {{"sort_index", id}}}});
+    }
+
+    for (const auto& event : _events) {
+        json::Value entry = {{"name", event.name},
+                             {"cat", event.category},
+                             {"ph", "X"},
+                             {"pid", 1},
+                             {"tid", event.lane},
+                             {"ts", us(event.start - _origin).count()},
+                             {"dur", us(event.end - event.start).count()}};
+        if (!event.args.is_null())
+            entry["args"] = event.args;
+        events.push_back(std::move(entry));
+    }
+
+    return {{"traceEvents", std::move(events)}, {"displayTimeUnit", "ms"}};
+}
+
+
+void Tracer::write(std::ostream& os) const
+{
+    os << toJson().dump();
+}
+
+
+void Tracer::writeFile(const std::string& path) const
+{
+    std::ofstream file(path, std::ios::out | std::ios::trunc);
+    if (!file)
+        throw std::runtime_error("Cannot write trace file: " + path);
+    write(file);
+    if (!file.flush())
+        throw std::runtime_error("Cannot write trace file: " + path);
+}
+
+
+} // namespace pacm
+} // namespace icy
+
+
+/// @}
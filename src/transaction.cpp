@@ -0,0 +1,421 @@
+///
+//
+// icey
+// Copyright (c) 2005, icey <https://0state.com>
+//
+// SPDX-License-Identifier: LGPL-2.1+
+//
+/// @addtogroup pacm
+/// @{
+
+
+#include "icy/pacm/transaction.h"
+#include "icy/filesystem.h"
+#include "icy/logger.h"
+#include "icy/pacm/async.h"
+
+#include <filesystem>
+
+
+using namespace std;
+
+
+namespace icy {
+namespace pacm {
+
+
+Transaction::Transaction(PackageManager& manager)
+    : _manager(manager)
+    , _state(State::Pending)
+    , _remaining(0)
+    , _aborting(false)
+    , _irreversible(false)
+{
+}
+
+
+Transaction::~Transaction() noexcept
+{
+}
+
+
+void Transaction::install(const std::string& id, const InstallOptions& options)
+{
+    if (_state != State::Pending)
+        throw std::runtime_error("Transaction has already been committed");
+
+    Operation op;
+    op.id = id;
+    op.options = options;
+    _operations.push_back(std::move(op));
+}
+
+
+void Transaction::update(const std::string& id, const InstallOptions& options)
+{
+    install(id, options);
+    _operations.back().update = true;
+}
+
+
+void Transaction::uninstall(const std::string& id)
+{
+    if (_state != State::Pending)
+        throw std::runtime_error("Transaction has already been committed");
+
+    _uninstalls.push_back(id);
+}
+
+
+void Transaction::commit()
+{
+    if (_state != State::Pending)
+        throw std::runtime_error("Transaction has already been committed");
+
+    SInfo << "Commit transaction: Installs=" << _operations.size()
+          << ", Uninstalls=" << _uninstalls.size() << endl;
+
+    _self = shared_from_this();
+    _state = State::Staging;
+
+    // Create every task before starting any, so that a package which
+    // cannot be installed aborts the transaction before anything changed.
+    std::string error;
+    try {
+        for (const auto& id : _uninstalls) {
+            if (!_manager.localPackages().contains(id))
+                throw std::runtime_error("Package not installed: " + id);
+        }
+
+        for (auto& op : _operations) {
+            if (auto* local = _manager.localPackages().get(op.id)) {
+                std::lock_guard<std::recursive_mutex> guard(local->mutex());
+                op.backup = local->toJson();
+                op.existed = true;
+                if (local->isInstalled() && local->isVersioned())
+                    op.previousVersion = local->version();
+            }
+
+            op.task = op.update ? _manager.updatePackage(op.id, op.options)
+                                : _manager.installPackage(op.id, op.options);
+            if (!op.task) {
+                // Nothing to do only if the package is already installed
+                // as requested; a missing asset aborts the transaction.
+                auto* local = _manager.localPackages().get(op.id);
+                if (!local || !local->isInstalled() ||
+                    (!op.options.version.empty() && local->version() != op.options.version))
+                    throw std::runtime_error("No installable asset for " + op.id);
+                continue; // already up-to-date
+            }
+
+            // Staged tasks are held in Finalizing until every package
+            // is staged.
+            op.task->setHoldFinalize(true);
+            op.task->StateChange += slot(this, &Transaction::onTaskStateChange);
+            op.task->Complete += slot(this, &Transaction::onTaskComplete);
+            _remaining++;
+        }
+    } catch (std::exception& exc) {
+        error = exc.what();
+    }
+
+    if (!error.empty()) {
+        abort(error);
+        return;
+    }
+
+    if (_remaining == 0) {
+        commitStaged();
+        return;
+    }
+
+    // Tasks are started through the scheduler like any other. A task
+    // which cannot start completes as failed, which aborts.
+    for (auto& op : _operations) {
+        if (!op.task)
+            continue;
+        op.scheduled = true;
+        _manager.scheduleTask(op.task);
+        if (_aborting)
+            return;
+    }
+}
+
+
+void Transaction::rollback()
+{
+    if (_state == State::Pending) {
+        _self = shared_from_this();
+        finish(State::RolledBack);
+    } else if (_state == State::Staging && !_aborting) {
+        abort("Transaction rolled back");
+    }
+}
+
+
+Transaction::State Transaction::state() const
+{
+    return _state;
+}
+
+
+bool Transaction::complete() const
+{
+    return _state == State::Committed || _state == State::RolledBack ||
+           _state == State::Failed;
+}
+
+
+bool Transaction::success() const
+{
+    return _state == State::Committed;
+}
+
+
+const StringVec& Transaction::errors() const
+{
+    return _errors;
+}
+
+
+void Transaction::onTaskStateChange(void* sender, InstallationState& state,
+                                    const InstallationState&)
+{
+    if (_state != State::Staging || _aborting ||
+        state.id() != InstallationState::Finalizing)
+        return;
+
+    // The task is now held with its files extracted. It keeps its
+    // slot, but no longer counts against the limit, so the remaining
+    // packages of the transaction can be staged.
+    auto op = find(*reinterpret_cast<InstallTask*>(sender));
+    if (op)
+        op->staged = true;
+
+    for (const auto& other : _operations) {
+        if (other.task && !other.staged) {
+            runOnLoop(loop(), [self = shared_from_this()]() {
+                self->_manager.startScheduledTasks();
+            });
+            return;
+        }
+    }
+    commitStaged();
+}
+
+
+void Transaction::onTaskComplete(InstallTask& task)
+{
+    task.StateChange -= slot(this, &Transaction::onTaskStateChange);
+    task.Complete -= slot(this, &Transaction::onTaskComplete);
+
+    // Held tasks cannot complete while staging, so this is a failure
+    if (_state == State::Staging && !_aborting)
+        abort("Cannot stage " + task.local()->id() + ": " + task.local()->lastError());
+    else if (_state == State::Committing && !task.success()) {
+        _errors.push_back("Cannot finalize " + task.local()->id() + ": " +
+                          task.local()->lastError());
+
+        // A versioned finalization publishes with a single rename, but
+        // a flat one may have replaced some of the previous files.
+        auto op = find(task);
+        if (op && !task.local()->isVersioned()) {
+            op->partial = true;
+            _irreversible = true;
+        }
+    }
+
+    // Continue once the manager has released the task, which happens
+    // after this signal.
+    if (--_remaining == 0)
+        runOnLoop(task.loop(), [self = shared_from_this()]() { self->tasksComplete(); });
+}
+
+
+void Transaction::commitStaged()
+{
+    PacmDebug << "All packages staged, committing" << endl;
+
+    _state = State::Committing;
+    for (auto& op : _operations) {
+        if (op.task)
+            op.task->setHoldFinalize(false);
+    }
+
+    if (_remaining == 0)
+        tasksComplete();
+}
+
+
+void Transaction::abort(const std::string& error)
+{
+    SError << "Transaction aborted: " << error << endl;
+    _errors.push_back(error);
+    _aborting = true;
+
+    // Tasks which were never scheduled are started cancelled, so that
+    // they complete and are released by the manager like any other.
+    // Queued ones complete once the scheduler starts them.
+    for (auto& op : _operations) {
+        if (!op.task || op.task->complete())
+            continue;
+        op.task->cancel();
+        if (!op.scheduled) {
+            try {
+                op.scheduled = true;
+                op.task->start();
+            } catch (std::exception& exc) {
+                SError << "Cannot release task: " << exc.what() << endl;
+            }
+        }
+    }
+
+    if (_remaining == 0)
+        runOnLoop(loop(), [self = shared_from_this()]() { self->tasksComplete(); });
+}
+
+
+void Transaction::tasksComplete()
+{
+    if (_aborting) {
+        restorePackages();
+        finish(State::RolledBack);
+        return;
+    }
+
+    if (!_errors.empty()) {
+        revertCommitted();
+        restorePackages();
+        finish(_irreversible ? State::Failed : State::RolledBack);
+        return;
+    }
+
+    // Uninstalls cannot be undone, so they are applied last
+    if (!_uninstalls.empty()) {
+        _manager.uninstallPackagesAsync(_uninstalls, loop(),
+                                        [self = shared_from_this()](const UninstallResult& result) {
+                                            self->onUninstallComplete(result);
+                                        });
+        return;
+    }
+
+    finish(State::Committed);
+}
+
+
+void Transaction::onUninstallComplete(const UninstallResult& result)
+{
+    for (const auto& error : result.errors)
+        _errors.push_back(error);
+    finish(State::Committed);
+}
+
+
+void Transaction::restorePackages()
+{
+    for (auto& op : _operations) {
+        if (!op.task || op.task->success())
+            continue;
+
+        // Remove the extracted files which were never finalized
+        std::error_code ec;
+        std::filesystem::remove_all(_manager.getPackageDataDir(op.id), ec);
+
+        auto* local = _manager.localPackages().get(op.id);
+        if (!local)
+            continue;
+
+        // The previous files are no longer intact, so the package is
+        // left failed rather than restored to a version which is gone.
+        if (op.partial) {
+            _manager.publishPackage(op.id);
+            continue;
+        }
+
+        if (op.existed) {
+            {
+                std::lock_guard<std::recursive_mutex> guard(local->mutex());
+                static_cast<json::Value&>(*local) = op.backup;
+            }
+            _manager.saveLocalPackage(*local);
+        } else {
+            // The package record was created by this transaction
+            std::string path(fs::makePath(_manager.options().dataDir, op.id + ".json"));
+            std::filesystem::remove(path, ec);
+            _manager.localPackages().erase(op.id);
+        }
+        _manager.publishPackage(op.id);
+    }
+}
+
+
+void Transaction::revertCommitted()
+{
+    for (auto& op : _operations) {
+        if (!op.task || !op.task->success())
+            continue;
+
+        SInfo << "Reverting package: " << op.id << endl;
+        if (!op.previousVersion.empty()) {
+            // The previous version is still retained on disk
+            if (!_manager.rollbackPackage(op.id, op.previousVersion)) {
+                _errors.push_back("Cannot roll back " + op.id + " to " + op.previousVersion);
+                _irreversible = true;
+            }
+        } else if (!op.existed || op.backup.value("state", "") != "Installed") {
+            // Nothing usable was installed before
+            if (!_manager.uninstallPackage(op.id)) {
+                _errors.push_back("Cannot remove " + op.id);
+                _irreversible = true;
+            }
+        } else {
+            _errors.push_back("Cannot roll back " + op.id +
+                              ": flat installs overwrite the previous files");
+            _irreversible = true;
+        }
+    }
+}
+
+
+void Transaction::finish(State state)
+{
+    // Keep alive until the signal has been emitted
+    auto self = std::move(_self);
+
+    _state = state;
+    SInfo << "Transaction "
+          << (state == State::Committed    ? "committed"
+              : state == State::RolledBack ? "rolled back"
+                                           : "failed")
+          << ": Errors=" << _errors.size() << endl;
+    Complete.emit(*this);
+}
+
+
+Transaction::Operation* Transaction::find(const InstallTask& task)
+{
+    for (auto& op : _operations) {
+        if (op.task.get() == &task)
+            return &op;
+    }
+    return nullptr;
+}
+
+
+uv::Loop* Transaction::loop() const
+{
+    // Tasks are created on the manager's loop; without any, that is
+    // the default loop.
+    for (const auto& op : _operations) {
+        if (op.task)
+            return op.task->loop();
+    }
+    return uv::defaultLoop();
+}
+
+
+} // namespace pacm
+} // namespace icy
+
+
+/// @}
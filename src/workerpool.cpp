@@ -0,0 +1,211 @@
+///
+//
+// icey
+// Copyright (c) 2005, icey <https://0state.com>
+//
+// SPDX-License-Identifier: LGPL-2.1+
+//
+/// @addtogroup pacm
+/// @{
+
+
+#include "icy/pacm/workerpool.h"
+#include "icy/logger.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <iterator>
+#include <memory>
+
+
+using namespace std;
+
+
+namespace icy {
+namespace pacm {
+
+
+namespace {
+
+/// Priority of the job running on this thread
+thread_local int jobPriority = 0;
+
+} // namespace
+
+
+WorkerPool::WorkerPool(unsigned threads)
+    : _stopping(false)
+{
+    if (threads == 0)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    _threads.reserve(threads);
+    for (unsigned i = 0; i < threads; i++)
+        _threads.emplace_back(&WorkerPool::work, this);
+}
+
+
+WorkerPool::~WorkerPool() noexcept
+{
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        _stopping = true;
+    }
+    _cond.notify_all();
+    for (auto& thread : _threads)
+        thread.join();
+}
+
+
+void WorkerPool::post(std::function<void()> job, int priority)
+{
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        // Insert after the last job of the same or a higher priority
+        auto it = _jobs.end();
+        while (it != _jobs.begin() && std::prev(it)->priority < priority)
+            --it;
+        _jobs.insert(it, Job{std::move(job), priority});
+    }
+    _cond.notify_one();
+}
+
+
+void WorkerPool::parallelFor(size_t count, const std::function<void(size_t)>& fn)
+{
+    parallelFor(count, fn, currentPriority());
+}
+
+
+void WorkerPool::parallelFor(size_t count, const std::function<void(size_t)>& fn, int priority)
+{
+    if (count == 0)
+        return;
+
+    // Shared with helper jobs which may only get to run after the
+    // calling thread has already finished every index.
+    struct State
+    {
+        std::atomic<size_t> next{0};
+        size_t done = 0;
+        size_t count = 0;
+        const std::function<void(size_t)>* fn = nullptr;
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable cond;
+
+        void drain()
+        {
+            size_t index;
+            while ((index = next.fetch_add(1)) < count) {
+                std::exception_ptr exc;
+                try {
+                    (*fn)(index);
+                } catch (...) {
+                    exc = std::current_exception();
+                }
+
+                std::lock_guard<std::mutex> guard(mutex);
+                if (exc && !error)
+                    error = exc;
+                if (++done == count)
+                    cond.notify_all();
+            }
+        }
+    };
+
+    auto state = std::make_shared<State>();
+    state->count = count;
+    state->fn = &fn;
+
+    size_t helpers = std::min<size_t>(_threads.size(), count - 1);
+    for (size_t i = 0; i < helpers; i++)
+        post([state]() { state->drain(); }, priority);
+
+    state->drain();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->cond.wait(lock, [&]() { return state->done == state->count; });
+    if (state->error)
+        std::rethrow_exception(state->error);
+}
+
+
+void WorkerPool::submit(uv::Loop* loop, std::function<void()> work,
+                        std::function<void(std::exception_ptr)> done, int priority)
+{
+    // The async handle is the only libuv call which may be made from
+    // another thread, so it carries the result back to the loop.
+    struct Job
+    {
+        uv_async_t async;
+        std::function<void()> work;
+        std::function<void(std::exception_ptr)> done;
+        std::exception_ptr error;
+    };
+
+    auto job = new Job;
+    job->work = std::move(work);
+    job->done = std::move(done);
+    job->async.data = job;
+    uv_async_init(loop, &job->async, [](uv_async_t* handle) {
+        auto job = static_cast<Job*>(handle->data);
+        job->done(job->error);
+        uv_close(reinterpret_cast<uv_handle_t*>(handle), [](uv_handle_t* handle) {
+            delete static_cast<Job*>(handle->data);
+        });
+    });
+
+    post([job]() {
+        try {
+            job->work();
+        } catch (...) {
+            job->error = std::current_exception();
+        }
+        uv_async_send(&job->async);
+    }, priority);
+}
+
+
+unsigned WorkerPool::size() const
+{
+    return static_cast<unsigned>(_threads.size());
+}
+
+
+int WorkerPool::currentPriority()
+{
+    return jobPriority;
+}
+
+
+void WorkerPool::work()
+{
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cond.wait(lock, [this]() { return _stopping || !_jobs.empty(); });
+            if (_jobs.empty())
+                return; // stopping and drained
+            job = std::move(_jobs.front().fn);
+            jobPriority = _jobs.front().priority;
+            _jobs.pop_front();
+        }
+
+        try {
+            job();
+        } catch (std::exception& exc) {
+            SError << "Worker job failed: " << exc.what() << endl;
+        }
+        jobPriority = 0;
+    }
+}
+
+
+} // namespace pacm
+} // namespace icy
+
+
+/// @}
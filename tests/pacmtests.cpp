@@ -9,12 +9,24 @@
 /// @{
 
 
+#include "icy/pacm/checksum.h"
+#include "icy/pacm/fileops.h"
 #include "icy/pacm/package.h"
 #include "icy/pacm/installtask.h"
+#include "icy/pacm/metrics.h"
+#include "icy/pacm/packagemanager.h"
+#include "icy/pacm/tracer.h"
+#include "icy/pacm/transaction.h"
 #include "icy/json/json.h"
 #include "icy/logger.h"
 #include "icy/test.h"
 
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <map>
+#include <thread>
+
 
 using namespace std;
 using namespace icy;
@@ -90,6 +102,51 @@ static const char* WORKER_PACKAGE_JSON = R"({
 })";
 
 
+static pacm::Async<int> addLater(int a, int b)
+{
+    co_return a + b;
+}
+
+
+static pacm::Async<int> sumTwice(int a, int b)
+{
+    int first = co_await addLater(a, b);
+    int second = co_await addLater(first, first);
+    co_return second;
+}
+
+
+static pacm::Async<> failLater()
+{
+    throw std::runtime_error("coroutine error");
+    co_return;
+}
+
+
+static pacm::Async<pacm::UninstallResult> uninstallLater(pacm::PackageManager& manager,
+                                                          const StringVec& ids, uv::Loop* loop)
+{
+    co_return co_await manager.uninstall(ids, loop);
+}
+
+
+static pacm::Async<pacm::InstallTask::Ptr> installLater(pacm::PackageManager& manager,
+                                                       const std::string& id,
+                                                       pacm::InstallOptions options = {})
+{
+    co_return co_await manager.install(id, options);
+}
+
+
+/// Exposes the cancellation internals of an install task.
+struct CancelProbe : public pacm::InstallTask
+{
+    using pacm::InstallTask::InstallTask;
+    using pacm::InstallTask::addPartialPath;
+    using pacm::InstallTask::checkCancelled;
+};
+
+
 int main(int argc, char** argv)
 {
     // Logger::instance().add(std::make_unique<ConsoleChannel>("debug", Level::Trace));
@@ -145,6 +202,11 @@ int main(int argc, char** argv)
         expect(asset.fileSize() == 1024);
         expect(asset.url() == "https://example.com/test-1.0.0.zip");
         expect(asset.valid());
+
+        // Sizes above 2 GiB do not overflow
+        j["assets"][0]["file-size"] = std::uint64_t(5) << 30;
+        pacm::RemotePackage large(j);
+        expect(large.assetVersion("1.0.0").fileSize() == std::uint64_t(5) << 30);
     });
 
     // =========================================================================
@@ -380,6 +442,1215 @@ int main(int argc, char** argv)
         expect(local.errors().empty());
     });
 
+    // =========================================================================
+    // Versioned Install Layout
+    //
+    describe("versioned install layout", []() {
+        json::Value j = json::Value::parse(REMOTE_PACKAGE_JSON);
+        pacm::RemotePackage remote(j);
+        pacm::LocalPackage local(remote);
+
+        expect(!local.isVersioned());
+        bool threw = false;
+        try {
+            local.getVersionDir("1.0.0");
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        expect(threw);
+
+        auto root = std::filesystem::temp_directory_path() / "pacm-versioned-test";
+        std::filesystem::remove_all(root);
+        auto packageRoot = (root / "test-plugin").string();
+        local.setInstallRoot(packageRoot);
+        local.setInstallDir((root / "test-plugin" / "current").string());
+        expect(local.isVersioned());
+        expect(local.getVersionDir("1.0.0") == (root / "test-plugin" / "1.0.0").string());
+
+        threw = false;
+        try {
+            local.getVersionDir("../escape");
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        expect(threw);
+
+        local.setPendingVersion("1.1.0");
+        expect(local.pendingVersion() == "1.1.0");
+        local.setPendingVersion("");
+        expect(local.pendingVersion() == "");
+
+        // Swap the current link between two version directories
+        for (const auto& version : {"1.0.0", "1.1.0"}) {
+            std::filesystem::create_directories(local.getVersionDir(version));
+            std::ofstream(local.getVersionDir(version) + "/VERSION") << version;
+        }
+
+        pacm::PackageManager manager(pacm::PackageManager::Options(root.string()));
+        manager.activatePackageVersion(local, "1.0.0");
+        std::string content;
+        std::ifstream(local.getInstalledFilePath("VERSION")) >> content;
+        expect(content == "1.0.0");
+
+        manager.activatePackageVersion(local, "1.1.0");
+        std::ifstream(local.getInstalledFilePath("VERSION")) >> content;
+        expect(content == "1.1.0");
+        expect(std::filesystem::read_symlink(local.installDir()) == "1.1.0");
+
+        threw = false;
+        try {
+            manager.activatePackageVersion(local, "9.9.9");
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        expect(threw);
+
+        std::filesystem::remove_all(root);
+    });
+
+    // =========================================================================
+    // Retained Versions and Rollback
+    //
+    describe("retained versions and rollback", []() {
+        json::Value j = json::Value::parse(REMOTE_PACKAGE_JSON);
+        pacm::RemotePackage remote(j);
+
+        auto root = std::filesystem::temp_directory_path() / "pacm-rollback-test";
+        std::filesystem::remove_all(root);
+
+        pacm::PackageManager::Options options(root.string());
+        options.versionedInstalls = true;
+        options.retainedVersions = 2;
+        pacm::PackageManager manager(options);
+        manager.createDirectories();
+
+        auto pkg = std::make_unique<pacm::LocalPackage>(remote);
+        auto* local = pkg.get();
+        manager.localPackages().tryAdd(local->id(), std::move(pkg));
+        local->setInstallRoot((root / "install" / "test-plugin").string());
+        local->setInstallDir((root / "install" / "test-plugin" / "current").string());
+        local->setState("Installed");
+
+        // Simulate three successive installs
+        for (const auto& version : {"1.0.0", "1.1.0", "2.0.0"}) {
+            std::filesystem::create_directories(local->getVersionDir(version));
+            std::ofstream(local->getVersionDir(version) + "/VERSION") << version;
+            manager.activatePackageVersion(*local, version);
+            local->manifest().root = json::Value::array({"VERSION"});
+            local->setInstalledAsset(remote.assetVersion(version));
+            manager.retainPackageVersion(*local);
+        }
+
+        // Only the two most recent versions are kept on disk
+        expect(local->retainedVersions().size() == 2);
+        expect(!std::filesystem::exists(local->getVersionDir("1.0.0")));
+        expect(std::filesystem::exists(local->getVersionDir("1.1.0")));
+
+        // Roll back to the previous version without any download
+        expect(manager.rollbackPackage("test-plugin"));
+        expect(local->version() == "1.1.0");
+        expect(local->asset().fileName() == "test-1.1.0.zip");
+        expect(local->verifyInstallManifest());
+        std::string content;
+        std::ifstream(local->getInstalledFilePath("VERSION")) >> content;
+        expect(content == "1.1.0");
+
+        // Versions which are no longer retained cannot be restored
+        expect(!manager.rollbackPackage("test-plugin", "1.0.0"));
+        expect(local->version() == "1.1.0");
+
+        // Even when its files are still on disk, the link is not swapped
+        std::filesystem::create_directories(local->getVersionDir("1.0.0"));
+        expect(!manager.rollbackPackage("test-plugin", "1.0.0"));
+        expect(std::filesystem::read_symlink(local->installDir()) == "1.1.0");
+
+        std::filesystem::remove_all(root);
+    });
+
+    // =========================================================================
+    // Manifest Verification
+    //
+    describe("manifest verification", []() {
+        json::Value j = json::Value::parse(REMOTE_PACKAGE_JSON);
+        pacm::RemotePackage remote(j);
+        pacm::LocalPackage local(remote);
+
+        auto root = std::filesystem::temp_directory_path() / "pacm-verify-test";
+        std::filesystem::remove_all(root);
+        std::filesystem::create_directories(root / "lib" / "plugins");
+        std::ofstream(root / "lib" / "test-plugin.so") << "so";
+        std::ofstream(root / "lib" / "plugins" / "a.so") << "a";
+        std::ofstream(root / "lib" / "plugins" / "b.so") << "b";
+        std::ofstream(root / "README") << "readme";
+
+        // Back date the directories so the result may be cached
+        auto settle = [&]() {
+            auto old = std::filesystem::file_time_type::clock::now() - std::chrono::hours(1);
+            for (auto dir : {root, root / "lib", root / "lib" / "plugins"})
+                std::filesystem::last_write_time(dir, old);
+        };
+        settle();
+
+        local.setInstallDir(root.string());
+        local.manifest().root = json::Value::array(
+            {"README", "lib/", "lib/test-plugin.so", "lib/plugins/", "lib/plugins/a.so",
+             "lib/plugins/b.so"});
+        expect(local.verifyInstallManifest());
+        expect(local.verifyInstallManifest()); // cached
+        {
+            pacm::WorkerPool pool(2);
+            expect(local.verifyInstallManifest(false, &pool));
+        }
+
+        // Removing a file changes its directory, invalidating the cache
+        std::filesystem::remove(root / "lib" / "plugins" / "b.so");
+        expect(!local.verifyInstallManifest());
+        std::ofstream(root / "lib" / "plugins" / "b.so") << "b";
+        settle();
+        expect(local.verifyInstallManifest());
+
+        std::filesystem::remove_all(root / "lib");
+        expect(!local.verifyInstallManifest());
+
+        // A changed manifest is verified again
+        local.manifest().root = json::Value::array({"README"});
+        expect(local.verifyInstallManifest());
+        local.manifest().root = json::Value::array();
+        expect(!local.verifyInstallManifest());
+        expect(local.verifyInstallManifest(true));
+
+        std::filesystem::remove_all(root);
+    });
+
+    // =========================================================================
+    // Finalize Move Engine
+    //
+    describe("finalize move engine", []() {
+        auto root = std::filesystem::temp_directory_path() / "pacm-move-test";
+        std::filesystem::remove_all(root);
+        auto source = root / "source";
+        auto target = root / "target";
+
+        std::filesystem::create_directories(source / "lib" / "nested");
+        std::filesystem::create_directories(source / "share");
+        std::ofstream(source / "lib" / "plugin.so") << "new";
+        std::ofstream(source / "lib" / "nested" / "data.bin") << "data";
+        std::ofstream(source / "share" / "readme.txt") << "readme";
+
+        // Existing files are replaced and existing directories merged
+        std::filesystem::create_directories(target / "lib");
+        std::ofstream(target / "lib" / "plugin.so") << "old";
+        std::ofstream(target / "lib" / "keep.txt") << "keep";
+
+        pacm::WorkerPool pool(2);
+        pacm::Tracer tracer;
+        auto results = pacm::moveTree(source.string(), target.string(), &pool, &tracer);
+        bool allMoved = !results.empty();
+        for (const auto& result : results)
+            allMoved = allMoved && result.ok();
+        expect(allMoved);
+        expect(tracer.size() == results.size()); // one span per entry
+
+        std::string content;
+        std::ifstream(target / "lib" / "plugin.so") >> content;
+        expect(content == "new");
+        expect(std::filesystem::exists(target / "lib" / "keep.txt"));
+        expect(std::filesystem::exists(target / "lib" / "nested" / "data.bin"));
+        expect(std::filesystem::exists(target / "share" / "readme.txt"));
+        expect(!std::filesystem::exists(source / "lib" / "plugin.so"));
+
+        // A file in the way of a directory is reported, not thrown
+        std::filesystem::create_directories(source / "conflict");
+        std::ofstream(source / "conflict" / "file") << "x";
+        std::ofstream(target / "conflict") << "file";
+        results = pacm::moveTree(source.string(), target.string());
+        expect(results.size() == 1);
+        expect(results[0].outcome == pacm::FileResult::Failed);
+
+        // So is a source tree which cannot be walked
+        results = pacm::moveTree((root / "missing").string(), target.string());
+        expect(results.size() == 1);
+        expect(!results[0].ok());
+        results = pacm::linkTree((root / "missing").string(), target.string(), true);
+        expect(results.size() == 1);
+        expect(!results[0].ok());
+
+        std::filesystem::remove_all(root);
+    });
+
+    // =========================================================================
+    // Worker Pool Priority
+    //
+    describe("worker pool priority", []() {
+        std::vector<int> order;
+        {
+            pacm::WorkerPool pool(1);
+
+            // Hold the only worker while the other jobs are queued
+            std::promise<void> release;
+            std::shared_future<void> released = release.get_future().share();
+            pool.post([released]() { released.wait(); });
+
+            auto record = [&order](int n) { return [&order, n]() { order.push_back(n); }; };
+            pool.post(record(1));
+            pool.post(record(2), 10);
+            pool.post(record(3));
+            pool.post(record(4), 10);
+            pool.post(record(5), -1);
+            release.set_value();
+        } // the destructor finishes every queued job
+
+        expect((order == std::vector<int>{2, 4, 1, 3, 5}));
+    });
+
+    // =========================================================================
+    // Tree Checksum
+    //
+    describe("tree checksum", []() {
+        auto path = std::filesystem::temp_directory_path() / "pacm-tree-checksum.bin";
+        std::string data(9 * 1024 * 1024 + 3, '\0');
+        for (size_t i = 0; i < data.size(); i++)
+            data[i] = static_cast<char>((i * 7) % 251);
+        {
+            std::ofstream file(path, std::ios::binary);
+            file.write(data.data(), data.size());
+        }
+
+        // Three chunks, the last one short
+        const std::string expected = "97261f76681b2c877d2bdb11f90b03514c5a32ba831999eafa27a74591605981";
+        expect(pacm::treeChecksum(data.data(), data.size()) == expected);
+        expect(pacm::checksumFile(TREE_CHECKSUM_ALGORITHM, path.string()) == expected);
+        {
+            pacm::WorkerPool pool(2);
+            expect(pacm::checksumFile(TREE_CHECKSUM_ALGORITHM, path.string(), &pool) == expected);
+        }
+        expect(pacm::treeChecksum(nullptr, 0) ==
+               "af5570f5a1810b7af78caf4bc70a660f0df51e42baf91d4de5b2328de0e83dfc");
+
+        // A throwing checkpoint aborts the digest
+        bool aborted = false;
+        try {
+            pacm::checksumFile(TREE_CHECKSUM_ALGORITHM, path.string(), nullptr,
+                               []() { throw std::runtime_error("cancelled"); });
+        } catch (std::runtime_error&) {
+            aborted = true;
+        }
+        expect(aborted);
+        std::filesystem::remove(path);
+    });
+
+    // =========================================================================
+    // Checksum Cache
+    //
+    describe("checksum cache", []() {
+        auto dir = std::filesystem::temp_directory_path() / "pacm-checksum-cache-test";
+        std::filesystem::remove_all(dir);
+        std::filesystem::create_directories(dir);
+        auto file = (dir / "archive.zip").string();
+        auto cacheFile = (dir / "checksums.cache").string();
+        auto write = [&](const std::string& data) {
+            std::ofstream(file, std::ios::binary | std::ios::trunc) << data;
+            // Back date the file so it is not considered racy
+            std::filesystem::last_write_time(
+                file, std::filesystem::file_time_type::clock::now() - std::chrono::hours(1));
+        };
+
+        write("first contents");
+        std::string digest = pacm::checksumFile("SHA256", file);
+        {
+            pacm::ChecksumCache cache(cacheFile);
+            expect(cache.checksum("SHA256", file) == digest);
+            expect(cache.misses() == 1);
+            expect(cache.checksum("SHA256", file) == digest);
+            expect(cache.hits() == 1);
+            expect(cache.lookup("SHA1", file).empty());
+            cache.save();
+        }
+
+        // Digests persist across instances
+        {
+            pacm::ChecksumCache cache(cacheFile);
+            expect(cache.lookup("SHA256", file) == digest);
+        }
+
+        // Rewriting the file with the same size and modification time
+        // still changes its identity
+        auto mtime = std::filesystem::last_write_time(file);
+        std::ofstream(file, std::ios::binary | std::ios::trunc) << "other contents";
+        std::filesystem::last_write_time(file, mtime);
+        {
+            pacm::ChecksumCache cache(cacheFile);
+            expect(cache.size() == 0);
+            expect(cache.checksum("SHA256", file) == pacm::checksumFile("SHA256", file));
+            expect(cache.checksum("SHA256", file) != digest);
+        }
+
+        // Recently modified files are hashed but not remembered
+        std::ofstream(file, std::ios::binary | std::ios::trunc) << "fresh";
+        {
+            pacm::ChecksumCache cache;
+            cache.checksum("SHA256", file);
+            expect(cache.size() == 0);
+        }
+        std::filesystem::remove_all(dir);
+    });
+
+    // =========================================================================
+    // Content Store Materialization
+    //
+    describe("content store materialization", []() {
+        auto root = std::filesystem::temp_directory_path() / "pacm-store-test";
+        std::filesystem::remove_all(root);
+
+        pacm::PackageManager::Options options(root.string());
+        options.contentStore = true;
+        options.storeHardlinks = true;
+        pacm::PackageManager manager(options);
+        manager.createDirectories();
+
+        std::string storeDir = manager.getPackageStoreDir("test-plugin", "1.0.0");
+        expect(!manager.hasStoredPackage("test-plugin", "1.0.0"));
+        std::filesystem::create_directories(storeDir + "/lib");
+        std::ofstream(storeDir + "/lib/plugin.so") << "stored";
+        json::saveFile(storeDir + ".json", json::Value::array({"lib/", "lib/plugin.so"}));
+        expect(manager.hasStoredPackage("test-plugin", "1.0.0"));
+
+        // Materialize twice, as two install directories sharing the store.
+        // Files are reflinked where the filesystem supports it, and
+        // otherwise hardlinked or copied, so only the content is fixed.
+        size_t hardlinks = 0;
+        for (const auto& dir : {"a", "b"}) {
+            auto target = (root / "install" / dir).string();
+            auto results = pacm::linkTree(storeDir, target, true);
+            expect(results.size() == 1);
+            expect(results[0].ok());
+            std::string content;
+            std::ifstream(target + "/lib/plugin.so") >> content;
+            expect(content == "stored");
+            if (std::filesystem::equivalent(storeDir + "/lib/plugin.so", target + "/lib/plugin.so"))
+                hardlinks++;
+        }
+        expect(std::filesystem::hard_link_count(storeDir + "/lib/plugin.so") == 1 + hardlinks);
+        expect(std::filesystem::exists(storeDir + "/lib/plugin.so"));
+
+        manager.clearContentStore("test-plugin");
+        expect(!manager.hasStoredPackage("test-plugin", "1.0.0"));
+
+        std::filesystem::remove_all(root);
+    });
+
+    // =========================================================================
+    // Versioned Reinstall
+    //
+    describe("versioned reinstall", []() {
+        json::Value j = json::Value::parse(REMOTE_PACKAGE_JSON);
+        pacm::RemotePackage remote(j);
+
+        auto root = std::filesystem::temp_directory_path() / "pacm-reinstall-test";
+        std::filesystem::remove_all(root);
+
+        pacm::PackageManager::Options options(root.string());
+        options.contentStore = true;
+        options.versionedInstalls = true;
+        pacm::PackageManager manager(options);
+        manager.createDirectories();
+        manager.remotePackages().tryAdd("test-plugin", std::make_unique<pacm::RemotePackage>(j));
+
+        std::string storeDir = manager.getPackageStoreDir("test-plugin", "2.0.0");
+        std::filesystem::create_directories(storeDir);
+        std::ofstream(storeDir + "/plugin.so") << "new";
+        json::saveFile(storeDir + ".json", json::Value::array({"plugin.so"}));
+
+        // The active version is damaged, so it is installed again
+        auto pkg = std::make_unique<pacm::LocalPackage>(remote);
+        auto* local = pkg.get();
+        manager.localPackages().tryAdd(local->id(), std::move(pkg));
+        local->setInstallRoot((root / "install" / "test-plugin").string());
+        local->setInstallDir((root / "install" / "test-plugin" / "current").string());
+        local->setState("Installed");
+        std::filesystem::create_directories(local->getVersionDir("2.0.0"));
+        std::ofstream(local->getVersionDir("2.0.0") + "/plugin.so") << "old";
+        manager.activatePackageVersion(*local, "2.0.0");
+        local->setInstalledAsset(remote.assetVersion("2.0.0"));
+        local->manifest().root = json::Value::array({"plugin.so", "missing.so"});
+
+        expect(manager.installPackages({"test-plugin"}));
+        expect(manager.tasks().size() == 1);
+        uv_run(uv::defaultLoop(), UV_RUN_DEFAULT);
+        expect(manager.tasks().empty());
+        expect(local->isInstalled());
+        expect(std::filesystem::read_symlink(local->installDir()) == "2.0.0");
+        expect(!std::filesystem::exists(local->getVersionDir("2.0.0") + ".partial"));
+        std::string content;
+        std::ifstream(local->getInstalledFilePath("plugin.so")) >> content;
+        expect(content == "new");
+
+        std::filesystem::remove_all(root);
+    });
+
+    // =========================================================================
+    // Batched Uninstall
+    //
+    describe("batched uninstall", []() {
+        json::Value j = json::Value::parse(REMOTE_PACKAGE_JSON);
+        pacm::RemotePackage remote(j);
+
+        auto root = std::filesystem::temp_directory_path() / "pacm-uninstall-test";
+        std::filesystem::remove_all(root);
+        pacm::PackageManager manager(pacm::PackageManager::Options(root.string()));
+        manager.createDirectories();
+
+        auto installDir = root / "pacm" / "install";
+        auto pkg = std::make_unique<pacm::LocalPackage>(remote);
+        pkg->setInstallDir(installDir.string());
+        pkg->setState("Installed");
+        for (const auto& file : {"lib/", "lib/nested/", "lib/nested/plugin.so", "lib/data.bin"}) {
+            auto path = installDir / file;
+            if (path.filename().empty())
+                std::filesystem::create_directories(path);
+            else
+                std::ofstream(path) << "x";
+            pkg->manifest().addFile(file);
+        }
+        std::ofstream(installDir / "other.txt") << "owned by someone else";
+        manager.saveLocalPackage(*pkg);
+        manager.localPackages().tryAdd(pkg->id(), std::move(pkg));
+
+        pacm::UninstallResult result;
+        manager.UninstallComplete += [&](const pacm::UninstallResult& r) { result = r; };
+
+        expect(!manager.uninstallPackages({"test-plugin", "missing-package"}));
+        expect(!manager.localPackages().contains("test-plugin"));
+        expect(!std::filesystem::exists(installDir / "lib"));
+        expect(std::filesystem::exists(installDir / "other.txt"));
+        expect(result.packages.size() == 1);
+        expect(result.failed.size() == 1);
+        expect(result.filesRemoved == 2);
+        expect(result.dirsRemoved == 2);
+
+        // Each async batch reports to its own callback, and a package
+        // cannot join a second batch while the first is pending
+        std::filesystem::create_directories(installDir / "lib");
+        std::ofstream(installDir / "lib" / "plugin.so") << "x";
+        pkg = std::make_unique<pacm::LocalPackage>(remote);
+        pkg->setInstallDir(installDir.string());
+        pkg->setState("Installed");
+        pkg->manifest().addFile("lib/plugin.so");
+        manager.localPackages().tryAdd(pkg->id(), std::move(pkg));
+
+        uv_loop_t loop;
+        uv_loop_init(&loop);
+        std::vector<pacm::UninstallResult> batches(2);
+        manager.uninstallPackagesAsync({"test-plugin"}, &loop,
+                                       [&](const pacm::UninstallResult& r) { batches[0] = r; });
+        manager.uninstallPackagesAsync({"test-plugin"}, &loop,
+                                       [&](const pacm::UninstallResult& r) { batches[1] = r; });
+        expect(!manager.uninstallPackages({"test-plugin"}));
+        uv_run(&loop, UV_RUN_DEFAULT);
+        uv_loop_close(&loop);
+        expect(batches[0].packages == StringVec({"test-plugin"}));
+        expect(batches[1].failed == StringVec({"test-plugin"}));
+        expect(!manager.localPackages().contains("test-plugin"));
+
+        std::filesystem::remove_all(root);
+    });
+
+    // =========================================================================
+    // Dependency Resolution
+    //
+    describe("dependency resolution", []() {
+        auto makePackage = [](const std::string& id, json::Value dependencies) {
+            json::Value j = json::Value::parse(REMOTE_PACKAGE_JSON);
+            j["id"] = id;
+            j["name"] = id;
+            j["dependencies"] = dependencies;
+            return std::make_unique<pacm::RemotePackage>(j);
+        };
+
+        // Mixed string and object declarations
+        auto app = makePackage("app", json::Value::parse(R"(["ui", {"id": "codec"}])"));
+        expect(app->dependencies() == StringVec({"ui", "codec"}));
+        expect(makePackage("leaf", json::Value::array())->dependencies().empty());
+
+        auto root = std::filesystem::temp_directory_path() / "pacm-dependency-test";
+        pacm::PackageManager manager(pacm::PackageManager::Options(root.string()));
+        manager.remotePackages().tryAdd("app", std::move(app));
+        manager.remotePackages().tryAdd("ui", makePackage("ui", json::Value::parse(R"(["core"])")));
+        manager.remotePackages().tryAdd("codec", makePackage("codec", json::Value::parse(R"(["core"])")));
+        manager.remotePackages().tryAdd("core", makePackage("core", json::Value::array()));
+
+        // Each package comes after its dependencies, shared ones only once
+        StringVec order = manager.resolveDependencies({"app"});
+        expect(order == StringVec({"core", "ui", "codec", "app"}));
+        expect(manager.resolveDependencies({"codec", "ui"}) == StringVec({"core", "codec", "ui"}));
+
+        // Unknown dependencies and cycles are rejected
+        manager.remotePackages().tryAdd("broken", makePackage("broken", json::Value::parse(R"(["missing"])")));
+        bool threw = false;
+        try {
+            manager.resolveDependencies({"broken"});
+        } catch (std::runtime_error&) {
+            threw = true;
+        }
+        expect(threw);
+
+        manager.remotePackages().tryAdd("loop-a", makePackage("loop-a", json::Value::parse(R"(["loop-b"])")));
+        manager.remotePackages().tryAdd("loop-b", makePackage("loop-b", json::Value::parse(R"(["loop-a"])")));
+        threw = false;
+        try {
+            manager.resolveDependencies({"loop-a"});
+        } catch (std::runtime_error&) {
+            threw = true;
+        }
+        expect(threw);
+    });
+
+    // =========================================================================
+    // Dependency Chain Install
+    //
+    describe("dependency chain install", []() {
+        auto makePackage = [](const std::string& id, json::Value dependencies) {
+            json::Value j = json::Value::parse(REMOTE_PACKAGE_JSON);
+            j["id"] = id;
+            j["name"] = id;
+            j["dependencies"] = dependencies;
+            return std::make_unique<pacm::RemotePackage>(j);
+        };
+
+        auto root = std::filesystem::temp_directory_path() / "pacm-chain-test";
+        std::filesystem::remove_all(root);
+
+        // Both packages come from the content store, so the chain runs
+        // to completion without a download
+        pacm::PackageManager::Options options(root.string());
+        options.contentStore = true;
+        pacm::PackageManager manager(options);
+        manager.createDirectories();
+        manager.remotePackages().tryAdd("core", makePackage("core", json::Value::array()));
+        manager.remotePackages().tryAdd("app", makePackage("app", json::Value::parse(R"(["core"])")));
+        auto store = [&](const std::string& id) {
+            std::string storeDir = manager.getPackageStoreDir(id, "2.0.0");
+            std::filesystem::create_directories(storeDir + "/lib");
+            std::ofstream(storeDir + "/lib/" + id + ".so") << id;
+            json::saveFile(storeDir + ".json", json::Value::array({"lib/", "lib/" + id + ".so"}));
+        };
+        store("core");
+        store("app");
+
+        // The dependency finishes first and releases its dependent, which
+        // must not outlive the completed task's last reference
+        expect(manager.installPackages({"app"}, pacm::InstallOptions(), nullptr, true));
+        expect(manager.tasks().size() == 2);
+        uv_run(uv::defaultLoop(), UV_RUN_DEFAULT);
+        expect(manager.tasks().empty());
+        expect(manager.localPackages().get("core")->isInstalled());
+        expect(manager.localPackages().get("app")->isInstalled());
+
+        // An installed dependency missing from the index is used as it is
+        auto legacy = std::make_unique<pacm::LocalPackage>(*makePackage("legacy", json::Value::array()));
+        legacy->setState("Installed");
+        manager.localPackages().tryAdd("legacy", std::move(legacy));
+        manager.remotePackages().tryAdd("tool", makePackage("tool", json::Value::parse(R"(["legacy"])")));
+        store("tool");
+        expect(manager.installPackages({"tool"}, pacm::InstallOptions(), nullptr, true));
+        expect(manager.tasks().size() == 1);
+        uv_run(uv::defaultLoop(), UV_RUN_DEFAULT);
+        expect(manager.tasks().empty());
+
+        // Awaited installs bring in their dependencies through the scheduler
+        manager.remotePackages().tryAdd("lib", makePackage("lib", json::Value::array()));
+        manager.remotePackages().tryAdd("viewer", makePackage("viewer", json::Value::parse(R"(["lib"])")));
+        store("lib");
+        store("viewer");
+        auto job = installLater(manager, "viewer");
+        job.start();
+        expect(manager.getInstallTask("lib") != nullptr);
+        uv_run(uv::defaultLoop(), UV_RUN_DEFAULT);
+        expect(job.done());
+        auto task = job.get();
+        expect(task && task->success());
+        expect(manager.localPackages().get("lib")->isInstalled());
+        expect(manager.tasks().empty());
+
+        // A batch which fails part way leaves no tasks behind
+        manager.remotePackages().tryAdd("codec", makePackage("codec", json::Value::array()));
+        manager.remotePackages().tryAdd("player", makePackage("player", json::Value::parse(R"(["codec", "pending"])")));
+        manager.localPackages().tryAdd("pending", std::make_unique<pacm::LocalPackage>(*makePackage("pending", json::Value::array())));
+        bool threw = false;
+        try {
+            manager.installPackages({"player"}, pacm::InstallOptions(), nullptr, true);
+        } catch (std::exception&) {
+            threw = true;
+        }
+        expect(threw);
+        expect(manager.tasks().empty());
+        expect(!manager.getInstallTask("codec"));
+
+        // So does a dependency without an installable asset
+        json::Value legacyCodec = json::Value::parse(REMOTE_PACKAGE_JSON);
+        legacyCodec["id"] = "legacy-codec";
+        legacyCodec["name"] = "legacy-codec";
+        legacyCodec["assets"].erase(2); // SDK 2.0.0 assets only
+        manager.remotePackages().tryAdd("legacy-codec", std::make_unique<pacm::RemotePackage>(legacyCodec));
+        manager.remotePackages().tryAdd("recorder", makePackage("recorder", json::Value::parse(R"(["legacy-codec"])")));
+        pacm::InstallOptions sdk3;
+        sdk3.sdkVersion = "3.0.0";
+        threw = false;
+        try {
+            manager.installPackages({"recorder"}, sdk3, nullptr, true);
+        } catch (std::exception&) {
+            threw = true;
+        }
+        expect(threw);
+        expect(manager.tasks().empty());
+
+        std::filesystem::remove_all(root);
+    });
+
+    // =========================================================================
+    // Install Scheduler
+    //
+    describe("install scheduler", []() {
+        auto root = std::filesystem::temp_directory_path() / "pacm-scheduler-test";
+        std::filesystem::remove_all(root);
+
+        pacm::PackageManager::Options options(root.string());
+        options.contentStore = true;
+        options.maxConcurrentInstalls = 1;
+        pacm::PackageManager manager(options);
+        manager.createDirectories();
+
+        for (auto [id, size] : {std::pair<std::string, int>{"first", 100},
+                                {"large", 8192}, {"small", 512}, {"urgent", 65536}}) {
+            json::Value j = json::Value::parse(REMOTE_PACKAGE_JSON);
+            j["id"] = id;
+            j["name"] = id;
+            j["assets"][2]["file-size"] = size;
+            manager.remotePackages().tryAdd(id, std::make_unique<pacm::RemotePackage>(j));
+
+            std::string storeDir = manager.getPackageStoreDir(id, "2.0.0");
+            std::filesystem::create_directories(storeDir);
+            std::ofstream(storeDir + "/" + id + ".so") << id;
+            json::saveFile(storeDir + ".json", json::Value::array({id + ".so"}));
+        }
+
+        // With a single slot, tasks finish in the order they are started
+        StringVec order;
+        size_t maxRunning = 0;
+        manager.InstallTaskComplete += [&](const pacm::InstallTask& task) {
+            order.push_back(task.local()->id());
+            size_t running = 0;
+            for (const auto& other : manager.tasks()) {
+                if (!other->stateEquals(pacm::InstallationState::None))
+                    running++;
+            }
+            maxRunning = std::max(maxRunning, running);
+        };
+
+        // The first task takes the slot, then the rest queue by
+        // descending priority and then smallest asset
+        pacm::InstallOptions urgent;
+        urgent.priority = 10;
+        expect(manager.installPackages({"first"}));
+        expect(manager.installPackages({"large", "small"}));
+        expect(manager.installPackages({"urgent"}, urgent));
+        expect(manager.tasks().size() == 4);
+        uv_run(uv::defaultLoop(), UV_RUN_DEFAULT);
+
+        expect((order == StringVec{"first", "urgent", "small", "large"}));
+        expect(maxRunning == 1);
+        expect(manager.tasks().empty());
+
+        // A task which cannot be started still completes, as failed
+        json::Value j = json::Value::parse(REMOTE_PACKAGE_JSON);
+        j["id"] = "blocked";
+        j["name"] = "blocked";
+        manager.remotePackages().tryAdd("blocked", std::make_unique<pacm::RemotePackage>(j));
+        std::ofstream(root / "blocker") << "file";
+        pacm::InstallOptions blocked;
+        blocked.installDir = (root / "blocker" / "install").string();
+        auto job = installLater(manager, "blocked", blocked);
+        job.start();
+        expect(!job.done());
+        uv_run(uv::defaultLoop(), UV_RUN_DEFAULT);
+        expect(job.done());
+        auto task = job.get();
+        expect(task && task->failed());
+        expect(manager.localPackages().get("blocked")->state() == "Failed");
+        expect(manager.tasks().empty());
+
+        std::filesystem::remove_all(root);
+    });
+
+    // =========================================================================
+    // Package Snapshots
+    //
+    describe("package snapshots", []() {
+        json::Value j = json::Value::parse(REMOTE_PACKAGE_JSON);
+        auto root = std::filesystem::temp_directory_path() / "pacm-snapshot-test";
+        pacm::PackageManager manager(pacm::PackageManager::Options(root.string()));
+        expect(manager.snapshot()->local->empty());
+
+        manager.remotePackages().tryAdd("test-plugin", std::make_unique<pacm::RemotePackage>(j));
+        manager.localPackages().tryAdd("test-plugin", std::make_unique<pacm::LocalPackage>(j));
+        manager.localPackages().get("test-plugin")->manifest().addFile("lib/test-plugin.so");
+        json::Value other = j;
+        other["id"] = "other-plugin";
+        manager.localPackages().tryAdd("other-plugin", std::make_unique<pacm::LocalPackage>(other));
+        manager.publishSnapshot();
+
+        auto first = manager.snapshot();
+        expect(first->localPackage("test-plugin")->state() == "Installing");
+        expect(first->remotePackage("test-plugin") != nullptr);
+        expect(first->localPackage("missing") == nullptr);
+
+        // Publishing one package leaves older snapshots untouched and
+        // shares everything else
+        manager.localPackages().get("test-plugin")->setState("Installed");
+        manager.publishPackage("test-plugin");
+        auto second = manager.snapshot();
+        expect(second->version == first->version + 1);
+        expect(second->localPackage("test-plugin")->state() == "Installed");
+        expect(first->localPackage("test-plugin")->state() == "Installing");
+        expect(second->remote == first->remote);
+        expect(second->localPackage("other-plugin") == first->localPackage("other-plugin"));
+        expect(second->local->size() == 2);
+
+        // Manifests are published beside the package and shared while
+        // unchanged, as are remote packages when the index is re-read
+        expect(second->localManifest("test-plugin") == first->localManifest("test-plugin"));
+        expect(second->localManifest("test-plugin")->size() == 1);
+        expect(second->localPackage("test-plugin")->find("manifest") ==
+               second->localPackage("test-plugin")->end());
+        manager.localPackages().get("test-plugin")->manifest().addFile("lib/extra.so");
+        manager.publishPackage("test-plugin");
+        expect(manager.snapshot()->localManifest("test-plugin")->size() == 2);
+        expect(second->localManifest("test-plugin")->size() == 1);
+
+        auto remote = manager.snapshot()->remotePackage("test-plugin");
+        manager.remotePackages().erase("test-plugin");
+        manager.remotePackages().tryAdd("test-plugin", std::make_unique<pacm::RemotePackage>(j));
+        manager.publishSnapshot();
+        expect(manager.snapshot()->remotePackage("test-plugin") == remote);
+        second = manager.snapshot();
+
+        manager.localPackages().erase("test-plugin");
+        manager.publishPackage("test-plugin");
+        expect(manager.snapshot()->localPackage("test-plugin") == nullptr);
+        expect(second->localPackage("test-plugin") != nullptr);
+    });
+
+    // =========================================================================
+    // Memory Stats
+    //
+    describe("memory stats", []() {
+        json::Value j = json::Value::parse(REMOTE_PACKAGE_JSON);
+        auto root = std::filesystem::temp_directory_path() / "pacm-memory-test";
+        pacm::PackageManager manager(pacm::PackageManager::Options(root.string()));
+        expect(manager.memoryStats().totalBytes() == 0);
+
+        manager.remotePackages().tryAdd("test-plugin", std::make_unique<pacm::RemotePackage>(j));
+        auto* local = new pacm::LocalPackage(*manager.remotePackages().get("test-plugin"));
+        local->setState("Installed");
+        local->setInstalledAsset(manager.remotePackages().get("test-plugin")->latestAsset());
+        local->manifest().addFile("lib/test-plugin.so");
+        local->manifest().addFile("share/test-plugin/a-longer-resource-file-name.dat");
+        manager.localPackages().tryAdd("test-plugin", std::unique_ptr<pacm::LocalPackage>(local));
+
+        auto stats = manager.memoryStats();
+        expect(stats.remote.packages == 1);
+        expect(stats.remote.assets == 3);
+        expect(stats.remote.manifestEntries == 0);
+        expect(stats.local.packages == 1);
+        expect(stats.local.assets == 1);
+        expect(stats.local.manifestEntries == 2);
+        expect(stats.remote.domBytes > 0 && stats.remote.stringBytes > 0);
+        expect(stats.remote.assetBytes > 0);
+        expect(stats.remote.assetBytes < stats.remote.domBytes + stats.remote.stringBytes);
+        expect(stats.local.manifestBytes > 0);
+        expect(stats.snapshotBytes == 0);
+
+        // New metadata is accounted for
+        (*local)["capabilities-doc"] = std::string(1000, 'x');
+        expect(manager.memoryStats().local.stringBytes >= stats.local.stringBytes + 1000);
+
+        manager.publishSnapshot();
+        expect(manager.memoryStats().snapshotBytes > stats.totalBytes());
+    });
+
+    // =========================================================================
+    // Per-Package Locking
+    //
+    describe("concurrent package updates", []() {
+        json::Value j = json::Value::parse(REMOTE_PACKAGE_JSON);
+        pacm::RemotePackage remote(j);
+        pacm::LocalPackage package(remote);
+
+        // A task thread updates the package while another thread
+        // copies and reads it, as snapshot publishing does
+        std::thread writer([&]() {
+            for (int i = 0; i < 1000; i++) {
+                package.setInstallState(i % 2 ? "Extracting" : "Finalizing");
+                package.addError("error " + std::to_string(i));
+            }
+        });
+        size_t consistent = 0;
+        for (int i = 0; i < 1000; i++) {
+            pacm::LocalPackage copy(package);
+            if (copy.id() == "test-plugin" && copy.errors().is_array())
+                consistent++;
+        }
+        writer.join();
+
+        expect(package.errors().size() == 1000);
+        expect(package.lastError() == "error 999");
+        expect(consistent == 1000);
+    });
+
+    // =========================================================================
+    // Install Stats
+    //
+    describe("install stats", []() {
+        using Clock = pacm::InstallStats::Clock;
+        using std::chrono::seconds;
+
+        pacm::InstallStats stats;
+        stats.created = Clock::time_point(seconds(100));
+        stats.transitions.push_back({pacm::InstallationState::Downloading, Clock::time_point(seconds(101))});
+        stats.transitions.push_back({pacm::InstallationState::Extracting, Clock::time_point(seconds(105))});
+        stats.transitions.push_back({pacm::InstallationState::Finalizing, Clock::time_point(seconds(107))});
+        stats.transitions.push_back({pacm::InstallationState::Installed, Clock::time_point(seconds(108))});
+        stats.finished = Clock::time_point(seconds(110));
+        stats.bytesDownloaded = 4000;
+        stats.bytesWritten = 10000;
+
+        expect(stats.stateTime(pacm::InstallationState::Downloading) == seconds(4));
+        expect(stats.stateTime(pacm::InstallationState::Extracting) == seconds(2));
+        expect(stats.stateTime(pacm::InstallationState::Installed) == seconds(2));
+        expect(stats.stateTime(pacm::InstallationState::Failed) == seconds(0));
+        expect(stats.totalTime() == seconds(10));
+        expect(stats.downloadRate() == 1000);
+        expect(stats.extractRate() == 5000);
+    });
+
+    // =========================================================================
+    // Metrics
+    //
+    describe("metrics registry", []() {
+        pacm::MetricsRegistry metrics;
+        metrics.counter("pacm_test_total", "Test counter").inc(3);
+        metrics.counter("pacm_failures_total", "Failures", {{"stage", "Downloading"}}).inc();
+        metrics.gauge("pacm_tasks_active", "Active tasks").set(2);
+
+        auto& histogram = metrics.histogram("pacm_test_seconds", "Test durations", {0.1, 1});
+        histogram.observe(0.05);
+        histogram.observe(0.5);
+        histogram.observe(0.1);
+        histogram.observe(5);
+        expect(histogram.count() == 4);
+
+        // The same series is returned for the same name and labels
+        expect(&metrics.counter("pacm_test_total", "Test counter") ==
+               &metrics.counter("pacm_test_total", "Test counter"));
+        bool threw = false;
+        try {
+            metrics.gauge("pacm_test_total", "Wrong type");
+        } catch (std::logic_error&) {
+            threw = true;
+        }
+        expect(threw);
+
+        std::string text = metrics.toString();
+        expect(text.find("# TYPE pacm_test_total counter\npacm_test_total 3\n") != std::string::npos);
+        expect(text.find("pacm_failures_total{stage=\"Downloading\"} 1\n") != std::string::npos);
+        expect(text.find("pacm_tasks_active 2\n") != std::string::npos);
+        expect(text.find("pacm_test_seconds_bucket{le=\"0.1\"} 2\n") != std::string::npos);
+        expect(text.find("pacm_test_seconds_bucket{le=\"1\"} 3\n") != std::string::npos);
+        expect(text.find("pacm_test_seconds_bucket{le=\"+Inf\"} 4\n") != std::string::npos);
+        expect(text.find("pacm_test_seconds_sum 5.65\n") != std::string::npos);
+        expect(text.find("pacm_test_seconds_count 4\n") != std::string::npos);
+
+        auto path = std::filesystem::temp_directory_path() / "pacm-metrics-test.prom";
+        metrics.writeFile(path.string());
+        std::ifstream file(path);
+        std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        expect(content == text);
+        std::filesystem::remove(path);
+    });
+
+    // =========================================================================
+    // Tracer
+    //
+    describe("chrome trace output", []() {
+        pacm::Tracer tracer;
+        uint64_t lane = tracer.lane("install test-plugin");
+        {
+            pacm::Tracer::Span outer(&tracer, "outer", "test", lane);
+            pacm::Tracer::Span inner(&tracer, "inner", "test", lane);
+            inner.arg("bytes", 42);
+        }
+        std::thread([&]() { pacm::Tracer::Span span(&tracer, "worker", "test"); }).join();
+        {
+            pacm::Tracer::Span disabled(nullptr, "disabled", "test");
+            disabled.arg("ignored", true);
+        }
+        expect(tracer.size() == 3);
+
+        json::Value trace = tracer.toJson();
+        expect(trace["displayTimeUnit"] == "ms");
+        std::map<std::string, json::Value> spans;
+        std::map<uint64_t, std::string> lanes;
+        for (const auto& event : trace["traceEvents"]) {
+            if (event["ph"] == "X")
+                spans[event["name"].get<std::string>()] = event;
+            else if (event["name"] == "thread_name")
+                lanes[event["tid"].get<uint64_t>()] = event["args"]["name"].get<std::string>();
+        }
+        expect(spans.size() == 3);
+        expect(spans["inner"]["tid"] == lane);
+        expect(spans["inner"]["args"]["bytes"] == 42);
+        expect(spans["inner"]["ts"].get<double>() >= spans["outer"]["ts"].get<double>());
+        expect(spans["inner"]["dur"].get<double>() <= spans["outer"]["dur"].get<double>());
+        expect(lanes[lane] == "install test-plugin");
+        expect(spans["worker"]["tid"] != lane);
+        expect(lanes[spans["worker"]["tid"].get<uint64_t>()] == "thread 1");
+
+        tracer.clear();
+        expect(tracer.size() == 0);
+    });
+
+    // =========================================================================
+    // Install Task Cancellation
+    //
+    describe("install task cancellation", []() {
+        json::Value j = json::Value::parse(REMOTE_PACKAGE_JSON);
+        pacm::RemotePackage remote(j);
+        pacm::LocalPackage local(remote);
+
+        auto root = std::filesystem::temp_directory_path() / "pacm-cancel-test";
+        std::filesystem::remove_all(root);
+        auto partial = root / "partial";
+        std::filesystem::create_directories(partial);
+        std::ofstream(partial / "file.bin") << "partial";
+        {
+            pacm::PackageManager manager(pacm::PackageManager::Options(root.string()));
+            {
+                CancelProbe task(manager, &local, &remote);
+                task.addPartialPath(partial.string());
+                task.checkCancelled(); // no throw before cancel
+
+                task.cancel();
+                expect(task.cancelled());
+                auto stats = task.stats();
+                expect(stats.transitions.size() == 1);
+                expect(stats.transitions[0].state == pacm::InstallationState::Cancelled);
+                bool threw = false;
+                try {
+                    task.checkCancelled();
+                } catch (std::runtime_error&) {
+                    threw = true;
+                }
+                expect(threw);
+            } // releasing the task queues removal of its partial output
+        } // the worker pool finishes queued jobs when destroyed
+
+        expect(!std::filesystem::exists(partial));
+        std::filesystem::remove_all(root);
+    });
+
+    // =========================================================================
+    // Transactions
+    //
+    describe("transactions", []() {
+        json::Value j = json::Value::parse(REMOTE_PACKAGE_JSON);
+        pacm::RemotePackage remote(j);
+
+        auto root = std::filesystem::temp_directory_path() / "pacm-transaction-test";
+        std::filesystem::remove_all(root);
+        pacm::PackageManager manager(pacm::PackageManager::Options(root.string()));
+        manager.createDirectories();
+
+        auto installDir = root / "pacm" / "install";
+        auto pkg = std::make_unique<pacm::LocalPackage>(remote);
+        pkg->setInstallDir(installDir.string());
+        pkg->setState("Installed");
+        std::filesystem::create_directories(installDir);
+        std::ofstream(installDir / "plugin.so") << "x";
+        pkg->manifest().addFile("plugin.so");
+        manager.localPackages().tryAdd(pkg->id(), std::move(pkg));
+
+        // A package which cannot be installed rolls everything back,
+        // including the staged uninstall
+        auto failing = manager.beginTransaction();
+        failing->uninstall("test-plugin");
+        failing->install("missing-package");
+        failing->commit();
+        uv_run(uv::defaultLoop(), UV_RUN_DEFAULT);
+        expect(failing->state() == pacm::Transaction::State::RolledBack);
+        expect(failing->errors().size() == 1);
+        expect(manager.localPackages().contains("test-plugin"));
+        expect(std::filesystem::exists(installDir / "plugin.so"));
+
+        // Committing again is rejected
+        bool threw = false;
+        try {
+            failing->commit();
+        } catch (std::runtime_error&) {
+            threw = true;
+        }
+        expect(threw);
+
+        // So does a version which does not exist
+        auto missingVersion = manager.beginTransaction();
+        pacm::InstallOptions unknown;
+        unknown.version = "9.9.9";
+        missingVersion->uninstall("test-plugin");
+        missingVersion->install("test-plugin", unknown);
+        missingVersion->commit();
+        uv_run(uv::defaultLoop(), UV_RUN_DEFAULT);
+        expect(missingVersion->state() == pacm::Transaction::State::RolledBack);
+        expect(manager.localPackages().contains("test-plugin"));
+        expect(std::filesystem::exists(installDir / "plugin.so"));
+
+        // Uninstalls are applied once everything else is committed
+        auto committed = manager.beginTransaction();
+        committed->uninstall("test-plugin");
+        committed->commit();
+        uv_run(uv::defaultLoop(), UV_RUN_DEFAULT);
+        expect(committed->success());
+        expect(!manager.localPackages().contains("test-plugin"));
+        expect(!std::filesystem::exists(installDir / "plugin.so"));
+        std::filesystem::remove_all(root);
+
+        // A flat finalization which fails part way cannot be rolled back
+        pacm::PackageManager::Options storeOptions(root.string());
+        storeOptions.contentStore = true;
+        pacm::PackageManager storeManager(storeOptions);
+        storeManager.createDirectories();
+        storeManager.remotePackages().tryAdd("test-plugin", std::make_unique<pacm::RemotePackage>(j));
+
+        std::string storeDir = storeManager.getPackageStoreDir("test-plugin", "2.0.0");
+        std::filesystem::create_directories(storeDir + "/lib");
+        std::ofstream(storeDir + "/plugin.so") << "new";
+        std::ofstream(storeDir + "/lib/plugin.so") << "new";
+        json::saveFile(storeDir + ".json", json::Value::array({"plugin.so", "lib/", "lib/plugin.so"}));
+
+        auto installed = std::make_unique<pacm::LocalPackage>(remote);
+        installed->setInstallDir(installDir.string());
+        installed->setState("Installed");
+        std::filesystem::create_directories(installDir);
+        std::ofstream(installDir / "plugin.so") << "old";
+        std::ofstream(installDir / "lib") << "in the way";
+        installed->manifest().addFile("plugin.so");
+        storeManager.localPackages().tryAdd("test-plugin", std::move(installed));
+
+        auto partial = storeManager.beginTransaction();
+        partial->update("test-plugin");
+        partial->commit();
+        uv_run(uv::defaultLoop(), UV_RUN_DEFAULT);
+        expect(partial->state() == pacm::Transaction::State::Failed);
+        expect(partial->complete());
+        expect(!partial->success());
+        expect(!partial->errors().empty());
+        expect(storeManager.localPackages().get("test-plugin")->state() == "Failed");
+        std::filesystem::remove_all(root);
+
+        // Staged packages go through the scheduler, and a held package
+        // does not block the rest of its transaction from staging
+        pacm::PackageManager::Options limitOptions(root.string());
+        limitOptions.contentStore = true;
+        limitOptions.maxConcurrentInstalls = 1;
+        pacm::PackageManager limited(limitOptions);
+        limited.createDirectories();
+        for (const std::string id : {"alpha", "beta"}) {
+            json::Value package = j;
+            package["id"] = id;
+            package["name"] = id;
+            limited.remotePackages().tryAdd(id, std::make_unique<pacm::RemotePackage>(package));
+            std::string dir = limited.getPackageStoreDir(id, "2.0.0");
+            std::filesystem::create_directories(dir);
+            std::ofstream(dir + "/" + id + ".so") << id;
+            json::saveFile(dir + ".json", json::Value::array({id + ".so"}));
+        }
+
+        auto both = limited.beginTransaction();
+        both->install("alpha");
+        both->install("beta");
+        both->commit();
+        expect(limited.tasks().size() == 2);
+        uv_run(uv::defaultLoop(), UV_RUN_DEFAULT);
+        expect(both->success());
+        expect(limited.localPackages().get("alpha")->isInstalled());
+        expect(limited.localPackages().get("beta")->isInstalled());
+        expect(limited.tasks().empty());
+
+        std::filesystem::remove_all(root);
+    });
+
+    // =========================================================================
+    // Coroutine API
+    //
+    describe("coroutine api", []() {
+        auto sum = sumTwice(1, 2);
+        expect(!sum.done());
+        sum.start();
+        expect(sum.done());
+        expect(sum.get() == 6);
+
+        auto failing = failLater();
+        failing.start();
+        bool threw = false;
+        try {
+            failing.get();
+        } catch (std::runtime_error&) {
+            threw = true;
+        }
+        expect(threw);
+
+        // Awaiting an uninstall resumes from the loop, not from the signal
+        json::Value j = json::Value::parse(REMOTE_PACKAGE_JSON);
+        pacm::RemotePackage remote(j);
+
+        auto root = std::filesystem::temp_directory_path() / "pacm-coroutine-test";
+        std::filesystem::remove_all(root);
+        pacm::PackageManager manager(pacm::PackageManager::Options(root.string()));
+        manager.createDirectories();
+
+        auto installDir = root / "pacm" / "install";
+        auto pkg = std::make_unique<pacm::LocalPackage>(remote);
+        pkg->setInstallDir(installDir.string());
+        pkg->setState("Installed");
+        std::filesystem::create_directories(installDir / "lib");
+        std::ofstream(installDir / "lib" / "plugin.so") << "x";
+        pkg->manifest().addFile("lib/plugin.so");
+        manager.localPackages().tryAdd(pkg->id(), std::move(pkg));
+
+        uv_loop_t loop;
+        uv_loop_init(&loop);
+        auto job = uninstallLater(manager, {"test-plugin"}, &loop);
+        job.start();
+        expect(!job.done());
+
+        // A failing batch for the same package does not resume the awaiter
+        bool duplicateDone = false;
+        manager.uninstallPackagesAsync({"test-plugin"}, &loop,
+                                       [&](const pacm::UninstallResult& r) {
+                                           expect(r.failed == StringVec({"test-plugin"}));
+                                           duplicateDone = true;
+                                       });
+        uv_run(&loop, UV_RUN_DEFAULT);
+        expect(job.done());
+        expect(duplicateDone);
+
+        auto result = job.get();
+        expect(result.success());
+        expect(result.filesRemoved == 1);
+        expect(!manager.localPackages().contains("test-plugin"));
+        uv_loop_close(&loop);
+
+        std::filesystem::remove_all(root);
+    });
+
     // =========================================================================
     // InstallationState Strings
     //